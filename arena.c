@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "tools.h"
+
+struct arena_block {
+	struct arena_block * next;
+	size_t size;
+	size_t used;
+	/* data follows, aligned */
+};
+
+#define BLOCK_HEADER ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void * block_alloc (struct arena * a, size_t size)
+{
+	struct arena_block * b = a->extra;
+	char * p;
+
+	if (!b || b->size - b->used < size) {
+		size_t bsize = (size > a->size) ? size : a->size;
+		b = xmalloc(BLOCK_HEADER + bsize);
+		b->size = bsize;
+		b->used = 0;
+		b->next = a->extra;
+		a->extra = b;
+	}
+	p = (char *)b + BLOCK_HEADER + b->used;
+	b->used += size;
+	return p;
+}
+
+void * arena_alloc (struct arena * a, size_t size)
+{
+	void * p;
+
+	size = ALIGN_UP(size ? size : 1);
+	if (!a->base) {
+		a->size = (size > ARENA_DEFAULT_SIZE) ? ALIGN_UP(size) : ARENA_DEFAULT_SIZE;
+		a->base = xmalloc(a->size);
+		a->used = 0;
+	}
+
+	if (!a->extra && a->size - a->used >= size) {
+		p = a->base + a->used;
+		a->used += size;
+	} else {
+		/* used keeps counting, for resizing at reset */
+		p = block_alloc(a, size);
+		a->used += size;
+	}
+	return p;
+}
+
+char * arena_strndup (struct arena * a, char const * s, size_t len)
+{
+	char * p = arena_alloc(a, len + 1);
+	memcpy(p, s, len);
+	p[len] = 0;
+	return p;
+}
+
+static void free_extra (struct arena * a)
+{
+	while (a->extra) {
+		struct arena_block * b = a->extra;
+		a->extra = b->next;
+		free(b);
+	}
+}
+
+void arena_reset (struct arena * a)
+{
+	if (a->extra) {
+		free_extra(a);
+		/* next time, everything fits in one block */
+		free(a->base);
+		a->size = ALIGN_UP(a->used + a->used / 2);
+		a->base = xmalloc(a->size);
+	}
+	a->used = 0;
+}
+
+void arena_free (struct arena * a)
+{
+	free_extra(a);
+	free(a->base);
+	a->base = NULL;
+	a->size = a->used = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef ARENA__H__
+#define ARENA__H__
+
+#include <stddef.h>
+
+/* Bump allocator for short-lived memory.
+ *
+ * Allocations are carved out of one block and never freed individually;
+ * arena_reset() releases all of them at once. When the block runs out,
+ * overflow blocks are malloc'd and chained. On reset they are freed and
+ * the main block grows to the high-water mark, so an arena that is reset
+ * after every command settles into doing no mallocs at all.
+ *
+ * Memory is not zeroed. Allocation failure is fatal, like in xmalloc. */
+
+#define ARENA_ALIGN 16
+#define ARENA_DEFAULT_SIZE (64 * 1024)
+
+struct arena_block;
+
+struct arena {
+	char * base;
+	size_t size;
+	size_t used;	/* including overflow blocks */
+	struct arena_block * extra;
+};
+
+#define ARENA_INIT { NULL, 0, 0, NULL }
+
+/* allocate size bytes, aligned to ARENA_ALIGN */
+void * arena_alloc (struct arena * a, size_t size);
+
+/* copy of the first len bytes of s, NUL-terminated */
+char * arena_strndup (struct arena * a, char const * s, size_t len);
+
+/* release everything allocated from the arena */
+void arena_reset (struct arena * a);
+
+/* release everything, including the main block */
+void arena_free (struct arena * a);
+
+#endif
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "attrcache.h"
+#include "log.h"
+#include "tools.h"
+
+struct attr_entry {
+	struct attr_entry * next_hash;
+	/* all entries in order of insertion, the oldest is evicted first */
+	struct attr_entry * prev, * next;
+	uint64_t expires;
+	uint32_t hash;
+	struct stat st;
+	int len;
+	char key[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct attr_entry ** buckets;
+static unsigned mask;
+static struct attr_entry * oldest, * newest;
+static int count, max_count;
+static uint64_t attr_ttl;
+static unsigned long hits, misses;
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint32_t key_hash (char const * key, int len)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void attr_cache_init (double attr_timeout, int max_entries)
+{
+	unsigned size = 64;
+	while (size < max_entries) size *= 2;
+	buckets = xcalloc(size * sizeof(struct attr_entry *));
+	mask = size - 1;
+	max_count = max_entries;
+	attr_ttl = attr_timeout > 0 ? attr_timeout * 1e9 : 0;
+}
+
+/* call with lock held */
+static struct attr_entry ** find (char const * key, int len, uint32_t hash)
+{
+	struct attr_entry ** e = buckets + (hash & mask);
+	for (; *e; e = &(*e)->next_hash) {
+		if ((*e)->hash == hash && (*e)->len == len && !memcmp((*e)->key, key, len))
+			break;
+	}
+	return e;
+}
+
+/* unlinks *e from its hash chain and the expiry list, and frees it */
+static void remove_entry (struct attr_entry ** e)
+{
+	struct attr_entry * x = *e;
+	*e = x->next_hash;
+	if (x->prev) x->prev->next = x->next;
+	else oldest = x->next;
+	if (x->next) x->next->prev = x->prev;
+	else newest = x->prev;
+	count--;
+	free(x);
+}
+
+int attr_cache_get (char const * key, struct stat * st)
+{
+	int len = strlen(key);
+	uint32_t hash = key_hash(key, len);
+	struct attr_entry ** e;
+	int res = 1;
+
+	if (!buckets) return 1;
+	pthread_mutex_lock(&lock);
+	e = find(key, len, hash);
+	if (*e && (*e)->expires <= now_ns()) remove_entry(e);
+	if (*e) {
+		*st = (*e)->st;
+		res = 0;
+		hits++;
+	} else {
+		misses++;
+	}
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+void attr_cache_put (char const * key, int len, struct stat const * st)
+{
+	uint32_t hash = key_hash(key, len);
+	struct attr_entry ** e, * x;
+
+	if (!buckets || !attr_ttl) return;
+	pthread_mutex_lock(&lock);
+	e = find(key, len, hash);
+	if (*e) remove_entry(e);
+	while (count >= max_count) {
+		struct attr_entry * victim = oldest;
+		remove_entry(find(victim->key, victim->len, victim->hash));
+	}
+
+	x = xmalloc(sizeof(struct attr_entry) + len + 1);
+	memcpy(x->key, key, len);
+	x->key[len] = 0;
+	x->len = len;
+	x->hash = hash;
+	x->st = *st;
+	x->expires = now_ns() + attr_ttl;
+
+	e = buckets + (hash & mask);
+	x->next_hash = *e;
+	*e = x;
+	x->next = NULL;
+	x->prev = newest;
+	if (newest) newest->next = x;
+	else oldest = x;
+	newest = x;
+	count++;
+	pthread_mutex_unlock(&lock);
+}
+
+void attr_cache_drop (char const * key)
+{
+	int len = strlen(key);
+	uint32_t hash = key_hash(key, len);
+	struct attr_entry ** e;
+
+	if (!buckets) return;
+	pthread_mutex_lock(&lock);
+	e = find(key, len, hash);
+	if (*e) remove_entry(e);
+	pthread_mutex_unlock(&lock);
+}
+
+void attr_cache_report ()
+{
+	pthread_mutex_lock(&lock);
+	logp("attribute cache: %lu hits, %lu misses, %d entries", hits, misses, count);
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,28 @@
+#ifndef ATTRCACHE__H__
+#define ATTRCACHE__H__
+
+#include <sys/stat.h>
+
+/* Attribute cache of newfs.
+ *
+ * Maps keys naming a file (its directory's inode and its name) to the
+ * file's attributes, each valid for attr_timeout. Entries come from STAT
+ * replies and directory listings, and are dropped when our own operations
+ * change the file.
+ *
+ * The cache holds at most max_entries; when full, the entry that expires
+ * first goes. All functions are thread-safe. A timeout of 0 disables
+ * the cache. */
+
+void attr_cache_init (double attr_timeout, int max_entries);
+
+/* returns 0 and fills st on a hit, 1 on miss */
+int attr_cache_get (char const * key, struct stat * st);
+
+void attr_cache_put (char const * key, int len, struct stat const * st);
+void attr_cache_drop (char const * key);
+
+/* log hit/miss counts */
+void attr_cache_report ();
+
+#endif
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Loopback benchmark suite: starts bench-server on a scratch share and
+# runs loopbench against it, printing a JSON array of its results.
+#
+# usage: ./bench.sh [loopbench options] [workload...]
+#   without arguments, runs every workload with 32 KB transfers at depths
+#   1 and 16, and with 4 KB transfers at depth 16.
+#
+#   BENCH_PORT - port of the server (default 63988)
+#   BENCH_TIME - seconds per workload (default 3)
+#
+# Each result is labelled with the commit it was built from, so runs of
+# different commits can be compared. Build with `make bench`, which
+# builds both programs with optimizations.
+
+DIR=$(dirname "$0")
+PORT=${BENCH_PORT:-63988}
+TIME=${BENCH_TIME:-3}
+LABEL=$(git -C "$DIR" describe --always --dirty 2>/dev/null)
+SHARE=$(mktemp -d)
+
+"$DIR/bench-server" -P "$PORT" -rw "$SHARE=bench" > "$SHARE.log" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$SHARE" "$SHARE.log"' EXIT
+sleep 1
+
+run () {
+	"$DIR/loopbench" -P "$PORT" -t "$TIME" -l "$LABEL" "$@" localhost bench || exit 1
+}
+
+echo "["
+if [ $# -gt 0 ]; then
+	# options go before the host, workloads after the share
+	opts=""
+	while [ $# -gt 0 ] && [ "${1#-}" != "$1" ]; do
+		opts="$opts $1 $2"
+		shift 2
+	done
+	"$DIR/loopbench" -P "$PORT" -t "$TIME" -l "$LABEL" $opts localhost bench "$@" || exit 1
+else
+	run -d 1 -s 32768
+	echo ","
+	run -d 16 -s 32768
+	echo ","
+	run -d 16 -s 4096
+fi
+echo "]"
@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "commands.h"
+#include "common.h"
+#include "log.h"
+#include "structs.h"
+#include "tools.h"
+
+#define HEADER_LEN (sizeof(CAPTURE_MAGIC) - 1 + 2 + 8)
+#define RECORD_LEN (8 + 4 + SIZEOF_command() + 1 + 2)
+
+static int fd = -1;
+static int flags;
+static uint64_t started;
+static char * buf;
+static int buffered;
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_out ()
+{
+	int res, done = 0;
+
+	while (done < buffered) {
+		RETRY1(res, write(fd, buf + done, buffered - done));
+		if (res == -1) {
+			errp("capture stopped: %s", strerror(errno));
+			close(fd);
+			fd = -1;
+			break;
+		}
+		done += res;
+	}
+	buffered = 0;
+}
+
+int capture_open (char const * dir, int capture_flags)
+{
+	char name[PATH_MAX];
+	struct timeval tv;
+	uint64_t wall;
+
+	gettimeofday(&tv, NULL);
+	wall = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	snprintf(name, sizeof(name), "%s/%llu-%d.cap", dir, (unsigned long long)tv.tv_sec, (int)getpid());
+	RETRY1(fd, open(name, O_WRONLY | O_CREAT | O_EXCL, 0600));
+	if (fd == -1) {
+		errp("can't create capture %s: %s", name, strerror(errno));
+		return -1;
+	}
+	logp("capturing commands to %s", name);
+
+	flags = capture_flags;
+	started = now_ns();
+	if (!buf) buf = xmalloc(CAPTURE_BUFFER);
+	memcpy(buf, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+	buffered = sizeof(CAPTURE_MAGIC) - 1;
+	buffered += pack(buf + buffered, "ccl", (uint8_t)CAPTURE_VERSION, (uint8_t)flags, wall);
+	return 0;
+}
+
+void capture_command (struct command const * cmd, char const * payload,
+	uint64_t received, uint64_t service_ns, int result)
+{
+	int kept = 0;
+
+	if (fd == -1) return;
+	if (flags & CAPTURE_PAYLOADS) {
+		kept = cmd->length;
+		/* just the offset */
+		if (cmd->command == CMD_WRITE && kept > 8) kept = 8;
+	}
+	if (buffered + RECORD_LEN + kept > CAPTURE_BUFFER) write_out();
+	if (fd == -1) return;
+
+	buffered += pack(buf + buffered, "li", received - started,
+		(uint32_t)(service_ns > UINT32_MAX ? UINT32_MAX : service_ns));
+	buffered += pack_command(buf + buffered, cmd);
+	buffered += pack(buf + buffered, "cs", (uint8_t)(result < 0 ? CAPTURE_DEFERRED : result), (uint16_t)kept);
+	memcpy(buf + buffered, payload, kept);
+	buffered += kept;
+}
+
+void capture_close ()
+{
+	if (fd == -1) return;
+	write_out();
+	if (fd != -1) close(fd);
+	fd = -1;
+}
+
+/**** reading ****/
+
+int capture_reader_open (struct capture_reader * r, char const * name)
+{
+	char header[HEADER_LEN];
+	uint8_t version, f;
+
+	r->f = fopen(name, "rb");
+	if (!r->f) return -1;
+	if (fread(header, HEADER_LEN, 1, r->f) != 1 ||
+		memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1)) goto bad;
+	unpack(header + sizeof(CAPTURE_MAGIC) - 1, 10, "ccl", &version, &f, &r->started);
+	if (version != CAPTURE_VERSION) goto bad;
+	r->flags = f;
+	return 0;
+bad:
+	fclose(r->f);
+	r->f = NULL;
+	errno = EINVAL;
+	return -1;
+}
+
+int capture_read (struct capture_reader * r, struct capture_record * rec, char * payload)
+{
+	char header[RECORD_LEN];
+	size_t got = fread(header, 1, RECORD_LEN, r->f);
+	int pos;
+
+	/* a session killed mid-write leaves a partial record */
+	if (got < RECORD_LEN) return got ? -1 : 0;
+	pos = unpack(header, RECORD_LEN, "li", &rec->received, &rec->service);
+	pos += unpack_command(header + pos, RECORD_LEN - pos, &rec->cmd);
+	unpack(header + pos, RECORD_LEN - pos, "cs", &rec->result, &rec->kept);
+	if (rec->kept > rec->cmd.length) return -1;
+
+	if (rec->kept && fread(payload, rec->kept, 1, r->f) != 1) return -1;
+	memset(payload + rec->kept, 0, rec->cmd.length - rec->kept);
+	return 1;
+}
+
+void capture_reader_close (struct capture_reader * r)
+{
+	if (r->f) fclose(r->f);
+	r->f = NULL;
+}
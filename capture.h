@@ -0,0 +1,70 @@
+#ifndef CAPTURE__H__
+#define CAPTURE__H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "structs.h"
+
+/* Capture of the command stream, for replay.
+ *
+ * With -C, every session writes the commands it receives, as they are
+ * after decryption, to <dir>/<time>-<pid>.cap. The file starts with
+ * CAPTURE_MAGIC, a version byte, a flags byte and the wall-clock time
+ * of the session start in microseconds. Then each command is a record:
+ *   uint64 received  - ns since the session started
+ *   uint32 service   - ns spent handling it and sending the reply
+ *   command header   - as received
+ *   uint8  result    - status of the reply, CAPTURE_DEFERRED if held back
+ *   uint16 kept      - how many bytes of the payload follow
+ * all in network byte order, as on the wire. Without CAPTURE_PAYLOADS no
+ * payload is kept, only its length in the header; with it, payloads are
+ * kept except for the data of WRITEs, which replays as zeros.
+ *
+ * Records are buffered and written out in CAPTURE_BUFFER blocks, so
+ * capturing costs a copy per command. If writing fails, the session goes
+ * on without capture. */
+
+#define CAPTURE_MAGIC "NTPCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER (256 * 1024)
+
+/* flags */
+#define CAPTURE_PAYLOADS 0x01
+
+#define CAPTURE_DEFERRED 0xff
+
+struct capture_record {
+	uint64_t received;
+	uint32_t service;
+	struct command cmd;
+	uint8_t result;
+	uint16_t kept;
+};
+
+/* starts capturing this session into a new file in dir.
+ * returns 0, or -1 if the file can't be created */
+int capture_open (char const * dir, int flags);
+/* records a command and its payload, cmd->length bytes. received is
+ * the CLOCK_MONOTONIC time in ns, result -1 if the reply was deferred */
+void capture_command (struct command const * cmd, char const * payload,
+	uint64_t received, uint64_t service_ns, int result);
+/* writes out the buffer and closes the file */
+void capture_close ();
+
+/* reading captures */
+struct capture_reader {
+	FILE * f;
+	int flags;
+	uint64_t started;	/* wall-clock, in microseconds */
+};
+
+/* returns 0, or -1 if the file can't be opened or is not a capture */
+int capture_reader_open (struct capture_reader * r, char const * name);
+/* reads the next record, and its payload into payload (which must hold
+ * MAX_LENGTH bytes), padded with zeros to cmd.length.
+ * returns 1, 0 at the end of the capture, or -1 if it is damaged */
+int capture_read (struct capture_reader * r, struct capture_record * rec, char * payload);
+void capture_reader_close (struct capture_reader * r);
+
+#endif
@@ -1,8 +1,10 @@
 #include <assert.h>
 #include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <locale.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,21 +17,17 @@
 #include <gnutls/gnutls.h>
 #include <gsasl.h>
 
-#include "clientops.h"
 #include "commands.h"
 #include "common.h"
+#include "journal.h"
+#include "libnewtp.h"
 #include "log.h"
 #include "structs.h"
 #include "tools.h"
 
-#define MYPORT "63987"
-/* NEWTP on a phone */
-
-void send_empty_command(int id, int command, int handle)
-{
-	pack_command_p(outbuf, id, 0, command, handle, 0);
-	safe_send_full(outbuf, SIZEOF_command());
-}
+static struct newtp_conn * conn;
+static char * hostname;
+static Gsasl * ctx;
 
 #define ATTRIBUTES  "\x01\x06\x10\x02\x13"
 #define ATTR_LEN    strlen(ATTRIBUTES)
@@ -53,9 +51,9 @@ void print_listing (char * data, int len)
 
 	while (items && pos < len) {
 		char parms[3] = "---";
-		if (unpack_dir_entry(data + pos, len - pos, &entry) == -1) {
-			fprintf(stderr, "malformed entry in directory listing, attempting to skip\n");
-			continue;
+		if (unpack_dir_entry_view(data + pos, len - pos, &entry) == -1) {
+			fprintf(stderr, "malformed entry in directory listing\n");
+			break;
 		}
 		assert(entry.attr_len == ATTR_LIST_SIZE);
 		unpack(entry.attr, entry.attr_len, ATTR_FORMAT, &rights, &mtime, &type, &size, &uid);
@@ -78,27 +76,31 @@ void print_listing (char * data, int len)
 			entry.name_len, entry.name);
 
 		pos += SIZEOF_dir_entry(&entry);
-		free(entry.name);
-		free(entry.attr);
 		items--;
 	}
 	assert(pos <= len);
 }
 
-void do_assign (char * path, int handle)
+/* runs command with the given payload and returns its result */
+static int run_on (struct newtp_conn * c, uint8_t command, uint16_t handle, char const * payload, int len)
 {
-	struct reply reply;
-	int len = strlen(path);
+	struct newtp_req * r = newtp_req_new(c, command, handle);
+	int res;
 
-	pack_command_p(inbuf, 1, 0, CMD_ASSIGN, handle, len);
-	strncpy(inbuf + SIZEOF_command(), path, len);
-	safe_send_full(inbuf, SIZEOF_command() + len);
+	if (len) memcpy(newtp_req_payload(r, len), payload, len);
+	res = newtp_run(r);
+	newtp_req_free(r);
+	return res;
+}
 
-	recv_reply(&reply);
-	assert(reply.request_id == 1);
-	if (reply.length > 0) safe_skip_data(reply.length);
+int assign_on (struct newtp_conn * c, char * path, int handle)
+{
+	return run_on(c, CMD_ASSIGN, handle, path, strlen(path));
+}
 
-	if (reply.result != STAT_OK) {
+void do_assign (char * path, int handle)
+{
+	if (assign_on(conn, path, handle) != STAT_OK) {
 		fprintf(stderr, "failed to assign handle\n");
 		exit(1);
 	}
@@ -106,128 +108,1206 @@ void do_assign (char * path, int handle)
 
 void do_list (char * path)
 {
-	struct reply reply;
-	int id = 2;
-	int end = 0;
+	struct newtp_req * rewind, * r;
+	int res;
 
 	do_assign(path, 1);
-	send_empty_command(2, CMD_REWINDDIR, 1);
 
-	pack_command_p(outbuf, ++id, 0, CMD_READDIR, 1, ATTR_LEN);
-	strcpy(outbuf + SIZEOF_command(), ATTRIBUTES);
-	safe_send_full(outbuf, SIZEOF_command() + ATTR_LEN);
+	/* the rewind goes out together with the first READDIR */
+	rewind = newtp_req_new(conn, CMD_REWINDDIR, 1);
+	newtp_submit(rewind, NULL, NULL);
 
-	/* read the REWINDDIR reply packet */
-	recv_reply(&reply);
-	assert(reply.request_id == 2);
-	assert(reply.result == STAT_OK);
-
-	/* start reading entries */
+	r = newtp_req_new(conn, CMD_READDIR, 1);
+	memcpy(newtp_req_payload(r, ATTR_LEN), ATTRIBUTES, ATTR_LEN);
 	do {
-		recv_reply(&reply);
-		assert(reply.request_id == id);
-		switch (reply.result) {
-			case STAT_FINISHED:
-				end = 1;
-			case STAT_CONTINUED:
-				print_listing(inbuf + SIZEOF_reply(), reply.length);
-				if (!end) {
-					pack_command_p(outbuf, ++id, 0, CMD_READDIR, 1, ATTR_LEN);
-					safe_send_full(outbuf, SIZEOF_command() + ATTR_LEN);
-				}
-				break;
-			default:
-				fprintf(stderr, "listing '%s' failed: %d\n", path, reply.result);
+		res = newtp_run(r);
+		if (rewind) {
+			if (newtp_wait(rewind) != STAT_OK) res = rewind->reply.result;
+			newtp_req_free(rewind);
+			rewind = NULL;
+		}
+		if (res != STAT_CONTINUED && res != STAT_FINISHED) {
+			fprintf(stderr, "listing '%s' failed: %d\n", path, res);
+			exit(1);
+		}
+		print_listing(r->data, r->reply.length);
+	} while (res != STAT_FINISHED);
+	newtp_req_free(r);
+}
+
+/* size and mtime of the file on handle. returns the result of the STAT */
+static int stat_size_mtime (struct newtp_conn * c, uint16_t handle, uint64_t * size, uint64_t * mtime)
+{
+	static char const query[] = { ATTR_SIZE, ATTR_MTIME };
+	struct newtp_req * r = newtp_req_new(c, CMD_STAT, handle);
+	int res;
+
+	memcpy(newtp_req_payload(r, sizeof(query)), query, sizeof(query));
+	res = newtp_run(r);
+	if (res == STAT_OK) {
+		if (r->reply.length < 16) res = ERR_FAIL;
+		else unpack(r->data, r->reply.length, "ll", size, mtime);
+	}
+	newtp_req_free(r);
+	return res;
+}
+
+/* asks for the hash of [offset, offset + len) of the file on handle */
+static struct newtp_req * submit_hash (struct newtp_conn * c, uint16_t handle, uint64_t offset, uint64_t len)
+{
+	struct newtp_req * r = newtp_req_new(c, CMD_HASH, handle);
+	pack(newtp_req_payload(r, 16), "ll", offset, len);
+	newtp_submit(r, NULL, NULL);
+	return r;
+}
+
+/* whether the HASH r found all len bytes, hashing to digest. frees r */
+static int hash_matches (struct newtp_req * r, uint64_t len, unsigned char const * digest)
+{
+	uint64_t done;
+	int match = newtp_wait(r) == STAT_OK && r->reply.length == 8 + HASH_SIZE;
+
+	if (match) {
+		unpack(r->data, r->reply.length, "l", &done);
+		match = done == len && !memcmp(r->data + 8, digest, HASH_SIZE);
+	}
+	newtp_req_free(r);
+	return match;
+}
+
+/* where a transfer between fd and the file on handle can continue, given
+ * limit bytes present on both sides. the last range of the journal is
+ * checked again against both copies, as an interruption may have left
+ * it damaged, and then data past the journal is compared range by range,
+ * so a partial copy without a journal is kept as far as it is right.
+ * leaves the journal hashing from the returned offset */
+static uint64_t resume_point (struct newtp_conn * c, uint16_t handle, struct journal * j, int fd, uint64_t limit)
+{
+	unsigned char digest[HASH_SIZE];
+
+	while (j->count) {
+		struct journal_range * last = j->ranges + j->count - 1;
+		uint64_t start = (j->count > 1) ? last[-1].end : 0;
+
+		if (last->end <= limit) {
+			struct newtp_req * r = submit_hash(c, handle, start, last->end - start);
+			int local = !hash_file_range(fd, start, last->end - start, digest) &&
+				!memcmp(digest, last->digest, HASH_SIZE);
+			if (hash_matches(r, last->end - start, last->digest) && local) break;
+		}
+		journal_truncate(j, j->count - 1);
+	}
+
+	for (;;) {
+		uint64_t start = journal_end(j);
+		uint64_t end = (start / JOURNAL_RANGE + 1) * JOURNAL_RANGE;
+		struct newtp_req * r;
+
+		if (end > j->size) end = j->size;
+		if (start >= end || end > limit) break;
+
+		/* the server hashes its copy while we hash ours */
+		r = submit_hash(c, handle, start, end - start);
+		if (journal_hash_file(j, fd, end) != 1) {
+			hash_matches(r, 0, digest);
+			journal_truncate(j, j->count);
+			break;
+		}
+		if (!hash_matches(r, end - start, j->ranges[j->count - 1].digest)) {
+			journal_truncate(j, j->count - 1);
+			break;
+		}
+		journal_commit(j);
+	}
+	return journal_end(j);
+}
+
+/* READs or WRITEs kept in flight by get and put: the window follows
+ * twice the estimated bandwidth-delay product, within these bounds */
+#define PIPE_MIN_WINDOW   2
+#define PIPE_START_WINDOW 8
+#define PIPE_MAX_WINDOW   1024
+/* chunks waiting for the local file */
+#define PIPE_QUEUE        256
+
+/* grows the window by a request per reply while below the target,
+ * which doubles it every round trip, and shrinks it slowly when well
+ * above */
+static int adjust_window (int window, struct newtp_estimate const * est)
+{
+	double target = 2 * newtp_estimate_bdp(est) / MAX_LENGTH;
+
+	if (!target || window < target) window++;
+	else if (window > 2 * target) window--;
+	if (window < PIPE_MIN_WINDOW) window = PIPE_MIN_WINDOW;
+	if (window > PIPE_MAX_WINDOW) window = PIPE_MAX_WINDOW;
+	return window;
+}
+
+/* writes replies out to the local file on its own thread, so reception
+ * doesn't stop while the disk is busy. ranges of the journal are
+ * committed as they reach the disk */
+struct file_sink {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct newtp_req * queue[PIPE_QUEUE];
+	int head, count;
+	int closed;
+
+	int fd;
+	char * name;
+	struct journal * journal;
+};
+
+static void * sink_thread (void * arg)
+{
+	struct file_sink * s = arg;
+
+	for (;;) {
+		struct newtp_req * r;
+		int l = 0, completed;
+
+		pthread_mutex_lock(&s->lock);
+		while (!s->count && !s->closed) pthread_cond_wait(&s->cond, &s->lock);
+		if (!s->count) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		r = s->queue[s->head];
+		pthread_mutex_unlock(&s->lock);
+
+		while (l < r->reply.length) {
+			int w = write(s->fd, r->data + l, r->reply.length - l);
+			if (w <= 0) {
+				if (errno == EINTR) continue;
+				fprintf(stderr, "failed to write to %s: %s\n", s->name, strerror(errno));
 				exit(1);
+			}
+			l += w;
 		}
-	} while (!end);
+		completed = journal_hash(s->journal, r->data, r->reply.length);
+		if (completed && fdatasync(s->fd) == 0)
+			while (completed--) journal_commit(s->journal);
+		newtp_req_free(r);
+
+		/* the slot is freed only now, which bounds the replies held */
+		pthread_mutex_lock(&s->lock);
+		s->head = (s->head + 1) % PIPE_QUEUE;
+		s->count--;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
 }
 
+static void sink_start (struct file_sink * s, int fd, char * name, struct journal * journal)
+{
+	memset(s, 0, sizeof(struct file_sink));
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->fd = fd;
+	s->name = name;
+	s->journal = journal;
+	if (pthread_create(&s->thread, NULL, sink_thread, s)) {
+		fprintf(stderr, "failed to start writer thread\n");
+		exit(1);
+	}
+}
+
+/* hands the reply of r over to be written and freed */
+static void sink_push (struct file_sink * s, struct newtp_req * r)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->count == PIPE_QUEUE) pthread_cond_wait(&s->cond, &s->lock);
+	s->queue[(s->head + s->count) % PIPE_QUEUE] = r;
+	s->count++;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* waits until everything is written */
+static void sink_finish (struct file_sink * s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->closed = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+}
+
+static struct newtp_req * submit_read (uint64_t ofs)
+{
+	struct newtp_req * r = newtp_req_new(conn, CMD_READ, 1);
+	pack_params_offlen_p(newtp_req_payload(r, SIZEOF_params_offlen()), ofs, MAX_LENGTH);
+	newtp_submit(r, NULL, NULL);
+	return r;
+}
+
+/* downloads path to target, continuing from what a journal and a
+ * comparison of hashes show to be there already */
 void do_get (char * path, char * target, int overwrite)
 {
-	struct reply reply;
-	char * buf = outbuf;
-	int id = 2, rid = 1;
-	long ofs = 0;
-	int fd;
-	const int len = MAX_LENGTH;
+	static struct newtp_req * reads[PIPE_MAX_WINDOW];
+	struct newtp_estimate est;
+	struct file_sink sink;
+	struct journal journal;
+	struct stat st;
+	uint64_t ofs, size, mtime;
+	int fd, res, head = 0, count = 0, window = PIPE_START_WINDOW, eof = 0;
 
 	do_assign(path, 1);
 
-	/* TODO ensure that the file exists and is readable on server side
-	 before creating the local file */
+	/* TODO ensure that the file is readable on server side before
+	 creating the local file */
+	res = stat_size_mtime(conn, 1, &size, &mtime);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to stat %s: 0x%x\n", path, res);
+		exit(1);
+	}
 
-	fd = open(target, O_WRONLY | O_CREAT | (overwrite ? O_TRUNC : 0), 0644);
-	if (fd == -1) {
+	fd = open(target, O_RDWR | O_CREAT | (overwrite ? O_TRUNC : 0), 0644);
+	if (fd == -1 || fstat(fd, &st) == -1) {
 		fprintf(stderr, "failed to open %s: %s\n", target, strerror(errno));
 		exit(1);
 	}
-	ofs = lseek(fd, 0, SEEK_END);
-
-	/* simplistic-smart approach: send many reads at once, for each success
-	 * send a next one. exit when first read fails/shorts. */
-	for (int i = 0; i < 8; i++) {
-		buf += pack_command_p(buf, id++, 0, CMD_READ, 1, SIZEOF_params_offlen());
-		buf += pack_params_offlen_p(buf, ofs, len);
-		ofs += len;
+	journal_open(&journal, target, "get", size, mtime);
+	ofs = resume_point(conn, 1, &journal, fd, ((uint64_t)st.st_size < size) ? (uint64_t)st.st_size : size);
+	if (ftruncate(fd, ofs) == -1 || lseek(fd, ofs, SEEK_SET) == -1) {
+		fprintf(stderr, "failed to truncate %s: %s\n", target, strerror(errno));
+		exit(1);
 	}
-	safe_send_full(outbuf, buf - outbuf);
 
-	while (1) {
-		recv_reply(&reply);
-		assert(reply.request_id > rid);
-		rid = reply.request_id;
-		if (reply.result != STAT_OK) {
+	memset(&est, 0, sizeof(est));
+	newtp_set_window(conn, PIPE_MAX_WINDOW);
+	sink_start(&sink, fd, target, &journal);
+
+	/* keep a window of reads in flight, and pass the replies on in
+	 * order, until the first short read */
+	while (!eof) {
+		struct newtp_req * r;
+
+		while (count < window) {
+			reads[(head + count) % PIPE_MAX_WINDOW] = submit_read(ofs);
+			ofs += MAX_LENGTH;
+			count++;
+		}
+
+		r = reads[head];
+		head = (head + 1) % PIPE_MAX_WINDOW;
+		count--;
+		if (newtp_wait(r) != STAT_OK) {
 			/* bail */
-			fprintf(stderr, "read failed: 0x%x\n", reply.result);
+			fprintf(stderr, "read failed: 0x%x\n", r->reply.result);
 			exit(1);
 		}
-		if (reply.length > 0) {
-			buf = inbuf + SIZEOF_reply();
-			int l = 0;
-			do {
-				int i = write(fd, buf + l, reply.length - l);
-				if (i <= 0) {
-					if (errno == EINTR) continue;
-					else {
-						fprintf(stderr, "failed to write to %s: %s\n", target, strerror(errno));
-						exit(1);
-					}
-				}
-				l += i;
-			} while (l < reply.length);
+		newtp_estimate_add(&est, r);
+		if (r->reply.length < MAX_LENGTH) eof = 1;
+		if (r->reply.length) sink_push(&sink, r);
+		else newtp_req_free(r);
+		window = adjust_window(window, &est);
+	}
+
+	sink_finish(&sink);
+	close(fd);
+	journal_remove(&journal);
+
+	/* the reads past the end are still in flight */
+	newtp_drain(conn);
+	for (; count; count--, head = (head + 1) % PIPE_MAX_WINDOW) newtp_req_free(reads[head]);
+}
+
+/* reads the local file ahead on its own thread, into WRITEs ready to
+ * be sent, so sending doesn't wait for the disk. each range of the
+ * journal the file completes is followed by a FLUSH, and committed when
+ * that comes back */
+struct file_source {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct newtp_req * queue[PIPE_QUEUE];
+	int head, count;
+	int done;		/* nothing more will be queued */
+	int error;		/* errno of a failed read, or -1 if the file got shorter */
+
+	int fd;
+	uint64_t start, size;
+	struct journal * journal;
+};
+
+static void source_queue (struct file_source * s, struct newtp_req * r)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->count == PIPE_QUEUE) pthread_cond_wait(&s->cond, &s->lock);
+	s->queue[(s->head + s->count) % PIPE_QUEUE] = r;
+	s->count++;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void * source_thread (void * arg)
+{
+	struct file_source * s = arg;
+	uint64_t pos = s->start;
+	int error = 0;
+
+	while (pos < s->size && !error) {
+		int len = (s->size - pos > MAX_LENGTH - 8) ? MAX_LENGTH - 8 : s->size - pos;
+		struct newtp_req * r = newtp_req_new(conn, CMD_WRITE, 1);
+		char * data = newtp_req_payload(r, 8 + len);
+		int l = 0, completed;
+
+		pack(data, "l", pos);
+		while (l < len) {
+			int n = pread(s->fd, data + 8 + l, len - l, pos + l);
+			if (n <= 0) {
+				if (n == -1 && errno == EINTR) continue;
+				error = n ? errno : -1;
+				break;
+			}
+			l += n;
+		}
+		if (error) {
+			newtp_req_free(r);
+			break;
+		}
+		pos += len;
+		completed = journal_hash(s->journal, data + 8, len);
+		source_queue(s, r);
+
+		while (completed--) {
+			r = newtp_req_new(conn, CMD_FLUSH, 1);
+			*newtp_req_payload(r, 1) = DURABLE_DATA;
+			source_queue(s, r);
+		}
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->done = 1;
+	s->error = error;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static void source_start (struct file_source * s, int fd, uint64_t start, uint64_t size, struct journal * journal)
+{
+	memset(s, 0, sizeof(struct file_source));
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->fd = fd;
+	s->start = start;
+	s->size = size;
+	s->journal = journal;
+	if (pthread_create(&s->thread, NULL, source_thread, s)) {
+		fprintf(stderr, "failed to start reader thread\n");
+		exit(1);
+	}
+}
+
+/* the next WRITE or FLUSH in file order, or NULL at the end */
+static struct newtp_req * source_pop (struct file_source * s)
+{
+	struct newtp_req * r = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->count && !s->done) pthread_cond_wait(&s->cond, &s->lock);
+	if (s->count) {
+		r = s->queue[s->head];
+		s->head = (s->head + 1) % PIPE_QUEUE;
+		s->count--;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return r;
+}
+
+/* returns 0 or the error of the reader */
+static int source_finish (struct file_source * s)
+{
+	pthread_join(s->thread, NULL);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	return s->error;
+}
+
+/* striped transfers over several connections. the file is split
+ * evenly between them, and a connection that runs out of work takes over
+ * the upper half of the largest range another one has left, so a slow
+ * connection doesn't hold up the end */
+
+/* requests in flight per connection */
+#define STRIPE_WINDOW 16
+#define STRIPE_MAX_CONNS 32
+
+struct stripe_job;
+
+struct stripe_worker {
+	struct stripe_job * job;
+	pthread_t thread;
+	struct newtp_conn * conn;
+	/* range not requested yet, under job->lock */
+	uint64_t pos, end;
+};
+
+struct stripe_job {
+	pthread_mutex_t lock;
+	int put;
+	uint16_t handle;
+	char * path;
+	char * local;
+	int fd;
+	int chunk;		/* bytes per READ or WRITE */
+	int failed;		/* no more chunks are claimed once set */
+	uint64_t * progress;	/* bytes done are added here if set */
+	int count;
+	struct stripe_worker workers[STRIPE_MAX_CONNS];
+};
+
+/* takes the next chunk of w's range, stealing a range if it has none.
+ * returns 0 when nothing is left */
+static int stripe_claim (struct stripe_worker * w, uint64_t * off, int * len)
+{
+	struct stripe_job * j = w->job;
+
+	pthread_mutex_lock(&j->lock);
+	if (w->pos >= w->end && !j->failed) {
+		struct stripe_worker * v = NULL;
+		for (int i = 0; i < j->count; i++) {
+			struct stripe_worker * o = j->workers + i;
+			if (!v || o->end - o->pos > v->end - v->pos) v = o;
+		}
+		if (v->end - v->pos >= 2 * (uint64_t)j->chunk) {
+			uint64_t left = v->end - v->pos;
+			uint64_t mid = v->pos + left / 2 / j->chunk * j->chunk;
+			w->pos = mid;
+			w->end = v->end;
+			v->end = mid;
+		}
+	}
+	if (w->pos >= w->end || j->failed) {
+		pthread_mutex_unlock(&j->lock);
+		return 0;
+	}
+	*off = w->pos;
+	*len = (w->end - w->pos > (uint64_t)j->chunk) ? j->chunk : w->end - w->pos;
+	w->pos += *len;
+	pthread_mutex_unlock(&j->lock);
+	return 1;
+}
+
+static void stripe_fail (struct stripe_job * j)
+{
+	pthread_mutex_lock(&j->lock);
+	j->failed = 1;
+	pthread_mutex_unlock(&j->lock);
+}
+
+/* returns NULL if the local file can't be read */
+static struct newtp_req * stripe_submit (struct stripe_worker * w, uint64_t off, int len)
+{
+	struct stripe_job * j = w->job;
+	struct newtp_req * r;
+
+	if (!j->put) {
+		r = newtp_req_new(w->conn, CMD_READ, j->handle);
+		pack_params_offlen_p(newtp_req_payload(r, SIZEOF_params_offlen()), off, len);
+	} else {
+		char * data;
+		int l = 0;
+		r = newtp_req_new(w->conn, CMD_WRITE, j->handle);
+		data = newtp_req_payload(r, 8 + len);
+		pack(data, "l", off);
+		while (l < len) {
+			int n = pread(j->fd, data + 8 + l, len - l, off + l);
+			if (n <= 0) {
+				if (n == -1 && errno == EINTR) continue;
+				fprintf(stderr, "failed to read %s: %s\n", j->local,
+					n ? strerror(errno) : "file got shorter");
+				newtp_req_free(r);
+				return NULL;
+			}
+			l += n;
+		}
+	}
+	newtp_submit(r, NULL, NULL);
+	return r;
+}
+
+/* checks the reply of r and writes out READ data. returns 0 or -1 */
+static int stripe_complete (struct stripe_worker * w, struct newtp_req * r, uint64_t off, int len)
+{
+	struct stripe_job * j = w->job;
+	uint16_t retlen = 0;
+	int l = 0;
+
+	if (newtp_wait(r) != STAT_OK) {
+		fprintf(stderr, "%s of %s failed at %llu: 0x%x\n", j->put ? "write" : "read",
+			j->path, (unsigned long long)off, r->reply.result);
+		return -1;
+	}
+	if (j->put) {
+		if (r->reply.length >= 2) unpack(r->data, r->reply.length, "s", &retlen);
+		if (retlen < len) {
+			fprintf(stderr, "short write to %s at %llu, device full?\n", j->path,
+				(unsigned long long)off);
+			return -1;
+		}
+	} else {
+		if (r->reply.length < len) {
+			fprintf(stderr, "%s got shorter during transfer\n", j->path);
+			return -1;
+		}
+		while (l < len) {
+			int n = pwrite(j->fd, r->data + l, len - l, off + l);
+			if (n <= 0) {
+				if (n == -1 && errno == EINTR) continue;
+				fprintf(stderr, "failed to write to %s: %s\n", j->local, strerror(errno));
+				return -1;
+			}
+			l += n;
+		}
+	}
+	if (j->progress) __atomic_add_fetch(j->progress, len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void * stripe_thread (void * arg)
+{
+	struct stripe_worker * w = arg;
+	struct newtp_req * ring[STRIPE_WINDOW];
+	uint64_t offs[STRIPE_WINDOW];
+	int lens[STRIPE_WINDOW];
+	int head = 0, count = 0;
+
+	for (;;) {
+		while (count < STRIPE_WINDOW) {
+			int slot = (head + count) % STRIPE_WINDOW;
+			if (!stripe_claim(w, offs + slot, lens + slot)) break;
+			ring[slot] = stripe_submit(w, offs[slot], lens[slot]);
+			if (!ring[slot]) {
+				stripe_fail(w->job);
+				break;
+			}
+			count++;
+		}
+		if (!count) break;
+		/* after a failure the requests in flight are only collected */
+		if (stripe_complete(w, ring[head], offs[head], lens[head]) < 0) stripe_fail(w->job);
+		newtp_req_free(ring[head]);
+		head = (head + 1) % STRIPE_WINDOW;
+		count--;
+	}
+	return NULL;
+}
+
+/* transfers [start, size) of the file on handle of c, which is assigned
+ * to path, over conns connections: c and conns - 1 new ones.
+ * returns 0 or -1 */
+static int stripe_run (struct newtp_conn * c, uint16_t handle, int put, char * path, char * local,
+	int fd, uint64_t start, uint64_t size, int conns, uint64_t * progress)
+{
+	struct stripe_job j;
+	uint64_t share;
+
+	memset(&j, 0, sizeof(j));
+	pthread_mutex_init(&j.lock, NULL);
+	j.put = put;
+	j.handle = handle;
+	j.path = path;
+	j.local = local;
+	j.fd = fd;
+	j.chunk = put ? MAX_LENGTH - 8 : MAX_LENGTH;
+	j.progress = progress;
+	j.count = conns;
+
+	share = (size > start) ? (size - start + conns - 1) / conns : 0;
+	share = (share + j.chunk - 1) / j.chunk * j.chunk;
+	for (int i = 0; i < conns; i++) {
+		struct stripe_worker * w = j.workers + i;
+		w->job = &j;
+		w->pos = start + i * share;
+		w->end = w->pos + share;
+		if (w->pos > size) w->pos = size;
+		if (w->end > size) w->end = size;
+		if (i == 0) {
+			w->conn = c;
 		} else {
-			close(fd);
+			w->conn = newtp_connect(hostname, NEWTP_PORT, ctx);
+			if (!w->conn) exit(1);
+			if (assign_on(w->conn, path, handle) != STAT_OK) {
+				fprintf(stderr, "failed to assign handle\n");
+				exit(1);
+			}
+		}
+	}
+
+	for (int i = 1; i < conns; i++) {
+		if (pthread_create(&j.workers[i].thread, NULL, stripe_thread, j.workers + i)) {
+			fprintf(stderr, "failed to start transfer thread\n");
+			exit(1);
+		}
+	}
+	stripe_thread(j.workers);
+	for (int i = 1; i < conns; i++) {
+		pthread_join(j.workers[i].thread, NULL);
+		newtp_disconnect(j.workers[i].conn);
+	}
+	pthread_mutex_destroy(&j.lock);
+	return j.failed ? -1 : 0;
+}
+
+/* get over several connections, continuing a partial local file as far
+ * as it matches. the stripes complete out of order, so no journal is
+ * kept and the prefix is verified by hash alone */
+void do_get_striped (char * path, char * target, int conns)
+{
+	struct journal journal;
+	struct stat st;
+	uint64_t size, mtime, start;
+	int fd, res;
+
+	do_assign(path, 1);
+	res = stat_size_mtime(conn, 1, &size, &mtime);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to stat %s: 0x%x\n", path, res);
+		exit(1);
+	}
+
+	fd = open(target, O_RDWR | O_CREAT, 0644);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", target, strerror(errno));
+		exit(1);
+	}
+	journal_open(&journal, target, NULL, size, mtime);
+	start = resume_point(conn, 1, &journal, fd, ((uint64_t)st.st_size < size) ? (uint64_t)st.st_size : size);
+	journal_close(&journal);
+	if (ftruncate(fd, start) == -1) {
+		fprintf(stderr, "failed to truncate %s: %s\n", target, strerror(errno));
+		exit(1);
+	}
+
+	if (stripe_run(conn, 1, 0, path, target, fd, start, size, conns, NULL) < 0) exit(1);
+	close(fd);
+}
+
+/* creates the file on handle, assigned to path, with the given size, so
+ * the stripes can be written in any order. data already there is kept.
+ * returns 0 or -1 */
+static int put_prepare (struct newtp_conn * c, uint16_t handle, char * path, uint64_t size)
+{
+	char buf[8];
+	int res;
+
+	/* an empty WRITE creates the file */
+	pack(buf, "l", (uint64_t)0);
+	res = run_on(c, CMD_WRITE, handle, buf, 8);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to create %s: 0x%x\n", path, res);
+		return -1;
+	}
+	pack(buf, "l", size);
+	res = run_on(c, CMD_TRUNCATE, handle, buf, 8);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to truncate %s: 0x%x\n", path, res);
+		return -1;
+	}
+	return 0;
+}
+
+/* sends the file from start over conn alone. WRITEs read ahead by the
+ * source thread go out in a window sized like get's, and each reply has
+ * to report its whole chunk written */
+static void put_pipelined (int fd, char * source, char * path, uint64_t start, uint64_t size,
+	struct journal * journal)
+{
+	static struct newtp_req * writes[PIPE_MAX_WINDOW];
+	struct newtp_estimate est;
+	struct file_source src;
+	int head = 0, count = 0, window = PIPE_START_WINDOW, more = 1, err;
+
+	memset(&est, 0, sizeof(est));
+	newtp_set_window(conn, PIPE_MAX_WINDOW);
+	source_start(&src, fd, start, size, journal);
+
+	for (;;) {
+		struct newtp_req * r;
+		uint16_t retlen = 0;
+
+		while (more && count < window) {
+			r = source_pop(&src);
+			if (!r) {
+				more = 0;
+				break;
+			}
+			newtp_submit(r, NULL, NULL);
+			writes[(head + count) % PIPE_MAX_WINDOW] = r;
+			count++;
+		}
+		if (!count) break;
+
+		r = writes[head];
+		head = (head + 1) % PIPE_MAX_WINDOW;
+		count--;
+		if (newtp_wait(r) != STAT_OK) {
+			fprintf(stderr, "%s to %s failed: 0x%x\n",
+				r->cmd.command == CMD_FLUSH ? "sync" : "write", path, r->reply.result);
+			exit(1);
+		}
+		if (r->cmd.command == CMD_FLUSH) {
+			/* the range before it is on the server's disk */
+			journal_commit(journal);
+			newtp_req_free(r);
+			continue;
+		}
+		if (r->reply.length >= 2) unpack(r->data, r->reply.length, "s", &retlen);
+		if (retlen != r->cmd.length - 8) {
+			fprintf(stderr, "short write to %s, device full?\n", path);
+			exit(1);
+		}
+		newtp_estimate_add(&est, r);
+		newtp_req_free(r);
+		window = adjust_window(window, &est);
+	}
+
+	err = source_finish(&src);
+	if (err) {
+		fprintf(stderr, "failed to read %s: %s\n", source, err > 0 ? strerror(err) : "file got shorter");
+		exit(1);
+	}
+}
+
+/* uploads source to path, replacing its contents, and waits until the
+ * data is on the server's disk. like get, continues from where the two
+ * files stop matching */
+void do_put (char * source, char * path, int conns)
+{
+	struct journal journal;
+	struct stat st;
+	uint64_t size = 0, mtime, start;
+	char mode = DURABLE_FULL;
+	int fd, res;
+
+	fd = open(source, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", source, strerror(errno));
+		exit(1);
+	}
+
+	do_assign(path, 1);
+	if (stat_size_mtime(conn, 1, &size, &mtime) != STAT_OK) size = 0;
+	if (size > (uint64_t)st.st_size) size = st.st_size;
+
+	journal_open(&journal, source, (conns > 1) ? NULL : "put", st.st_size, newtp_timespec_to_time(st.st_mtim));
+	start = resume_point(conn, 1, &journal, fd, size);
+	if (put_prepare(conn, 1, path, st.st_size) < 0) exit(1);
+	if (conns > 1) {
+		if (stripe_run(conn, 1, 1, path, source, fd, start, st.st_size, conns, NULL) < 0) exit(1);
+	} else {
+		put_pipelined(fd, source, path, start, st.st_size, &journal);
+	}
+	close(fd);
+
+	res = run_on(conn, CMD_FLUSH, 1, &mode, 1);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to sync %s: 0x%x\n", path, res);
+		exit(1);
+	}
+	journal_remove(&journal);
+}
+
+/* recursive transfers over one connection. threads share it, each with
+ * a handle of its own, and take directories to list and files to
+ * transfer from a queue. files whose size and mtime match are skipped,
+ * and transferred files get the mtime of their source */
+
+#define MIRROR_THREADS 8
+#define MIRROR_MAX_THREADS 64
+
+struct mirror_item {
+	struct mirror_item * next;
+	char * remote;
+	char * local;
+	int dir;
+	/* of the source file */
+	uint64_t size, mtime;
+};
+
+static struct {
+	int put;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct mirror_item * head, * tail;
+	int busy;		/* items taken and not finished */
+	int listing, max_listing;
+
+	unsigned long files, skipped, failed, dirs;
+	uint64_t bytes;		/* changed atomically */
+} mirror = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static char * join_path (char const * dir, char const * name, int len)
+{
+	char * p = xmalloc(strlen(dir) + len + 2);
+	sprintf(p, "%s/%.*s", dir, len, name);
+	return p;
+}
+
+static void mirror_push (char * remote, char * local, int dir, uint64_t size, uint64_t mtime)
+{
+	struct mirror_item * it = xmalloc(sizeof(struct mirror_item));
+
+	it->next = NULL;
+	it->remote = remote;
+	it->local = local;
+	it->dir = dir;
+	it->size = size;
+	it->mtime = mtime;
+	pthread_mutex_lock(&mirror.lock);
+	if (mirror.tail) mirror.tail->next = it;
+	else mirror.head = it;
+	mirror.tail = it;
+	pthread_cond_broadcast(&mirror.cond);
+	pthread_mutex_unlock(&mirror.lock);
+}
+
+/* takes the first item that may run now: directories wait while as many
+ * listings as the server keeps open are in progress. returns NULL once
+ * the queue is empty and nothing in progress can add to it */
+static struct mirror_item * mirror_take ()
+{
+	struct mirror_item * it, * prev;
+
+	pthread_mutex_lock(&mirror.lock);
+	for (;;) {
+		for (prev = NULL, it = mirror.head; it; prev = it, it = it->next) {
+			if (!it->dir || mirror.listing < mirror.max_listing) break;
+		}
+		if (it) {
+			if (prev) prev->next = it->next;
+			else mirror.head = it->next;
+			if (mirror.tail == it) mirror.tail = prev;
+			if (it->dir) mirror.listing++;
+			mirror.busy++;
 			break;
 		}
-		buf = outbuf;
-		buf += pack_command_p(buf, id++, 0, CMD_READ, 1, SIZEOF_params_offlen());
-		buf += pack_params_offlen_p(buf, ofs, len);
-		safe_send_full(outbuf, buf - outbuf);
-		ofs += len;
+		if (!mirror.head && !mirror.busy) break;
+		pthread_cond_wait(&mirror.cond, &mirror.lock);
 	}
+	pthread_mutex_unlock(&mirror.lock);
+	return it;
+}
+
+static void mirror_done (struct mirror_item * it, int res)
+{
+	pthread_mutex_lock(&mirror.lock);
+	if (it->dir) {
+		mirror.listing--;
+		if (res == 0) mirror.dirs++;
+	} else {
+		if (res == 0) mirror.files++;
+		else if (res == 1) mirror.skipped++;
+	}
+	if (res < 0) mirror.failed++;
+	mirror.busy--;
+	pthread_cond_broadcast(&mirror.cond);
+	pthread_mutex_unlock(&mirror.lock);
+
+	free(it->remote);
+	free(it->local);
+	free(it);
+}
+
+/* queues the entries of the remote directory. returns 0 or -1 */
+static int mirror_list_remote (uint16_t handle, struct mirror_item * it)
+{
+	struct newtp_req * rewind, * r;
+	int res;
+
+	if (mkdir(it->local, 0777) == -1 && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s: %s\n", it->local, strerror(errno));
+		return -1;
+	}
+	res = assign_on(conn, it->remote, handle);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to assign %s: 0x%x\n", it->remote, res);
+		return -1;
+	}
+
+	rewind = newtp_req_new(conn, CMD_REWINDDIR, handle);
+	newtp_submit(rewind, NULL, NULL);
+	r = newtp_req_new(conn, CMD_READDIR, handle);
+	memcpy(newtp_req_payload(r, ATTR_LEN), ATTRIBUTES, ATTR_LEN);
+	do {
+		struct dir_entry entry;
+		uint16_t items;
+		int pos = 2;
+
+		res = newtp_run(r);
+		if (rewind) {
+			if (newtp_wait(rewind) != STAT_OK) res = rewind->reply.result;
+			newtp_req_free(rewind);
+			rewind = NULL;
+		}
+		if (res != STAT_CONTINUED && res != STAT_FINISHED) {
+			fprintf(stderr, "listing %s failed: 0x%x\n", it->remote, res);
+			newtp_req_free(r);
+			return -1;
+		}
+
+		unpack(r->data, r->reply.length, "s", &items);
+		for (; items && pos < r->reply.length; items--) {
+			uint8_t type, rights;
+			uint64_t mtime, size;
+			uint32_t uid;
+			unsigned int st_mode;
+
+			if (unpack_dir_entry_view(r->data + pos, r->reply.length - pos, &entry) == -1
+				|| entry.attr_len != ATTR_LIST_SIZE) {
+				fprintf(stderr, "malformed entry in listing of %s\n", it->remote);
+				break;
+			}
+			pos += SIZEOF_dir_entry(&entry);
+			if ((entry.name_len == 1 && entry.name[0] == '.') ||
+				(entry.name_len == 2 && !memcmp(entry.name, "..", 2)))
+				continue;
+			unpack(entry.attr, entry.attr_len, ATTR_FORMAT, &rights, &mtime, &type, &size, &uid);
+			st_mode = type << 12;
+			if (!S_ISDIR(st_mode) && !S_ISREG(st_mode)) continue;
+			mirror_push(join_path(it->remote, entry.name, entry.name_len),
+				join_path(it->local, entry.name, entry.name_len),
+				S_ISDIR(st_mode), size, mtime);
+		}
+	} while (res != STAT_FINISHED);
+	newtp_req_free(r);
+	return 0;
+}
+
+/* queues the entries of the local directory. returns 0 or -1 */
+static int mirror_list_local (uint16_t handle, struct mirror_item * it)
+{
+	struct dirent * de;
+	DIR * dir;
+	int res;
+
+	res = assign_on(conn, it->remote, handle);
+	if (res == STAT_OK) res = run_on(conn, CMD_MAKEDIR, handle, NULL, 0);
+	if (res != STAT_OK && res != ERR_EXISTS) {
+		fprintf(stderr, "failed to create %s: 0x%x\n", it->remote, res);
+		return -1;
+	}
+
+	dir = opendir(it->local);
+	if (!dir) {
+		fprintf(stderr, "failed to open %s: %s\n", it->local, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		int len = strlen(de->d_name);
+		struct stat st;
+		char * local;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+		local = join_path(it->local, de->d_name, len);
+		if (lstat(local, &st) == -1 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+			free(local);
+			continue;
+		}
+		mirror_push(join_path(it->remote, de->d_name, len), local, S_ISDIR(st.st_mode),
+			st.st_size, newtp_timespec_to_time(st.st_mtim));
+	}
+	closedir(dir);
+	return 0;
+}
+
+/* returns 0 when transferred, 1 when unchanged, -1 on failure */
+static int mirror_get (uint16_t handle, struct mirror_item * it)
+{
+	struct timespec ts[2];
+	struct stat st;
+	int fd, res;
+
+	if (stat(it->local, &st) == 0 && (uint64_t)st.st_size == it->size &&
+		(uint64_t)newtp_timespec_to_time(st.st_mtim) == it->mtime)
+		return 1;
+
+	res = assign_on(conn, it->remote, handle);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to assign %s: 0x%x\n", it->remote, res);
+		return -1;
+	}
+	fd = open(it->local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", it->local, strerror(errno));
+		return -1;
+	}
+	res = stripe_run(conn, handle, 0, it->remote, it->local, fd, 0, it->size, 1, &mirror.bytes);
+	if (res == 0) {
+		ts[0].tv_nsec = UTIME_OMIT;
+		newtp_time_to_timespec(&ts[1], it->mtime);
+		futimens(fd, ts);
+	}
+	close(fd);
+	return res;
+}
+
+/* returns 0 when transferred, 1 when unchanged, -1 on failure */
+static int mirror_put (uint16_t handle, struct mirror_item * it)
+{
+	uint64_t size, mtime;
+	char buf[9], mode = DURABLE_FULL;
+	int fd, res;
+
+	res = assign_on(conn, it->remote, handle);
+	if (res != STAT_OK) {
+		fprintf(stderr, "failed to assign %s: 0x%x\n", it->remote, res);
+		return -1;
+	}
+	if (stat_size_mtime(conn, handle, &size, &mtime) == STAT_OK &&
+		size == it->size && mtime == it->mtime)
+		return 1;
+
+	fd = open(it->local, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", it->local, strerror(errno));
+		return -1;
+	}
+	res = put_prepare(conn, handle, it->remote, it->size);
+	if (res == 0) res = stripe_run(conn, handle, 1, it->remote, it->local, fd, 0, it->size, 1, &mirror.bytes);
+	close(fd);
+	if (res == 0) {
+		/* the mtime says the file is complete, so the data must be
+		 * on disk before it */
+		res = run_on(conn, CMD_FLUSH, handle, &mode, 1);
+		if (res != STAT_OK) {
+			fprintf(stderr, "failed to sync %s: 0x%x\n", it->remote, res);
+			return -1;
+		}
+		pack(buf, "cl", ATTR_MTIME, it->mtime);
+		res = run_on(conn, CMD_SETATTR, handle, buf, 9);
+		if (res != STAT_OK) {
+			fprintf(stderr, "failed to set mtime of %s: 0x%x\n", it->remote, res);
+			return -1;
+		}
+	}
+	return res;
+}
+
+static void * mirror_thread (void * arg)
+{
+	uint16_t handle = (uintptr_t)arg;
+	struct mirror_item * it;
+
+	while ((it = mirror_take())) {
+		int res;
+		if (it->dir) res = mirror.put ? mirror_list_local(handle, it) : mirror_list_remote(handle, it);
+		else res = mirror.put ? mirror_put(handle, it) : mirror_get(handle, it);
+		mirror_done(it, res);
+	}
+	return NULL;
+}
+
+static double now_s ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* copies the tree at source to target: remote to local for get, local to
+ * remote for put. returns the number of failures */
+unsigned long do_mirror (int put, char * source, char * target, int threads)
+{
+	pthread_t tids[MIRROR_MAX_THREADS];
+	double start = now_s(), elapsed;
+	int tty = isatty(2);
+
+	if (threads + 2 > newtp_server_intro(conn)->max_handles) threads = newtp_server_intro(conn)->max_handles - 2;
+	mirror.put = put;
+	mirror.max_listing = newtp_server_intro(conn)->max_opendirs;
+	if (mirror.max_listing < 1) mirror.max_listing = 1;
+	mirror_push(strdup(put ? target : source), strdup(put ? source : target), 1, 0, 0);
+
+	/* requests from all threads go out on the connection, and a
+	 * receiver thread hands out the replies */
+	newtp_set_window(conn, threads * STRIPE_WINDOW + 1);
+	if (newtp_start_receiver(conn) != 0) {
+		fprintf(stderr, "failed to start receiver thread\n");
+		exit(1);
+	}
+	for (int i = 0; i < threads; i++) {
+		/* handle 1 is the main thread's */
+		if (pthread_create(tids + i, NULL, mirror_thread, (void *)(uintptr_t)(i + 2))) {
+			fprintf(stderr, "failed to start transfer thread\n");
+			exit(1);
+		}
+	}
+
+	/* progress, once a second on a terminal */
+	pthread_mutex_lock(&mirror.lock);
+	while (mirror.head || mirror.busy) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		pthread_cond_timedwait(&mirror.cond, &mirror.lock, &until);
+		if (tty) fprintf(stderr, "\r%lu files, %lu unchanged, %.1f MB ", mirror.files, mirror.skipped,
+			__atomic_load_n(&mirror.bytes, __ATOMIC_RELAXED) / 1e6);
+	}
+	pthread_mutex_unlock(&mirror.lock);
+	for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+
+	elapsed = now_s() - start;
+	if (tty) fprintf(stderr, "\n");
+	printf("%lu files, %llu bytes in %.2f s (%.1f MB/s); %lu unchanged, %lu directories, %lu failed\n",
+		mirror.files, (unsigned long long)mirror.bytes, elapsed,
+		elapsed > 0 ? mirror.bytes / elapsed / 1e6 : 0.0, mirror.skipped, mirror.dirs, mirror.failed);
+	return mirror.failed;
 }
 
 int main (int argc, char **argv)
 {
-	struct intro intro;
-	char * command, * path, * target;
-	Gsasl * ctx;
+	char * command, * path, * target, * prog = argv[0];
+	int opt, conns = 1, recursive = 0, jobs = MIRROR_THREADS, ret = 0;
 
 	setlocale(LC_ALL, "");
+	log_init();
 	assert(gsasl_init(&ctx) == GSASL_OK);
 
+	while ((opt = getopt(argc, argv, "n:rj:")) != -1) {
+		if (opt == 'n') {
+			conns = atoi(optarg);
+			if (conns < 1 || conns > STRIPE_MAX_CONNS) {
+				fprintf(stderr, "connections must be between 1 and %d\n", STRIPE_MAX_CONNS);
+				return 1;
+			}
+		} else if (opt == 'r') {
+			recursive = 1;
+		} else if (opt == 'j') {
+			jobs = atoi(optarg);
+			if (jobs < 1 || jobs > MIRROR_MAX_THREADS) {
+				fprintf(stderr, "jobs must be between 1 and %d\n", MIRROR_MAX_THREADS);
+				return 1;
+			}
+		} else {
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 3) {
-		printf("usage: %s <address> <command> [path]\n", argv[0]);
+		printf("usage: %s [-n connections] [-r [-j jobs]] <address> <command> [path] [target]\n", prog);
 		return 0;
 	}
 
+	hostname = argv[1];
 	command = argv[2];
 	if (argc > 3) path = argv[3];
 	else path = "";
 
-	if (newtp_client_connect(argv[1], MYPORT, &intro, NULL) > 0) return 1;
-	newtp_client_sasl_auth(ctx, &intro);
+	conn = newtp_connect(hostname, NEWTP_PORT, ctx);
+	if (!conn) return 1;
 
 	/*** perform actual commands ***/
 
@@ -237,14 +1317,24 @@ int main (int argc, char **argv)
 		char * c = path;
 		target = path;
 		while (*c++) if (*c == '/') target = c + 1; /* get basename */
-		do_get(path, target, 0);
+		if (argc > 4) target = argv[4];
+		if (recursive) ret = do_mirror(0, path, target, jobs) ? 1 : 0;
+		else if (conns > 1) do_get_striped(path, target, conns);
+		else do_get(path, target, 0);
+	} else if (!strcmp("put", command)) {
+		if (argc < 5) {
+			fprintf(stderr, "usage: %s [-n connections] [-r [-j jobs]] <address> put <file> <path>\n", prog);
+			exit(1);
+		}
+		if (recursive) ret = do_mirror(1, path, argv[4], jobs) ? 1 : 0;
+		else do_put(path, argv[4], conns);
 	} else {
 		fprintf(stderr, "unknown command: %s\n", command);
 		exit(1);
 	}
 
-	newtp_gnutls_disconnect(1);
+	newtp_disconnect(conn);
 	gsasl_done(ctx);
 
-	return 0;
+	return ret;
 }
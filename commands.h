@@ -12,6 +12,9 @@
 #define CMD_READ	0x10
 #define CMD_WRITE	0x11
 #define CMD_TRUNCATE	0x12
+#define CMD_FLUSH	0x13
+#define CMD_DURABILITY	0x14
+#define CMD_HASH	0x15
 /* directory manipulation */
 #define CMD_DELETE	0x20
 #define CMD_RENAME	0x21
@@ -56,6 +59,25 @@
 #define ERR_FAIL		0xFE // Generic command failure
 #define ERR_SERVFAIL		0xFF // Internal server error
 
+/*** durability modes ***/
+
+/* used as parameter of CMD_FLUSH and CMD_DURABILITY.
+ * Replies to commands that wait for durability are held back until the data
+ * is on stable storage, so they can arrive out of order with respect to
+ * replies for commands sent later. */
+#define DURABLE_NONE	0x00 // No sync, kernel writes data back whenever it likes
+#define DURABLE_DATA	0x01 // File data is synced (fdatasync)
+#define DURABLE_FULL	0x02 // File data and metadata are synced (fsync)
+
+/*** range hashes ***/
+
+/* CMD_HASH takes an offset and a length (two uint64) and replies with the
+ * number of bytes hashed (uint64, less than length at the end of the file)
+ * followed by their SHA-256. Clients use it to check data they already have
+ * without transferring it again. */
+#define HASH_SIZE	32
+#define HASH_MAX_LENGTH	(1024 * 1024 * 1024)
+
 /*** attribute codes ***/
 
 /* generic codes */
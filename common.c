@@ -2,11 +2,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include <gnutls/gnutls.h>
 
@@ -15,26 +17,14 @@
 #include "structs.h"
 #include "tools.h"
 
-/* endian-independent htonll - assumes 8bit char */
 uint64_t htonll (uint64_t hostlong)
 {
-	unsigned char buffer[8];
-	uint64_t *ret = (uint64_t *)buffer;
-	for (int i = 0; i < 8; i++) {
-		buffer[i] = (uint8_t)((hostlong >> ((7 - i) * 8)) & ((uint64_t)0xff));
-	}
-	return *ret;
+	return WIRE_SWAP64(hostlong);
 }
 
 uint64_t ntohll (uint64_t netlong)
 {
-	uint64_t ret = 0;
-	unsigned char *buffer = (unsigned char *)&netlong;
-	for (int i = 0; i < 8; i++) {
-		ret <<= 8;
-		ret |= buffer[i];
-	}
-	return ret;
+	return WIRE_SWAP64(netlong);
 }
 
 #define ISDIGIT(x) ((x) >= '0' && (x) <= '9')
@@ -46,10 +36,7 @@ int pack (char * const buffer, char const * format, ...)
 	char * string;
 	int num; uint64_t lnum;
 	uint8_t v8bit;
-	uint16_t v16bit;
-	uint32_t v32bit;
-	uint64_t v64bit;
-	uint16_t len;
+	uint16_t len = 0;
 
 	va_start(ap, format);
 
@@ -64,20 +51,17 @@ int pack (char * const buffer, char const * format, ...)
 			case 's': /* 16bit short */
 				num = va_arg(ap, unsigned int);
 				len = (uint16_t)num;
-				v16bit = htons(len);
-				memcpy(buf, &v16bit, 2);
+				wire_put_uint16_t(buf, len);
 				buf += 2;
 				break;
 			case 'i': /* 32bit int */
 				num = va_arg(ap, unsigned int);
-				v32bit = htonl((uint32_t)num);
-				memcpy(buf, &v32bit, 4);
+				wire_put_uint32_t(buf, (uint32_t)num);
 				buf += 4;
 				break;
 			case 'l': /* 64bit long */
 				lnum = va_arg(ap, uint64_t);
-				v64bit = htonll((uint64_t)lnum);
-				memcpy(buf, &v64bit, 8);
+				wire_put_uint64_t(buf, lnum);
 				buf += 8;
 				break;
 			case 'B': /* byte string, length specified by previous short */
@@ -113,7 +97,7 @@ int unpack (char const * const buffer, int available, char const * format, ...)
 	uint16_t * v16bit;
 	uint32_t * v32bit;
 	uint64_t * v64bit;
-	uint16_t len;
+	uint16_t len = 0;
 
 	va_start(ap, format);
 
@@ -128,24 +112,21 @@ int unpack (char const * const buffer, int available, char const * format, ...)
 			case 's': /* 16bit short */
 				if (available < 2) return -1;
 				v16bit = va_arg(ap, uint16_t *);
-				memcpy(v16bit, buf, 2);
+				*v16bit = wire_get_uint16_t(buf);
 				buf += 2; available -= 2;
-				*v16bit = ntohs(*v16bit);
 				len = *v16bit;
 				break;
 			case 'i': /* 32bit int */
 				if (available < 4) return -1;
 				v32bit = va_arg(ap, uint32_t *);
-				memcpy(v32bit, buf, 4);
+				*v32bit = wire_get_uint32_t(buf);
 				buf += 4; available -= 4;
-				*v32bit = ntohl(*v32bit);
 				break;
 			case 'l': /* 64bit long */
 				if (available < 8) return -1;
 				v64bit = va_arg(ap, uint64_t *);
-				memcpy(v64bit, buf, 8);
+				*v64bit = wire_get_uint64_t(buf);
 				buf += 8; available -= 8;
-				*v64bit = ntohll(*v64bit);
 				break;
 			case 'B': /* byte string, length specified by previous short */
 				string = va_arg(ap, char **);
@@ -232,8 +213,9 @@ void newtp_gnutls_disconnect (int bye)
 	if (bye) gnutls_bye(_session, GNUTLS_SHUT_RDWR);
 	close(_socket);
 	gnutls_deinit(_session);
-	gnutls_anon_free_server_credentials(_server_cred);
-	gnutls_anon_free_client_credentials(_client_cred);
+	/* only one of them was allocated */
+	if (_server_cred) gnutls_anon_free_server_credentials(_server_cred);
+	if (_client_cred) gnutls_anon_free_client_credentials(_client_cred);
 	gnutls_global_deinit();
 }
 
@@ -276,6 +258,20 @@ int skip_data (int len)
 	return 1;
 }
 
+int wait_for_data (int timeout)
+{
+	struct pollfd pfd;
+	int r;
+
+	/* TLS might have already buffered a whole record */
+	if (gnutls_record_check_pending(_session) > 0) return 1;
+
+	pfd.fd = _socket;
+	pfd.events = POLLIN;
+	RETRY1(r, poll(&pfd, 1, timeout));
+	return r > 0;
+}
+
 int continue_or_die (int err)
 {
 	if (err > 0) return err;
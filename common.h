@@ -32,6 +32,9 @@ int send_full (void *, int);
 int recv_full (void *, int);
 /* discard len bytes from input */
 int skip_data (int);
+/* wait at most timeout milliseconds for incoming data.
+   returns 1 if there is something to read, 0 otherwise */
+int wait_for_data (int timeout);
 
 /* wrappers that log errors and cleanly exit the program */
 int safe_send_full (void *, int);
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE /* syncfs, sync_file_range, MAP_ANONYMOUS */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "common.h"
+#include "flush.h"
+#include "log.h"
+#include "paths.h"
+#include "structs.h"
+
+struct flush_req {
+	uint16_t request_id;
+	uint8_t  mode;
+	uint8_t  with_count;
+	uint16_t count;
+	uint8_t  result;
+	uint8_t  done;
+
+	int fd;		/* private dup() of the handle's fd */
+	dev_t dev;
+	ino_t ino;
+	uint64_t queued;	/* when the data was handed to the kernel */
+};
+
+static struct flush_req queue[FLUSH_QUEUE_LEN];
+static int queued = 0;
+static uint64_t window_end = 0;
+static int (*send_replies) (void *, int) = safe_send_full;
+
+/* shared between all sessions: for every device, start time of the most
+ * recent syncfs() that completed successfully. anything written before
+ * that time is durable. */
+#define FLUSH_DEVICES 64
+struct flush_dev {
+	uint64_t dev;	/* dev_t + 1, zero means free slot */
+	uint64_t covered;
+};
+static struct flush_dev * devices = NULL;
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void flush_init ()
+{
+	void * mem = mmap(NULL, FLUSH_DEVICES * sizeof(struct flush_dev),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		/* group commit still works, we just can't share syncfs() results */
+		warnp("cannot map shared flush table: %s", strerror(errno));
+		return;
+	}
+	memset(mem, 0, FLUSH_DEVICES * sizeof(struct flush_dev));
+	devices = mem;
+}
+
+static struct flush_dev * flush_device (dev_t dev, int create)
+{
+	uint64_t key = (uint64_t)dev + 1;
+	if (!devices) return NULL;
+
+	for (int i = 0; i < FLUSH_DEVICES; i++) {
+		struct flush_dev * d = devices + (key + i) % FLUSH_DEVICES;
+		uint64_t cur = __atomic_load_n(&d->dev, __ATOMIC_ACQUIRE);
+		if (cur == key) return d;
+		if (cur == 0) {
+			if (!create) return NULL;
+			uint64_t expected = 0;
+			if (__atomic_compare_exchange_n(&d->dev, &expected, key, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return d;
+			if (expected == key) return d; /* somebody else claimed it for us */
+		}
+	}
+	return NULL; /* table full, don't share */
+}
+
+static void flush_publish (dev_t dev, uint64_t started)
+{
+	struct flush_dev * d = flush_device(dev, 1);
+	if (!d) return;
+	uint64_t cur = __atomic_load_n(&d->covered, __ATOMIC_ACQUIRE);
+	while (cur < started &&
+		!__atomic_compare_exchange_n(&d->covered, &cur, started, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { }
+}
+
+static int flush_covered (struct flush_req * r)
+{
+	struct flush_dev * d = flush_device(r->dev, 0);
+	if (!d) return 0;
+	return __atomic_load_n(&d->covered, __ATOMIC_ACQUIRE) >= r->queued;
+}
+
+static int sync_errno_to_result (int e)
+{
+	if (e == EIO) return ERR_IO;
+	if (e == ENOSPC || e == EDQUOT) return ERR_DEVFULL;
+	if (e == EROFS || e == EINVAL) return ERR_UNSUPPORTED;
+	return ERR_FAIL;
+}
+
+int flush_queue (struct handle * h, uint16_t request_id, int mode, int with_count, uint16_t count)
+{
+	struct flush_req * r;
+	struct stat st;
+	int fd;
+
+	assert(h->fd != -1);
+	assert(mode == DURABLE_DATA || mode == DURABLE_FULL);
+
+	if (queued == FLUSH_QUEUE_LEN) flush_commit();
+
+	if (fstat(h->fd, &st) == -1) return ERR_FAIL;
+	RETRY1(fd, dup(h->fd));
+	if (fd == -1) return ERR_BUSY;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+	/* start writeback now, so that the sync at commit has less to wait for */
+	if (h->open_w) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+	r = queue + queued++;
+	r->request_id = request_id;
+	r->mode = mode;
+	r->with_count = with_count;
+	r->count = count;
+	r->result = STAT_OK;
+	r->done = 0;
+	r->fd = fd;
+	r->dev = st.st_dev;
+	r->ino = st.st_ino;
+	r->queued = now_ns();
+
+	if (queued == 1) window_end = r->queued + FLUSH_WINDOW_US * 1000ULL;
+
+	return STAT_OK;
+}
+
+int flush_pending ()
+{
+	return queued;
+}
+
+int flush_timeout ()
+{
+	uint64_t now;
+	if (!queued) return -1;
+	now = now_ns();
+	if (now >= window_end) return 0;
+	/* round up, poll() has millisecond resolution */
+	return (window_end - now + 999999) / 1000000;
+}
+
+static void flush_finish (struct flush_req * r, int result)
+{
+	r->result = result;
+	r->done = 1;
+}
+
+void flush_set_sender (int (*send) (void * buf, int len))
+{
+	send_replies = send;
+}
+
+void flush_commit ()
+{
+	char buf[FLUSH_QUEUE_LEN * (SIZEOF_reply() + sizeof(uint16_t))];
+	int len = 0, res;
+	uint64_t started;
+
+	if (!queued) return;
+
+	/* somebody else might have synced the filesystem already */
+	for (int i = 0; i < queued; i++)
+		if (flush_covered(queue + i)) flush_finish(queue + i, STAT_OK);
+
+	/* many files waiting on one filesystem -> syncfs() once */
+	for (int i = 0; i < queued; i++) {
+		int files = 0;
+		if (queue[i].done) continue;
+		for (int j = i; j < queued; j++) {
+			int seen = 0;
+			if (queue[j].done || queue[j].dev != queue[i].dev) continue;
+			for (int k = i; k < j && !seen; k++)
+				seen = !queue[k].done && queue[k].dev == queue[j].dev && queue[k].ino == queue[j].ino;
+			if (!seen) files++;
+		}
+		if (files < FLUSH_SYNCFS_THRESHOLD) continue;
+
+		started = now_ns();
+		RETRY1(res, syncfs(queue[i].fd));
+		/* before logging, which may write() and clobber errno */
+		res = res ? sync_errno_to_result(errno) : STAT_OK;
+		if (res == STAT_OK) flush_publish(queue[i].dev, started);
+		dbgp("group commit: syncfs over %d files", files);
+		for (int j = queued - 1; j >= i; j--)
+			if (!queue[j].done && queue[j].dev == queue[i].dev)
+				flush_finish(queue + j, res);
+	}
+
+	/* the rest is synced one file at a time, strongest mode wins */
+	for (int i = 0; i < queued; i++) {
+		int mode = queue[i].mode;
+		if (queue[i].done) continue;
+		for (int j = i + 1; j < queued; j++)
+			if (!queue[j].done && queue[j].dev == queue[i].dev && queue[j].ino == queue[i].ino
+			    && queue[j].mode > mode) mode = queue[j].mode;
+
+		if (mode == DURABLE_FULL) RETRY1(res, fsync(queue[i].fd));
+		else RETRY1(res, fdatasync(queue[i].fd));
+		res = res ? sync_errno_to_result(errno) : STAT_OK;
+
+		for (int j = queued - 1; j >= i; j--)
+			if (!queue[j].done && queue[j].dev == queue[i].dev && queue[j].ino == queue[i].ino)
+				flush_finish(queue + j, res);
+	}
+
+	/* release the replies, all in one go */
+	for (int i = 0; i < queued; i++) {
+		struct flush_req * r = queue + i;
+		if (r->with_count) {
+			len += pack_reply_p(buf + len, r->request_id, 0, r->result, sizeof(uint16_t));
+			len += pack(buf + len, "s", r->count);
+		} else {
+			len += pack_reply_p(buf + len, r->request_id, 0, r->result, 0);
+		}
+		RETRY1(res, close(r->fd));
+	}
+	dbgp("group commit: released %d replies", queued);
+	queued = 0;
+
+	send_replies(buf, len);
+}
@@ -0,0 +1,51 @@
+#ifndef FLUSH__H__
+#define FLUSH__H__
+
+#include <stdint.h>
+#include "paths.h"
+
+/* Group commit of sync requests.
+ *
+ * Commands that wait for durability (CMD_FLUSH, zero-length CMD_WRITE and
+ * WRITEs on handles with durability other than DURABLE_NONE) do not sync
+ * right away. Instead, they are queued here and their replies are held back.
+ * The queue is committed when the flush window closes: FLUSH_WINDOW_US after
+ * the first request was queued, when the queue fills up, or when the client
+ * has nothing more to say. Every file is then synced only once, and if many
+ * files on one filesystem are waiting, the whole filesystem is synced with
+ * one syncfs() call.
+ *
+ * syncfs() calls are published in shared memory, so that a session can skip
+ * its own sync if another session has synced the filesystem after the data
+ * was written. */
+
+/* maximum time a reply can be held back, in microseconds */
+#define FLUSH_WINDOW_US 2000
+/* maximum number of requests waiting for commit */
+#define FLUSH_QUEUE_LEN 64
+/* number of distinct files on one filesystem that triggers syncfs() */
+#define FLUSH_SYNCFS_THRESHOLD 8
+
+/* set up shared memory. must be called before forking sessions */
+void flush_init ();
+
+/* queue a sync of h->fd in the given DURABLE_* mode. reply is sent with
+ * request_id when the data is durable. if with_count is set, the reply
+ * carries `count` as uint16 (like WRITE replies do).
+ * returns STAT_OK if the request was queued, or an ERR_* code */
+int flush_queue (struct handle * h, uint16_t request_id, int mode, int with_count, uint16_t count);
+
+/* number of requests waiting for commit */
+int flush_pending ();
+
+/* milliseconds until the flush window closes, 0 if it already did,
+ * -1 if nothing is pending */
+int flush_timeout ();
+
+/* sync all queued files and send out held-back replies */
+void flush_commit ();
+
+/* where flush_commit sends the replies, safe_send_full by default */
+void flush_set_sender (int (*send) (void * buf, int len));
+
+#endif
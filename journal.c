@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "tools.h"
+
+/* "<end> <hex digest>\n" */
+#define LINE_MAX_LEN (20 + 1 + 2 * HASH_SIZE + 1)
+
+static void hash_restart (struct journal * j)
+{
+	if (j->hd) gnutls_hash_deinit(j->hd, NULL);
+	j->hd = NULL;
+	if (gnutls_hash_init(&j->hd, GNUTLS_DIG_SHA256) < 0) {
+		fprintf(stderr, "failed to initialize hashing\n");
+		exit(1);
+	}
+	j->pos = j->count ? j->ranges[j->count - 1].end : 0;
+}
+
+static int format_range (char * line, struct journal_range const * r)
+{
+	int len = sprintf(line, "%llu ", (unsigned long long)r->end);
+	for (int i = 0; i < HASH_SIZE; i++) len += sprintf(line + len, "%02x", r->digest[i]);
+	line[len++] = '\n';
+	return len;
+}
+
+static void write_out (struct journal * j, char const * buf, size_t len)
+{
+	/* a journal that can't be written only costs the ability to resume */
+	if (j->fd != -1 && write(j->fd, buf, len) != (ssize_t)len) {
+		fprintf(stderr, "failed to write %s: %s\n", j->name, strerror(errno));
+		close(j->fd);
+		j->fd = -1;
+	}
+}
+
+/* writes the header and the committed ranges to a fresh file */
+static void rewrite (struct journal * j)
+{
+	char line[LINE_MAX_LEN + 64];
+
+	if (j->fd != -1) close(j->fd);
+	j->fd = -1;
+	if (!j->kind) return;
+	j->fd = open(j->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (j->fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", j->name, strerror(errno));
+		return;
+	}
+	write_out(j, line, sprintf(line, "newtp-journal %s %llu %llu\n", j->kind,
+		(unsigned long long)j->size, (unsigned long long)j->mtime));
+	for (int i = 0; i < j->committed; i++) write_out(j, line, format_range(line, j->ranges + i));
+}
+
+static void add_range (struct journal * j, struct journal_range const * r)
+{
+	if (j->count == j->cap) {
+		j->cap = j->cap ? 2 * j->cap : 64;
+		j->ranges = xrealloc(j->ranges, sizeof(struct journal_range) * j->cap);
+	}
+	j->ranges[j->count++] = *r;
+}
+
+/* reads the ranges of an existing journal of the same source, up to the
+ * first line that is incomplete or out of order */
+static void load (struct journal * j)
+{
+	char head[64], line[LINE_MAX_LEN + 2];
+	unsigned long long size, mtime;
+	FILE * f = fopen(j->name, "r");
+
+	if (!f) return;
+	if (fscanf(f, "newtp-journal %63s %llu %llu\n", head, &size, &mtime) != 3 ||
+		strcmp(head, j->kind) || size != j->size || mtime != j->mtime) {
+		fclose(f);
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		struct journal_range r;
+		unsigned long long end;
+		char hex[2 * HASH_SIZE + 2];
+		int ok = 1;
+
+		if (!strchr(line, '\n') || sscanf(line, "%llu %65s", &end, hex) != 2 ||
+			strlen(hex) != 2 * HASH_SIZE) break;
+		r.end = end;
+		for (int i = 0; i < HASH_SIZE && ok; i++) {
+			unsigned int byte;
+			ok = sscanf(hex + 2 * i, "%2x", &byte) == 1;
+			r.digest[i] = byte;
+		}
+		if (!ok || r.end <= journal_end(j) || r.end > j->size) break;
+		add_range(j, &r);
+	}
+	fclose(f);
+}
+
+void journal_open (struct journal * j, char const * local, char const * kind, uint64_t size, uint64_t mtime)
+{
+	memset(j, 0, sizeof(struct journal));
+	pthread_mutex_init(&j->lock, NULL);
+	j->fd = -1;
+	j->kind = kind;
+	j->size = size;
+	j->mtime = mtime;
+	if (kind) {
+		j->name = xmalloc(strlen(local) + strlen(kind) + 8);
+		sprintf(j->name, "%s.newtp-%s", local, kind);
+		load(j);
+	}
+	j->committed = j->count;
+	rewrite(j);
+	hash_restart(j);
+}
+
+uint64_t journal_end (struct journal * j)
+{
+	return j->count ? j->ranges[j->count - 1].end : 0;
+}
+
+void journal_truncate (struct journal * j, int count)
+{
+	pthread_mutex_lock(&j->lock);
+	if (count < j->count) j->count = count;
+	if (j->committed > j->count) {
+		j->committed = j->count;
+		rewrite(j);
+	}
+	hash_restart(j);
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_hash (struct journal * j, char const * data, size_t len)
+{
+	int completed = 0;
+
+	pthread_mutex_lock(&j->lock);
+	while (len && j->pos < j->size) {
+		uint64_t boundary = (j->pos / JOURNAL_RANGE + 1) * JOURNAL_RANGE;
+		size_t n;
+
+		if (boundary > j->size) boundary = j->size;
+		n = (boundary - j->pos < len) ? boundary - j->pos : len;
+		gnutls_hash(j->hd, data, n);
+		j->pos += n;
+		data += n;
+		len -= n;
+		if (j->pos == boundary) {
+			struct journal_range r;
+			r.end = boundary;
+			gnutls_hash_output(j->hd, r.digest);
+			add_range(j, &r);
+			completed++;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	return completed;
+}
+
+void journal_commit (struct journal * j)
+{
+	char line[LINE_MAX_LEN];
+
+	pthread_mutex_lock(&j->lock);
+	if (j->committed < j->count) {
+		write_out(j, line, format_range(line, j->ranges + j->committed));
+		j->committed++;
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_remove (struct journal * j)
+{
+	if (j->name) unlink(j->name);
+	journal_close(j);
+}
+
+void journal_close (struct journal * j)
+{
+	if (j->fd != -1) close(j->fd);
+	if (j->hd) gnutls_hash_deinit(j->hd, NULL);
+	pthread_mutex_destroy(&j->lock);
+	free(j->ranges);
+	free(j->name);
+}
+
+static char file_buf[1024 * 1024];
+
+int journal_hash_file (struct journal * j, int fd, uint64_t end)
+{
+	uint64_t pos = j->pos;
+	int completed = 0;
+
+	while (pos < end) {
+		ssize_t n = pread(fd, file_buf, (end - pos > sizeof(file_buf)) ? sizeof(file_buf) : end - pos, pos);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		completed += journal_hash(j, file_buf, n);
+		pos += n;
+	}
+	return completed;
+}
+
+int hash_file_range (int fd, uint64_t offset, uint64_t len, unsigned char * digest)
+{
+	gnutls_hash_hd_t hd;
+	uint64_t done = 0;
+
+	if (gnutls_hash_init(&hd, GNUTLS_DIG_SHA256) < 0) return -1;
+	while (done < len) {
+		ssize_t n = pread(fd, file_buf, (len - done > sizeof(file_buf)) ? sizeof(file_buf) : len - done, offset + done);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			break;
+		}
+		gnutls_hash(hd, file_buf, n);
+		done += n;
+	}
+	gnutls_hash_deinit(hd, digest);
+	return (done == len) ? 0 : -1;
+}
@@ -0,0 +1,74 @@
+#ifndef JOURNAL__H__
+#define JOURNAL__H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <gnutls/crypto.h>
+
+#include "commands.h"
+
+/* Resume journals of the client.
+ *
+ * A get or put keeps a journal next to its local file. The first line
+ * names the source file by size and mtime; each further line records
+ * that the file is complete up to an offset, with the SHA-256 of the
+ * JOURNAL_RANGE bytes (fewer for the last range) before it. A range is
+ * only recorded once its data is on disk at the destination, so after a
+ * crash the journal never claims more than there is.
+ *
+ * A journal left by a transfer from a source that has changed since is
+ * ignored. The journal is removed when the transfer completes. */
+
+#define JOURNAL_RANGE (16 * 1024 * 1024)
+
+struct journal_range {
+	uint64_t end;
+	unsigned char digest[HASH_SIZE];
+};
+
+struct journal {
+	pthread_mutex_t lock;
+	char * name;
+	char const * kind;
+	int fd;			/* -1 if the journal can't be written */
+	uint64_t size, mtime;	/* of the source */
+
+	/* ranges hashed; the first committed ones are in the file */
+	struct journal_range * ranges;
+	int count, committed, cap;
+
+	/* hash of the data from the end of the last range up to pos */
+	gnutls_hash_hd_t hd;
+	uint64_t pos;
+};
+
+/* opens the journal of local for a transfer of the given direction
+ * ("get" or "put") from a source of this size and mtime, keeping its
+ * ranges if it was written for the same source */
+void journal_open (struct journal * j, char const * local, char const * kind, uint64_t size, uint64_t mtime);
+/* where the recorded ranges end */
+uint64_t journal_end (struct journal * j);
+/* forgets the ranges from the count-th on, in the file too, and any
+ * data fed since the last range */
+void journal_truncate (struct journal * j, int count);
+/* feeds the data following journal_end (and all data fed so far).
+ * returns the number of ranges it completed, which the caller commits
+ * once their data is on disk */
+int journal_hash (struct journal * j, char const * data, size_t len);
+/* writes out the oldest range completed but not yet committed */
+void journal_commit (struct journal * j);
+/* the transfer is complete: deletes the journal */
+void journal_remove (struct journal * j);
+void journal_close (struct journal * j);
+
+/* feeds the data of fd from where the hashing stands up to end, like
+ * journal_hash. returns the number of ranges completed, or -1 if the
+ * data can't all be read */
+int journal_hash_file (struct journal * j, int fd, uint64_t end);
+
+/* SHA-256 of len bytes of fd from offset. returns 0, or -1 if they
+ * can't all be read. these two share a buffer: one thread only */
+int hash_file_range (int fd, uint64_t offset, uint64_t len, unsigned char * digest);
+
+#endif
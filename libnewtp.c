@@ -0,0 +1,745 @@
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gnutls/gnutls.h>
+#include <gsasl.h>
+
+#include "commands.h"
+#include "common.h"
+#include "libnewtp.h"
+#include "log.h"
+#include "struct_helpers.h"
+#include "structs.h"
+#include "tools.h"
+
+#define REQUEST_IDS 65536
+
+struct newtp_conn {
+	int socket;
+	gnutls_session_t session;
+	gnutls_anon_client_credentials_t cred;
+	struct intro intro;
+	int broken;
+	int closing;
+
+	/* requests in flight, indexed by request_id */
+	struct newtp_req ** pending;
+	int in_flight;
+	int window;
+	uint16_t next_id;
+	unsigned long completed;
+
+	struct newtp_req * free_reqs;
+	int free_count;
+
+	/* lock protects everything above that changes after connecting.
+	 * cond is broadcast whenever a request completes */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* keeps commands of concurrent submitters whole on the wire */
+	pthread_mutex_t send_lock;
+	pthread_t receiver;
+	int threaded;
+};
+
+/**** transport ****/
+
+/* fails all requests in flight. their callbacks run as usual */
+static void conn_fail (struct newtp_conn * c, char const * why)
+{
+	struct newtp_req * callbacks = NULL, * r;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->broken) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	c->broken = 1;
+	for (int id = 0; id < REQUEST_IDS && c->in_flight > 0; id++) {
+		r = c->pending[id];
+		if (!r) continue;
+		c->pending[id] = NULL;
+		c->in_flight--;
+		c->completed++;
+		r->reply.request_id = id;
+		r->reply.extension = 0;
+		r->reply.result = ERR_FAIL;
+		r->reply.length = 0;
+		r->data = NULL;
+		r->failed = 1;
+		if (r->sending) continue;
+		r->done = 1;
+		/* requests without a callback may be freed by their waiter
+		 * as soon as the lock is released */
+		if (r->cb) {
+			r->next_free = callbacks;
+			callbacks = r;
+		}
+	}
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	if (!c->closing) errp("connection failed: %s", why);
+	while ((r = callbacks)) {
+		callbacks = r->next_free;
+		r->cb(r, r->arg);
+	}
+}
+
+/* 0 on success, -1 when the connection is (now) broken */
+static int conn_send (struct newtp_conn * c, char const * buf, int len)
+{
+	while (len > 0 && !c->broken) {
+		int w = gnutls_record_send(c->session, buf, len);
+		if (w > 0) {
+			buf += w; len -= w;
+		} else if (w < 0 && !gnutls_error_is_fatal(w)) {
+			continue;
+		} else {
+			conn_fail(c, w ? gnutls_strerror(w) : "connection closed");
+		}
+	}
+	return c->broken ? -1 : 0;
+}
+
+/* buf may be NULL, then the data is thrown away */
+static int conn_recv (struct newtp_conn * c, char * buf, int len)
+{
+	char scratch[16384];
+	while (len > 0 && !c->broken) {
+		char * to = buf ? buf : scratch;
+		int want = (buf || len < sizeof(scratch)) ? len : sizeof(scratch);
+		int r = gnutls_record_recv(c->session, to, want);
+		if (r > 0) {
+			if (buf) buf += r;
+			len -= r;
+		} else if (r < 0 && !gnutls_error_is_fatal(r)) {
+			continue;
+		} else {
+			conn_fail(c, r ? gnutls_strerror(r) : "connection closed by server");
+		}
+	}
+	return c->broken ? -1 : 0;
+}
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void grow (char ** buf, int * size, int need)
+{
+	if (*size >= need) return;
+	*buf = xrealloc(*buf, need);
+	*size = need;
+}
+
+/* receives one reply and completes its request.
+ * only one thread receives at a time: the receiver thread if there is
+ * one, otherwise the (single) thread using the connection */
+static int recv_one (struct newtp_conn * c)
+{
+	char hdr[SIZEOF_reply()];
+	struct reply reply;
+	struct newtp_req * r;
+	newtp_callback cb;
+	void * arg;
+
+	if (conn_recv(c, hdr, SIZEOF_reply()) < 0) return -1;
+	unpack_reply(hdr, SIZEOF_reply(), &reply);
+
+	pthread_mutex_lock(&c->lock);
+	r = c->pending[reply.request_id];
+	pthread_mutex_unlock(&c->lock);
+	if (!r) {
+		warnp("reply to unknown request 0x%04x, ignoring", reply.request_id);
+		return conn_recv(c, NULL, reply.length);
+	}
+
+	/* nobody else touches a request in flight */
+	if (r->dest && reply.length <= r->dest_size) {
+		r->data = r->dest;
+	} else {
+		grow(&r->in, &r->in_size, reply.length);
+		r->data = r->in;
+	}
+	if (conn_recv(c, r->data, reply.length) < 0) return -1;
+	r->done_ns = now_ns();
+
+	pthread_mutex_lock(&c->lock);
+	c->pending[reply.request_id] = NULL;
+	c->in_flight--;
+	c->completed++;
+	r->reply = reply;
+	cb = NULL;
+	arg = NULL;
+	if (!r->sending) {
+		r->done = 1;
+		cb = r->cb;
+		arg = r->arg;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (cb) cb(r, arg);
+	return 0;
+}
+
+static void * receiver_main (void * arg)
+{
+	struct newtp_conn * c = arg;
+	while (recv_one(c) == 0) { }
+	return NULL;
+}
+
+/**** requests ****/
+
+struct newtp_req * newtp_req_new (struct newtp_conn * c, uint8_t command, uint16_t handle)
+{
+	struct newtp_req * r;
+
+	pthread_mutex_lock(&c->lock);
+	r = c->free_reqs;
+	if (r) {
+		c->free_reqs = r->next_free;
+		c->free_count--;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (!r) {
+		r = xcalloc(sizeof(struct newtp_req));
+		r->conn = c;
+		grow(&r->out, &r->out_size, SIZEOF_command() + 64);
+	}
+
+	r->cmd.request_id = 0;
+	r->cmd.extension = 0;
+	r->cmd.command = command;
+	r->cmd.handle = handle;
+	r->cmd.length = 0;
+	memset(&r->reply, 0, sizeof(r->reply));
+	r->data = NULL;
+	r->done = r->failed = 0;
+	r->cb = NULL;
+	r->arg = NULL;
+	r->dest = NULL;
+	r->dest_size = 0;
+	r->next_free = NULL;
+	r->sending = 0;
+	return r;
+}
+
+char * newtp_req_payload (struct newtp_req * r, int len)
+{
+	assert(len >= 0 && len <= MAX_LENGTH);
+	grow(&r->out, &r->out_size, SIZEOF_command() + len);
+	r->cmd.length = len;
+	return r->out + SIZEOF_command();
+}
+
+void newtp_req_dest (struct newtp_req * r, char * buf, int size)
+{
+	r->dest = buf;
+	r->dest_size = size;
+}
+
+void newtp_req_free (struct newtp_req * r)
+{
+	struct newtp_conn * c;
+	if (!r) return;
+	c = r->conn;
+	pthread_mutex_lock(&c->lock);
+	/* a request in flight can't be freed, its reply would have nowhere to go */
+	assert(c->pending[r->cmd.request_id] != r);
+	if (c->free_count < NEWTP_POOL) {
+		r->next_free = c->free_reqs;
+		c->free_reqs = r;
+		c->free_count++;
+		r = NULL;
+	}
+	pthread_mutex_unlock(&c->lock);
+	/* the pool is full: don't keep more reply buffers around */
+	if (r) {
+		free(r->out);
+		free(r->in);
+		free(r);
+	}
+}
+
+int newtp_submit (struct newtp_req * r, newtp_callback cb, void * arg)
+{
+	struct newtp_conn * c = r->conn;
+	int ret;
+
+	r->cb = cb;
+	r->arg = arg;
+	r->done = r->failed = 0;
+
+	/* keep the pipe from overfilling: the server stops reading
+	 * commands when we don't read its replies */
+	pthread_mutex_lock(&c->lock);
+	while (c->in_flight >= c->window && !c->broken) {
+		if (c->threaded) {
+			pthread_cond_wait(&c->cond, &c->lock);
+		} else {
+			pthread_mutex_unlock(&c->lock);
+			recv_one(c);
+			pthread_mutex_lock(&c->lock);
+		}
+	}
+
+	if (c->broken) {
+		pthread_mutex_unlock(&c->lock);
+		r->reply.request_id = r->cmd.request_id;
+		r->reply.result = ERR_FAIL;
+		r->reply.length = 0;
+		r->failed = r->done = 1;
+		if (cb) cb(r, arg);
+		return -1;
+	}
+
+	while (c->pending[c->next_id]) c->next_id++;
+	r->cmd.request_id = c->next_id++;
+	c->pending[r->cmd.request_id] = r;
+	c->in_flight++;
+	r->sending = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	/* r is ours until conn_send returns: a reply, or conn_fail from
+	 * another thread, only takes it out of pending meanwhile */
+	pack_command(r->out, &r->cmd);
+	r->sent_ns = now_ns();
+	pthread_mutex_lock(&c->send_lock);
+	ret = conn_send(c, r->out, SIZEOF_command() + r->cmd.length);
+	pthread_mutex_unlock(&c->send_lock);
+
+	pthread_mutex_lock(&c->lock);
+	r->sending = 0;
+	if (c->pending[r->cmd.request_id] == r) {
+		pthread_mutex_unlock(&c->lock);
+		return ret;
+	}
+	/* the reply came, or the connection failed: complete r here */
+	r->done = 1;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	if (cb) cb(r, arg);
+	return ret;
+}
+
+int newtp_wait (struct newtp_req * r)
+{
+	struct newtp_conn * c = r->conn;
+
+	if (c->threaded) {
+		pthread_mutex_lock(&c->lock);
+		while (!r->done) pthread_cond_wait(&c->cond, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+	} else {
+		while (!r->done) {
+			if (recv_one(c) < 0) break;
+		}
+	}
+	assert(r->done);
+	return r->reply.result;
+}
+
+int newtp_run (struct newtp_req * r)
+{
+	newtp_submit(r, NULL, NULL);
+	return newtp_wait(r);
+}
+
+int newtp_poll (struct newtp_conn * c, int timeout)
+{
+	struct pollfd pfd;
+	int n = 0, ret;
+
+	if (c->broken) return -1;
+
+	if (c->threaded) {
+		struct timespec until;
+		unsigned long start;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += timeout / 1000;
+		until.tv_nsec += (long)(timeout % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&c->lock);
+		start = c->completed;
+		while (c->in_flight && c->completed == start && !c->broken) {
+			if (timeout < 0) pthread_cond_wait(&c->cond, &c->lock);
+			else if (pthread_cond_timedwait(&c->cond, &c->lock, &until)) break;
+		}
+		n = c->completed - start;
+		pthread_mutex_unlock(&c->lock);
+		return n;
+	}
+
+	if (!c->in_flight) return 0;
+
+	if (gnutls_record_check_pending(c->session) == 0) {
+		pfd.fd = c->socket;
+		pfd.events = POLLIN;
+		RETRY1(ret, poll(&pfd, 1, timeout));
+		if (ret <= 0) return 0;
+	}
+
+	/* take everything that has already arrived */
+	do {
+		if (recv_one(c) < 0) return -1;
+		n++;
+		ret = 1; /* buffered records are ready to take */
+		if (gnutls_record_check_pending(c->session) > 0) continue;
+		pfd.fd = c->socket;
+		pfd.events = POLLIN;
+		RETRY1(ret, poll(&pfd, 1, 0));
+	} while (c->in_flight && ret > 0);
+
+	return n;
+}
+
+int newtp_drain (struct newtp_conn * c)
+{
+	int ret;
+
+	if (c->threaded) {
+		pthread_mutex_lock(&c->lock);
+		while (c->in_flight && !c->broken) pthread_cond_wait(&c->cond, &c->lock);
+		ret = c->broken ? -1 : 0;
+		pthread_mutex_unlock(&c->lock);
+		return ret;
+	}
+
+	while (c->in_flight && !c->broken) recv_one(c);
+	return c->broken ? -1 : 0;
+}
+
+int newtp_start_receiver (struct newtp_conn * c)
+{
+	assert(!c->threaded);
+	/* whatever is in flight now will be received by the thread */
+	if (pthread_create(&c->receiver, NULL, receiver_main, c)) {
+		err("failed to start receiver thread");
+		return -1;
+	}
+	c->threaded = 1;
+	return 0;
+}
+
+int newtp_result_to_errno (int result)
+{
+	if (result < 0x80) return 0;
+	switch(result) {
+		case ERR_DENIED:   return -EACCES;
+		case ERR_BUSY:     return -EBUSY;
+		case ERR_BADPATH:
+		case ERR_NOTFOUND: return -ENOENT;
+		case ERR_NOTDIR:   return -ENOTDIR;
+		case ERR_NOTFILE:  return -ENFILE;
+
+		case ERR_BADOFFSET:return -EINVAL;
+		case ERR_TOOBIG:   return -EFBIG;
+		case ERR_DEVFULL:  return -ENOSPC;
+		case ERR_NOTEMPTY: return -ENOTEMPTY;
+		case ERR_EXISTS:   return -EEXIST;
+		default:           return -EIO;
+	}
+}
+
+void newtp_estimate_add (struct newtp_estimate * e, struct newtp_req const * r)
+{
+	uint64_t rtt;
+
+	if (!r->done || r->failed) return;
+	rtt = r->done_ns - r->sent_ns;
+	if (!e->rtt_ns || rtt < e->rtt_ns) e->rtt_ns = rtt;
+	/* replies of requests that were in flight together
+	 * are spaced by their transfer time */
+	if (r->sent_ns < e->last_done_ns && r->done_ns > e->last_done_ns) {
+		/* counting both ways covers uploads and downloads */
+		double bw = (double)(SIZEOF_command() + r->cmd.length + SIZEOF_reply() + r->reply.length)
+			/ (r->done_ns - e->last_done_ns);
+		e->bytes_per_ns = e->bytes_per_ns ? (7 * e->bytes_per_ns + bw) / 8 : bw;
+	}
+	e->last_done_ns = r->done_ns;
+}
+
+double newtp_estimate_bdp (struct newtp_estimate const * e)
+{
+	return e->bytes_per_ns * e->rtt_ns;
+}
+
+/**** connection ****/
+
+struct intro const * newtp_server_intro (struct newtp_conn * c)
+{
+	return &c->intro;
+}
+
+int newtp_broken (struct newtp_conn * c)
+{
+	return c->broken;
+}
+
+void newtp_set_window (struct newtp_conn * c, int window)
+{
+	assert(window > 0 && window < REQUEST_IDS);
+	c->window = window;
+}
+
+int newtp_in_flight (struct newtp_conn * c)
+{
+	return c->in_flight;
+}
+
+int newtp_fd (struct newtp_conn * c)
+{
+	return c->socket;
+}
+
+static int tls_connect (struct newtp_conn * c)
+{
+	char const * err;
+	int ret;
+
+	gnutls_global_init();
+	gnutls_init(&c->session, GNUTLS_CLIENT);
+	ret = gnutls_priority_set_direct(c->session,
+		"NORMAL:"
+		"+ANON-ECDH:"
+		"-COMP-ALL:+COMP-NULL:"
+		"-VERS-SSL3.0:-VERS-TLS1.0:-VERS-TLS1.1"
+		, &err);
+	if (ret != GNUTLS_E_SUCCESS) {
+		errp("error %s", gnutls_strerror(ret));
+		return -1;
+	}
+
+	gnutls_anon_allocate_client_credentials(&c->cred);
+	gnutls_credentials_set(c->session, GNUTLS_CRD_ANON, c->cred);
+	gnutls_transport_set_ptr(c->session, (void*)(uintptr_t)c->socket);
+
+	do { ret = gnutls_handshake(c->session); } while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
+	if (ret < 0) {
+		errp("TLS Handshake failed: %s", gnutls_strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+/* protocol intro, before any request can be sent */
+static int do_intro (struct newtp_conn * c)
+{
+	char buf[7 + SIZEOF_command()];
+	char * data;
+	struct reply reply;
+	uint16_t version;
+
+	pack(buf, "5Bs", "NewTP", (uint16_t)1);
+	pack_command_p(buf + 7, 0xffff, EXT_INIT, INIT_WELCOME, 0, 0);
+	if (conn_send(c, buf, 7 + SIZEOF_command()) < 0) return -1;
+	if (conn_recv(c, buf, 7 + SIZEOF_reply()) < 0) return -1;
+	if (strncmp(buf, "NewTP", 5)) {
+		err("server sent invalid intro string, closing connection");
+		return -1;
+	}
+	unpack(buf + 5, 2, "s", &version);
+	unpack_reply(buf + 7, SIZEOF_reply(), &reply);
+	if (version != 1 || reply.request_id != 0xffff ||
+	    reply.extension != EXT_INIT || reply.result != R_OK || reply.length == 0) {
+		errp("unsupported server intro (version %d, result 0x%02x)", version, reply.result);
+		return -1;
+	}
+
+	/* extensions following the intro are ignored, none are known yet */
+	data = xmalloc(reply.length);
+	if (conn_recv(c, data, reply.length) < 0 ||
+	    unpack_intro(data, reply.length, &c->intro) < 0) {
+		err("server intro packet too short");
+		free(data);
+		return -1;
+	}
+	free(data);
+
+	logp("server version %d on %s, max %d handles, max %d dirs",
+		version, c->intro.platform, c->intro.max_handles, c->intro.max_opendirs);
+	return 0;
+}
+
+static int sasl_callback(Gsasl * ctx, Gsasl_session * session, Gsasl_property prop)
+{
+	static char * password = NULL;
+	switch (prop) {
+		case GSASL_ANONYMOUS_TOKEN:
+			gsasl_property_set(session, prop, "anonymous");
+			return GSASL_OK;
+		case GSASL_PASSCODE:
+		case GSASL_PASSWORD:
+		case GSASL_AUTHID:
+			if (!password) {
+				password = xcalloc(1000);
+				printf("Enter password: ");
+				/* empty on EOF; delete newline, if there is one */
+				if (!fgets(password, 999, stdin)) password[0] = 0;
+				password[strcspn(password, "\n")] = 0;
+			}
+			gsasl_property_set(session, prop, password);
+			return GSASL_OK;
+		case GSASL_SERVICE:
+			gsasl_property_set(session, prop, "newtp");
+			return GSASL_OK;
+		case GSASL_HOSTNAME:
+			gsasl_property_set(session, prop, "localhost");
+			return GSASL_OK;
+		default:
+			return GSASL_NO_CALLBACK;
+	}
+}
+
+static int sasl_auth (struct newtp_conn * c, Gsasl * ctx)
+{
+	Gsasl_session * session;
+	struct newtp_req * r;
+	char const * mechanism = gsasl_client_suggest_mechanism(ctx, c->intro.authstr);
+	char * response;
+	size_t resp_size;
+	int ret, res;
+
+	gsasl_callback_set(ctx, sasl_callback);
+
+	if (mechanism) {
+		logp("using mechanism %s", mechanism);
+	} else {
+		err("failed to suggest mechanism");
+		return -1;
+	}
+
+	if (gsasl_client_start(ctx, mechanism, &session) != GSASL_OK) {
+		err("failed to start SASL session");
+		return -1;
+	}
+	r = newtp_req_new(c, SASL_START, 0);
+	r->cmd.extension = EXT_INIT;
+	memcpy(newtp_req_payload(r, strlen(mechanism)), mechanism, strlen(mechanism));
+
+	while ((res = newtp_run(r)) == SASL_R_CHALLENGE) {
+		ret = gsasl_step(session, r->data, r->reply.length, &response, &resp_size);
+		/* if we are done here, we still need to send empty(maybe?) response? */
+		if (ret != GSASL_OK && ret != GSASL_NEEDS_MORE) {
+			errp("SASL error %d: %s", ret, gsasl_strerror(ret));
+			res = SASL_E_FAILED;
+			break;
+		}
+		newtp_req_free(r);
+		r = newtp_req_new(c, SASL_RESPONSE, 0);
+		r->cmd.extension = EXT_INIT;
+		memcpy(newtp_req_payload(r, resp_size), response, resp_size);
+		free(response);
+	}
+	newtp_req_free(r);
+	gsasl_finish(session);
+
+	if (res != SASL_R_SUCCESS && res != SASL_R_SUCCESS_OPT) {
+		errp("authentication failed (0x%02x)", res);
+		return -1;
+	}
+	return 0;
+}
+
+struct newtp_conn * newtp_connect (char const * host, char const * port, Gsasl * ctx)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct newtp_conn * c;
+	int sock, yes = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res)) {
+		err("error resolving address");
+		return NULL;
+	}
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock == -1 || connect(sock, res->ai_addr, res->ai_addrlen)) {
+		errp("failed to connect: %s", strerror(errno));
+		if (sock != -1) close(sock);
+		freeaddrinfo(res);
+		return NULL;
+	}
+	freeaddrinfo(res);
+	/* pipelined commands are small, send them right away */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	c = xcalloc(sizeof(struct newtp_conn));
+	c->socket = sock;
+	c->pending = xcalloc(sizeof(struct newtp_req *) * REQUEST_IDS);
+	c->window = NEWTP_WINDOW;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_mutex_init(&c->send_lock, NULL);
+
+	if (tls_connect(c) < 0 || do_intro(c) < 0 || sasl_auth(c, ctx) < 0) {
+		c->broken = 1;
+		newtp_disconnect(c);
+		return NULL;
+	}
+	return c;
+}
+
+void newtp_disconnect (struct newtp_conn * c)
+{
+	struct newtp_req * r;
+
+	if (c->threaded) {
+		/* the receiver thread owns the reading side, so only say
+		 * goodbye and then cut the socket from under it */
+		newtp_drain(c);
+		c->closing = 1;
+		if (!c->broken) gnutls_bye(c->session, GNUTLS_SHUT_WR);
+		shutdown(c->socket, SHUT_RDWR);
+		pthread_join(c->receiver, NULL);
+	} else if (!c->broken) {
+		newtp_drain(c);
+		gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
+	}
+	close(c->socket);
+	if (c->session) gnutls_deinit(c->session);
+	if (c->cred) gnutls_anon_free_client_credentials(c->cred);
+	gnutls_global_deinit();
+
+	while ((r = c->free_reqs)) {
+		c->free_reqs = r->next_free;
+		free(r->out);
+		free(r->in);
+		free(r);
+	}
+	free(c->intro.platform);
+	free(c->intro.authstr);
+	free(c->pending);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->send_lock);
+	free(c);
+}
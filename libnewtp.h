@@ -0,0 +1,143 @@
+#ifndef LIBNEWTP__H__
+#define LIBNEWTP__H__
+
+#include <stdint.h>
+#include <gsasl.h>
+#include "structs.h"
+
+/* libnewtp - asynchronous client side of the protocol.
+ *
+ * A connection has its own TLS session and any number of requests in
+ * flight. Every request owns its command and reply buffers; replies are
+ * matched to requests by request_id, so they may come in any order.
+ *
+ * A request is either waited for like a future (newtp_wait), or given a
+ * callback, which is called from whichever newtp_wait/newtp_poll call
+ * receives the reply. Callbacks may submit more requests and free their
+ * own request.
+ *
+ * That is for a connection used by one thread. For many threads, start
+ * a receiver thread (newtp_start_receiver), which then takes all replies.
+ * From then on:
+ *  - newtp_req_*, newtp_submit, newtp_wait, newtp_run, newtp_poll and
+ *    newtp_drain may be called from any thread; newtp_poll and
+ *    newtp_drain only wait for the receiver.
+ *  - callbacks run on the receiver thread, so they must lock whatever
+ *    they share with other threads (writeback.c's write_done does).
+ *  - a callback must not block on the connection: no newtp_wait, newtp_run,
+ *    newtp_poll or newtp_drain, as no reply arrives while it runs. For
+ *    the same reason it must not submit when the window may be full.
+ *  - newtp_disconnect must not race with any other call.
+ *
+ * typical use:
+ *	r = newtp_req_new(c, CMD_STAT, handle);
+ *	memcpy(newtp_req_payload(r, len), query, len);
+ *	if (newtp_run(r) == STAT_OK) ... r->data, r->reply.length ...
+ *	newtp_req_free(r);
+ */
+
+#define NEWTP_PORT "63987"
+
+/* default number of requests in flight before newtp_submit waits */
+#define NEWTP_WINDOW 64
+/* freed requests kept for reuse, with their buffers */
+#define NEWTP_POOL   256
+
+struct newtp_conn;
+struct newtp_req;
+
+typedef void (*newtp_callback) (struct newtp_req * req, void * arg);
+
+struct newtp_req {
+	struct newtp_conn * conn;
+	struct command cmd;
+
+	/* valid once done is set. if the connection broke before the reply
+	 * came, failed is set and reply.result is ERR_FAIL */
+	struct reply reply;
+	char * data;		/* reply payload, reply.length bytes */
+	int done;
+	int failed;
+	/* monotonic times (ns) of sending and of receiving the reply */
+	uint64_t sent_ns;
+	uint64_t done_ns;
+
+	newtp_callback cb;
+	void * arg;
+
+	/* private */
+	char * out;		/* command packet followed by payload */
+	int out_size;
+	char * in;		/* reply payload, unless dest is set */
+	int in_size;
+	char * dest;
+	int dest_size;
+	struct newtp_req * next_free;
+	/* set while newtp_submit sends the command. a reply or failure
+	 * coming meanwhile leaves completing it to newtp_submit */
+	int sending;
+};
+
+/* connects to host:port, performs the intro and authenticates using ctx.
+ * returns NULL on failure */
+struct newtp_conn * newtp_connect (char const * host, char const * port, Gsasl * ctx);
+void newtp_disconnect (struct newtp_conn * c);
+
+/* the server's intro packet */
+struct intro const * newtp_server_intro (struct newtp_conn * c);
+/* nonzero once the connection has failed. all requests fail from then on */
+int newtp_broken (struct newtp_conn * c);
+
+/* maximum number of requests in flight. newtp_submit receives replies
+ * until the number drops below it */
+void newtp_set_window (struct newtp_conn * c, int window);
+int newtp_in_flight (struct newtp_conn * c);
+
+/* new request for command on handle, with empty payload.
+ * requests and their buffers are reused after newtp_req_free */
+struct newtp_req * newtp_req_new (struct newtp_conn * c, uint8_t command, uint16_t handle);
+/* sets payload length to len, returns where to write the payload */
+char * newtp_req_payload (struct newtp_req * r, int len);
+/* receive the reply payload straight into buf instead of the request's
+ * own buffer. longer replies are still received into the own buffer */
+void newtp_req_dest (struct newtp_req * r, char * buf, int size);
+void newtp_req_free (struct newtp_req * r);
+
+/* sends the request. cb may be NULL. returns 0, or -1 if the connection
+ * is broken, in which case the request completes as failed right away */
+int newtp_submit (struct newtp_req * r, newtp_callback cb, void * arg);
+/* waits for the reply of a submitted request and returns reply.result */
+int newtp_wait (struct newtp_req * r);
+/* newtp_submit without callback, then newtp_wait */
+int newtp_run (struct newtp_req * r);
+
+/* starts the receiver thread, for use from many threads (see the top
+ * of this file). call it after any fork(), threads don't survive it */
+int newtp_start_receiver (struct newtp_conn * c);
+
+/* receives replies for at most timeout ms (-1 waits forever) until at
+ * least one has arrived. returns number of replies received, -1 on failure */
+int newtp_poll (struct newtp_conn * c, int timeout);
+/* the socket of the connection, for waiting on many connections with
+ * poll(). newtp_poll(c, 0) then takes whatever has arrived, including
+ * what TLS had already buffered */
+int newtp_fd (struct newtp_conn * c);
+/* receives replies until nothing is in flight. returns -1 on failure */
+int newtp_drain (struct newtp_conn * c);
+
+/* negative errno for a reply result, 0 for success */
+int newtp_result_to_errno (int result);
+
+/* round-trip time and delivery rate of a connection, estimated from the
+ * timestamps of completed requests, fed in the order they were sent */
+struct newtp_estimate {
+	uint64_t rtt_ns;	/* the smallest seen */
+	double bytes_per_ns;	/* moving average, 0 until known */
+	uint64_t last_done_ns;
+};
+
+void newtp_estimate_add (struct newtp_estimate * e, struct newtp_req const * r);
+/* bandwidth-delay product in bytes, 0 until known */
+double newtp_estimate_bdp (struct newtp_estimate const * e);
+
+#endif /* LIBNEWTP__H__ */
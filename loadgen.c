@@ -0,0 +1,610 @@
+#include <locale.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gsasl.h>
+
+#include "commands.h"
+#include "common.h"
+#include "libnewtp.h"
+#include "struct_helpers.h"
+#include "structs.h"
+#include "tools.h"
+
+/* Load generator: many client sessions against one server.
+ *
+ * Each session is a connection of its own (so a server process of its
+ * own), issuing operations drawn at random from a mix. In closed loop,
+ * a session waits for each reply and then thinks for a random time
+ * before the next operation. In open loop (-r), operations arrive at
+ * random at a total rate regardless of replies, and their latency is
+ * counted from when they were due, so a server that falls behind shows
+ * it. Given several rates, each runs for the set time in turn, and the
+ * first one the server can't keep up with is reported as its saturation
+ * point. With -L, sessions are replaced after a number of operations,
+ * and the time to connect is reported as an operation of its own.
+ *
+ * Sessions are spread over threads, each waiting on its sessions'
+ * sockets with poll(). Results are one JSON object on stdout, with the
+ * latency distribution of each operation per step. The first tenth of
+ * each step is warmup and isn't counted.
+ *
+ * usage: ./loadgen [-P port] [-c sessions] [-j threads] [-t seconds]
+ *                  [-m mix] [-s size] [-z think_ms] [-r rate[,rate...]]
+ *                  [-L ops] [-n entries] [-l label] <host> <share>
+ *   mix: weights of stat, read, write, readdir and assign, e.g. the
+ *        default stat=70,read=20,readdir=10 */
+
+#define DATA_SIZE (8 * 1024 * 1024)
+#define MAX_STEPS 32
+#define MAX_THREADS 256
+/* ops in flight per session, and their due times kept for the replies */
+#define SESSION_WINDOW NEWTP_WINDOW
+#define DUE_RING (SESSION_WINDOW + 2)
+
+/* keep up with a rate if this much of it gets done */
+#define KEEP_UP 0.95
+
+#define H_DATA   1
+#define H_WRITE  2
+#define H_DIR    3
+#define H_ASSIGN 4
+
+enum { OP_STAT, OP_READ, OP_WRITE, OP_READDIR, OP_ASSIGN, OP_CONNECT, NOPS };
+static char const * const op_names[NOPS] = { "stat", "read", "write", "readdir", "assign", "connect" };
+
+static char * host, * base;
+static char const * port = NEWTP_PORT;
+static int sessions = 100, threads = 4, size = 4096, entries = 100, churn = 0;
+static double seconds = 10, think_ms = 0;
+static int mix[OP_CONNECT] = { 70, 20, 0, 10, 0 }, mix_total;
+static double rates[MAX_STEPS];
+static int nrates, nsteps = 1;
+static uint64_t t0, step_ns;
+
+struct samples {
+	uint64_t * v;
+	size_t n, cap;
+	uint64_t errors;
+};
+
+struct worker;
+
+struct session {
+	struct worker * w;
+	struct newtp_conn * conn;
+	uint64_t next_ns;	/* when the next op is due */
+	int busy;		/* closed loop: an op is in flight */
+	int ops_left;		/* before it's replaced, with -L */
+	uint64_t due[DUE_RING];
+	int head, count;
+};
+
+struct worker {
+	pthread_t thread;
+	Gsasl * ctx;
+	struct session * sessions;
+	int count;
+	struct pollfd * fds;
+	struct session ** polled;
+	uint64_t rng;
+	struct samples samples[MAX_STEPS][NOPS];
+};
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded per thread so runs repeat */
+static uint64_t next_random (struct worker * w)
+{
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double uniform (struct worker * w)
+{
+	return (next_random(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* exponentially distributed, with the given mean */
+static uint64_t exponential (struct worker * w, double mean_ns)
+{
+	return -mean_ns * log(1 - uniform(w));
+}
+
+static int step_of (uint64_t t)
+{
+	return (t < t0) ? 0 : (t - t0) / step_ns;
+}
+
+/* ns between arrivals at a session, at the rate of the step of t */
+static double interarrival (uint64_t t)
+{
+	int step = step_of(t);
+	if (step >= nsteps) step = nsteps - 1;
+	return 1e9 * sessions / rates[step];
+}
+
+static void record (struct worker * w, int op, uint64_t due, uint64_t done, int ok)
+{
+	struct samples * s;
+	int step = step_of(done);
+
+	if (done < t0 || step >= nsteps || (done - t0) % step_ns < step_ns / 10) return;
+	s = &w->samples[step][op];
+	if (!ok) {
+		s->errors++;
+		return;
+	}
+	if (s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 1024;
+		s->v = xrealloc(s->v, s->cap * sizeof(uint64_t));
+	}
+	s->v[s->n++] = done - due;
+}
+
+/**** operations ****/
+
+static struct newtp_req * request (struct session * s, uint8_t command, uint16_t handle, char const * payload, int len)
+{
+	struct newtp_req * r = newtp_req_new(s->conn, command, handle);
+	if (len) memcpy(newtp_req_payload(r, len), payload, len);
+	return r;
+}
+
+static void ignore_reply (struct newtp_req * r, void * arg)
+{
+	newtp_req_free(r);
+}
+
+static int op_of (uint8_t command)
+{
+	switch (command) {
+		case CMD_STAT:    return OP_STAT;
+		case CMD_READ:    return OP_READ;
+		case CMD_WRITE:   return OP_WRITE;
+		case CMD_READDIR: return OP_READDIR;
+		default:          return OP_ASSIGN;
+	}
+}
+
+static void op_done (struct newtp_req * r, void * arg)
+{
+	struct session * s = arg;
+	int op = op_of(r->cmd.command), ok;
+	uint64_t due = s->due[s->head];
+
+	s->head = (s->head + 1) % DUE_RING;
+	s->count--;
+	if (op == OP_READDIR) ok = r->reply.result == STAT_CONTINUED || r->reply.result == STAT_FINISHED;
+	else ok = r->reply.result == STAT_OK;
+	record(s->w, op, due, r->done_ns, ok);
+
+	if (!rates[0]) {
+		s->busy = 0;
+		s->next_ns = r->done_ns + exponential(s->w, think_ms * 1e6);
+	}
+	newtp_req_free(r);
+}
+
+static char * entry_path (int i, char * path, int len)
+{
+	snprintf(path, len, "%s/dir/f%06d", base, i);
+	return path;
+}
+
+static void issue (struct session * s, uint64_t due)
+{
+	static char const query[] = { ATTR_TYPE, ATTR_SIZE, ATTR_MTIME, ATTR_PERMS, ATTR_UID };
+	static char const attrs[] = { ATTR_RIGHTS, ATTR_MTIME, ATTR_PTYPE, ATTR_SIZE, ATTR_UID };
+	static char data[MAX_LENGTH];
+	struct worker * w = s->w;
+	struct newtp_req * r;
+	char path[1024];
+	int pick = next_random(w) % mix_total, op = 0;
+	uint64_t ofs = next_random(w) % (DATA_SIZE / size) * size;
+	char * p;
+
+	while (pick >= mix[op]) pick -= mix[op++];
+	switch (op) {
+		case OP_STAT:
+			r = request(s, CMD_STAT, H_DATA, query, sizeof(query));
+			break;
+		case OP_READ:
+			r = newtp_req_new(s->conn, CMD_READ, H_DATA);
+			pack_params_offlen_p(newtp_req_payload(r, SIZEOF_params_offlen()), ofs, size);
+			break;
+		case OP_WRITE:
+			r = newtp_req_new(s->conn, CMD_WRITE, H_WRITE);
+			p = newtp_req_payload(r, 8 + size);
+			pack(p, "l", ofs);
+			memcpy(p + 8, data, size);
+			break;
+		case OP_READDIR:
+			/* a listing from the start, its first page */
+			newtp_submit(request(s, CMD_REWINDDIR, H_DIR, NULL, 0), ignore_reply, NULL);
+			r = request(s, CMD_READDIR, H_DIR, attrs, sizeof(attrs));
+			break;
+		default:
+			entry_path(next_random(w) % entries, path, sizeof(path));
+			r = request(s, CMD_ASSIGN, H_ASSIGN, path, strlen(path));
+			break;
+	}
+	s->due[(s->head + s->count) % DUE_RING] = due;
+	s->count++;
+	if (churn) s->ops_left--;
+	newtp_submit(r, op_done, s);
+}
+
+/* connects the session and assigns its handles. a failure is retried
+ * on the next round. timed once the run has started */
+static void connect_session (struct session * s, int timed)
+{
+	char path[1024];
+	uint64_t start = now_ns();
+
+	s->conn = newtp_connect(host, port, s->w->ctx);
+	if (timed) record(s->w, OP_CONNECT, start, now_ns(), s->conn != NULL);
+	if (!s->conn) return;
+
+	newtp_set_window(s->conn, SESSION_WINDOW);
+	snprintf(path, sizeof(path), "%s/data", base);
+	newtp_submit(request(s, CMD_ASSIGN, H_DATA, path, strlen(path)), ignore_reply, NULL);
+	snprintf(path, sizeof(path), "%s/write", base);
+	newtp_submit(request(s, CMD_ASSIGN, H_WRITE, path, strlen(path)), ignore_reply, NULL);
+	snprintf(path, sizeof(path), "%s/dir", base);
+	newtp_submit(request(s, CMD_ASSIGN, H_DIR, path, strlen(path)), ignore_reply, NULL);
+	s->ops_left = churn;
+	s->busy = 0;
+	s->head = s->count = 0;
+}
+
+static void disconnect_session (struct session * s)
+{
+	newtp_disconnect(s->conn);
+	s->conn = NULL;
+}
+
+/**** threads ****/
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int connected;
+
+static void * worker_thread (void * arg)
+{
+	struct worker * w = arg;
+	uint64_t end;
+
+	for (int i = 0; i < w->count; i++) connect_session(w->sessions + i, 0);
+
+	pthread_mutex_lock(&start_lock);
+	connected++;
+	pthread_cond_broadcast(&start_cond);
+	while (!t0) pthread_cond_wait(&start_cond, &start_lock);
+	pthread_mutex_unlock(&start_lock);
+
+	/* spread the first ops out */
+	for (int i = 0; i < w->count; i++) {
+		struct session * s = w->sessions + i;
+		if (rates[0]) s->next_ns = t0 + exponential(w, interarrival(t0));
+		else s->next_ns = t0 + uniform(w) * think_ms * 1e6;
+	}
+	end = t0 + nsteps * step_ns;
+
+	for (;;) {
+		uint64_t now = now_ns(), wake = now + 10000000;
+		int nfds = 0, ready;
+
+		if (now >= end) break;
+		for (int i = 0; i < w->count; i++) {
+			struct session * s = w->sessions + i;
+
+			if (s->conn && newtp_broken(s->conn)) disconnect_session(s);
+			if (s->conn && churn && s->ops_left <= 0 && !newtp_in_flight(s->conn)) disconnect_session(s);
+			if (!s->conn) {
+				connect_session(s, 1);
+				if (!s->conn) continue;
+				now = now_ns();
+			}
+
+			/* arrivals wait while a session that's due for replacing
+			 * winds down, and keep their due times */
+			if (rates[0]) {
+				while (s->next_ns <= now && (!churn || s->ops_left > 0) &&
+					newtp_in_flight(s->conn) < SESSION_WINDOW) {
+					issue(s, s->next_ns);
+					s->next_ns += exponential(w, interarrival(s->next_ns));
+				}
+			} else if (!s->busy && s->next_ns <= now && (!churn || s->ops_left > 0)) {
+				s->busy = 1;
+				issue(s, now);
+			}
+			if ((rates[0] || !s->busy) && s->next_ns < wake) wake = s->next_ns;
+
+			if (newtp_in_flight(s->conn)) {
+				w->fds[nfds].fd = newtp_fd(s->conn);
+				w->fds[nfds].events = POLLIN;
+				w->polled[nfds++] = s;
+			}
+		}
+
+		now = now_ns();
+		ready = poll(w->fds, nfds, (wake > now) ? (wake - now) / 1000000 : 0);
+		for (int i = 0; i < nfds; i++) {
+			/* without anything on the sockets, look for replies TLS
+			 * took in already */
+			if (ready > 0 && !w->fds[i].revents) continue;
+			newtp_poll(w->polled[i]->conn, 0);
+		}
+	}
+
+	for (int i = 0; i < w->count; i++) {
+		struct session * s = w->sessions + i;
+		if (!s->conn) continue;
+		newtp_drain(s->conn);
+		disconnect_session(s);
+	}
+	return NULL;
+}
+
+/**** results ****/
+
+static int compare_u64 (void const * a, void const * b)
+{
+	uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+/* merges the samples of all workers for a step and op */
+static struct samples merge (struct worker * workers, int step, int op)
+{
+	struct samples m;
+
+	memset(&m, 0, sizeof(m));
+	for (int i = 0; i < threads; i++) {
+		struct samples * s = &workers[i].samples[step][op];
+		m.v = xrealloc(m.v, (m.n + s->n + 1) * sizeof(uint64_t));
+		memcpy(m.v + m.n, s->v, s->n * sizeof(uint64_t));
+		m.n += s->n;
+		m.errors += s->errors;
+	}
+	qsort(m.v, m.n, sizeof(uint64_t), compare_u64);
+	return m;
+}
+
+static uint64_t percentile (struct samples const * m, double p)
+{
+	return m->n ? m->v[(size_t)((m->n - 1) * p)] : 0;
+}
+
+static void print_results (struct worker * workers, char const * label)
+{
+	double counted = 0.9 * step_ns / 1e9, best = 0;
+	double saturation = 0;
+
+	printf("{\n  \"label\": \"%s\",\n  \"host\": \"%s\",\n  \"sessions\": %d,\n  \"threads\": %d,\n",
+		label, host, sessions, threads);
+	printf("  \"seconds\": %g,\n  \"size\": %d,\n  \"think_ms\": %g,\n  \"churn_ops\": %d,\n  \"mix\": {",
+		seconds, size, think_ms, churn);
+	for (int op = 0, first = 1; op < OP_CONNECT; op++) {
+		if (!mix[op]) continue;
+		printf("%s \"%s\": %d", first ? "" : ",", op_names[op], mix[op]);
+		first = 0;
+	}
+	printf(" },\n  \"steps\": [\n");
+
+	for (int step = 0; step < nsteps; step++) {
+		uint64_t total = 0;
+		int first = 1;
+
+		printf("    { \"offered_ops_per_s\": ");
+		if (rates[0]) printf("%g", rates[step]);
+		else printf("null");
+		printf(",\n      \"ops\": {\n");
+		for (int op = 0; op < NOPS; op++) {
+			struct samples m = merge(workers, step, op);
+			if (op != OP_CONNECT) total += m.n;
+			if (m.n || m.errors) {
+				printf("%s        \"%s\": { \"count\": %zu, \"errors\": %llu, \"ops_per_s\": %.1f, "
+					"\"latency_ns\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu } }",
+					first ? "" : ",\n", op_names[op], m.n, (unsigned long long)m.errors, m.n / counted,
+					(unsigned long long)percentile(&m, 0.5), (unsigned long long)percentile(&m, 0.99),
+					(unsigned long long)percentile(&m, 0.999), (unsigned long long)(m.n ? m.v[m.n - 1] : 0));
+				first = 0;
+			}
+			free(m.v);
+		}
+		printf("\n      },\n      \"ops_per_s\": %.1f }%s\n", total / counted, (step + 1 < nsteps) ? "," : "");
+		if (total / counted > best) best = total / counted;
+		if (rates[0] && !saturation && total / counted < KEEP_UP * rates[step]) saturation = rates[step];
+	}
+	printf("  ],\n  \"max_ops_per_s\": %.1f,\n  \"saturated_at_ops_per_s\": ", best);
+	if (saturation) printf("%g\n}\n", saturation);
+	else printf("null\n}\n");
+}
+
+/**** setup ****/
+
+static void check_free (struct newtp_req * r, void * arg)
+{
+	if (r->reply.result != STAT_OK && r->reply.result != ERR_EXISTS) {
+		fprintf(stderr, "setup failed: 0x%x\n", r->reply.result);
+		exit(1);
+	}
+	newtp_req_free(r);
+}
+
+static void setup_send (struct newtp_conn * c, uint8_t command, uint16_t handle, char const * payload, int len)
+{
+	struct newtp_req * r = newtp_req_new(c, command, handle);
+	if (len) memcpy(newtp_req_payload(r, len), payload, len);
+	newtp_submit(r, check_free, NULL);
+}
+
+/* the file read, the file written and the directory of entries */
+static void setup (Gsasl * ctx)
+{
+	static char chunk[MAX_LENGTH];
+	struct newtp_conn * c = newtp_connect(host, port, ctx);
+	char path[1024];
+
+	if (!c) exit(1);
+	setup_send(c, CMD_ASSIGN, 1, base, strlen(base));
+	setup_send(c, CMD_MAKEDIR, 1, NULL, 0);
+	snprintf(path, sizeof(path), "%s/dir", base);
+	setup_send(c, CMD_ASSIGN, 1, path, strlen(path));
+	setup_send(c, CMD_MAKEDIR, 1, NULL, 0);
+
+	snprintf(path, sizeof(path), "%s/data", base);
+	setup_send(c, CMD_ASSIGN, 2, path, strlen(path));
+	for (uint64_t pos = 0; pos < DATA_SIZE; pos += MAX_LENGTH - 8) {
+		int len = (DATA_SIZE - pos < MAX_LENGTH - 8) ? DATA_SIZE - pos : MAX_LENGTH - 8;
+		pack(chunk, "l", pos);
+		setup_send(c, CMD_WRITE, 2, chunk, 8 + len);
+	}
+
+	/* an empty WRITE creates a file */
+	pack(chunk, "l", (uint64_t)0);
+	snprintf(path, sizeof(path), "%s/write", base);
+	setup_send(c, CMD_ASSIGN, 3, path, strlen(path));
+	setup_send(c, CMD_WRITE, 3, chunk, 8);
+	for (int i = 0; i < entries; i++) {
+		entry_path(i, path, sizeof(path));
+		setup_send(c, CMD_ASSIGN, 3, path, strlen(path));
+		setup_send(c, CMD_WRITE, 3, chunk, 8);
+	}
+	if (newtp_drain(c) == -1) exit(1);
+	newtp_disconnect(c);
+}
+
+/* "stat=70,read=20,readdir=10" */
+static int parse_mix (char * spec)
+{
+	memset(mix, 0, sizeof(mix));
+	for (char * item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+		char * eq = strchr(item, '=');
+		int op;
+
+		if (!eq) return -1;
+		*eq = 0;
+		for (op = 0; op < OP_CONNECT && strcmp(item, op_names[op]); op++);
+		if (op == OP_CONNECT || atoi(eq + 1) < 0) return -1;
+		mix[op] = atoi(eq + 1);
+	}
+	return 0;
+}
+
+static void usage (char const * prog)
+{
+	fprintf(stderr, "usage: %s [-P port] [-c sessions] [-j threads] [-t seconds] [-m mix] [-s size]\n"
+		"       [-z think_ms] [-r rate[,rate...]] [-L ops] [-n entries] [-l label] <host> <share>\n"
+		"mix: weights of stat, read, write, readdir and assign (default stat=70,read=20,readdir=10)\n",
+		prog);
+	exit(1);
+}
+
+int main (int argc, char ** argv)
+{
+	static struct worker workers[MAX_THREADS];
+	char const * label = "";
+	struct rlimit rl;
+	struct session * all;
+	int opt;
+	Gsasl * ctx;
+
+	setlocale(LC_ALL, "");
+
+	while ((opt = getopt(argc, argv, "P:c:j:t:m:s:z:r:L:n:l:")) != -1) {
+		if (opt == 'P') port = optarg;
+		else if (opt == 'c') sessions = atoi(optarg);
+		else if (opt == 'j') threads = atoi(optarg);
+		else if (opt == 't') seconds = atof(optarg);
+		else if (opt == 'm') {
+			if (parse_mix(optarg) == -1) usage(argv[0]);
+		} else if (opt == 's') size = atoi(optarg);
+		else if (opt == 'z') think_ms = atof(optarg);
+		else if (opt == 'r') {
+			for (char * r = strtok(optarg, ","); r && nrates < MAX_STEPS; r = strtok(NULL, ","))
+				rates[nrates++] = atof(r);
+		} else if (opt == 'L') churn = atoi(optarg);
+		else if (opt == 'n') entries = atoi(optarg);
+		else if (opt == 'l') label = optarg;
+		else usage(argv[0]);
+	}
+	if (argc - optind != 2) usage(argv[0]);
+	for (int op = 0; op < OP_CONNECT; op++) mix_total += mix[op];
+	for (int i = 0; i < nrates; i++) if (rates[i] <= 0) usage(argv[0]);
+	if (sessions < 1 || threads < 1 || threads > MAX_THREADS || seconds <= 0 || !mix_total ||
+		size < 1 || size > MAX_LENGTH - 8 || entries < 1 || churn < 0 || think_ms < 0)
+		usage(argv[0]);
+	if (threads > sessions) threads = sessions;
+	if (nrates) nsteps = nrates;
+	step_ns = seconds * 1e9;
+
+	host = argv[optind];
+	base = xmalloc(strlen(argv[optind + 1]) + 16);
+	sprintf(base, "/%s/loadgen", argv[optind + 1]);
+
+	/* a socket per session */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (gsasl_init(&ctx) != GSASL_OK) {
+		fprintf(stderr, "failed to initialize SASL\n");
+		return 1;
+	}
+	setup(ctx);
+	gsasl_done(ctx);
+
+	all = xmalloc(sizeof(struct session) * sessions);
+	memset(all, 0, sizeof(struct session) * sessions);
+	for (int i = 0, first = 0; i < threads; i++) {
+		struct worker * w = workers + i;
+		w->count = sessions / threads + (i < sessions % threads);
+		w->sessions = all + first;
+		first += w->count;
+		w->fds = xmalloc(sizeof(struct pollfd) * w->count);
+		w->polled = xmalloc(sizeof(struct session *) * w->count);
+		w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		for (int j = 0; j < w->count; j++) w->sessions[j].w = w;
+		if (gsasl_init(&w->ctx) != GSASL_OK) {
+			fprintf(stderr, "failed to initialize SASL\n");
+			return 1;
+		}
+		if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+			fprintf(stderr, "failed to start thread\n");
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "connecting %d sessions\n", sessions);
+	pthread_mutex_lock(&start_lock);
+	while (connected < threads) pthread_cond_wait(&start_cond, &start_lock);
+	t0 = now_ns();
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_lock);
+	fprintf(stderr, "running %d step(s) of %g s\n", nsteps, seconds);
+
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		gsasl_done(workers[i].ctx);
+	}
+	print_results(workers, label);
+	return 0;
+}
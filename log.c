@@ -0,0 +1,234 @@
+#define _DEFAULT_SOURCE /* syscall */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+#include "tools.h"
+
+#define LOG_RING_SLOTS 256	/* must be a power of two */
+#define LOG_LINE_MAX   256
+
+static char const * const prefix[] = {
+	[LOG_ERR]   = "** ERR: ",
+	[LOG_WARN]  = "* WARN: ",
+	[LOG_INFO]  = "(info): ",
+	[LOG_DEBUG] = "(dbg):  ",
+};
+
+/* single-producer single-consumer ring. the owning thread moves head,
+ * the writer thread moves tail. */
+struct log_ring {
+	struct log_ring * next;
+	int in_use;	/* owned by a live thread */
+	unsigned head;
+	unsigned tail;
+	unsigned short len[LOG_RING_SLOTS];
+	char line[LOG_RING_SLOTS][LOG_LINE_MAX];
+};
+
+static struct log_ring * rings = NULL;
+static __thread struct log_ring * my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer;
+static int running = 0;		/* writer thread exists in this process */
+static int stopping = 0;
+/* the writer sleeps on this futex once all rings are empty. the first
+ * producer to find it set clears it and wakes the writer, so an idle
+ * process costs no wakeups and a busy one no syscalls */
+static int sleeping = 0;
+static pid_t pid;
+static unsigned long dropped = 0;
+static unsigned long dropped_reported = 0;
+
+/* thread exit: give the ring to whoever comes next. the writer still
+ * drains whatever is left in it. */
+static void ring_release (void * ring)
+{
+	__atomic_store_n(&((struct log_ring *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create ()
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+static struct log_ring * ring_get ()
+{
+	struct log_ring * r;
+	if (my_ring) return my_ring;
+
+	pthread_once(&ring_key_once, ring_key_create);
+
+	/* reuse a ring left behind by a finished thread */
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!r) {
+		r = xcalloc(sizeof(struct log_ring));
+		r->in_use = 1;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { }
+	}
+
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+static int format_line (char * buf, int level, char const * format, va_list ap)
+{
+	int len = snprintf(buf, LOG_LINE_MAX, "child %d: %s", (int)pid, prefix[level]);
+	len += vsnprintf(buf + len, LOG_LINE_MAX - len, format, ap);
+	if (len > LOG_LINE_MAX - 1) len = LOG_LINE_MAX - 1; /* truncated */
+	buf[len++] = '\n';
+	return len;
+}
+
+static void wake_writer ()
+{
+	if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_ACQ_REL))
+		syscall(SYS_futex, &sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void log_write (int level, char const * format, ...)
+{
+	va_list ap;
+	struct log_ring * r;
+	unsigned head;
+	int w;
+
+	va_start(ap, format);
+
+	if (!running) {
+		char buf[LOG_LINE_MAX];
+		pid = getpid();
+		RETRY1(w, write(STDERR_FILENO, buf, format_line(buf, level, format, ap)));
+		va_end(ap);
+		return;
+	}
+
+	r = ring_get();
+	head = r->head; /* only we write it */
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		va_end(ap);
+		return;
+	}
+	r->len[head % LOG_RING_SLOTS] = format_line(r->line[head % LOG_RING_SLOTS], level, format, ap);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	/* pairs with the fence in writer_main: either it sees the new head,
+	 * or we see it sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) wake_writer();
+
+	va_end(ap);
+}
+
+/* write out everything buffered so far, returns number of lines */
+static int drain ()
+{
+	struct iovec iov[64];
+	int total = 0, w;
+	unsigned long d;
+
+	for (struct log_ring * r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		unsigned tail = r->tail;
+		while (tail != head) {
+			int n = 0;
+			for (; tail + n != head && n < 64; n++) {
+				iov[n].iov_base = r->line[(tail + n) % LOG_RING_SLOTS];
+				iov[n].iov_len = r->len[(tail + n) % LOG_RING_SLOTS];
+			}
+			/* a short write to stderr loses the rest of the batch, that's acceptable */
+			RETRY1(w, writev(STDERR_FILENO, iov, n));
+			tail += n;
+			total += n;
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (d != dropped_reported) {
+		char buf[LOG_LINE_MAX];
+		int len = snprintf(buf, sizeof(buf), "child %d: %s%lu log messages dropped\n",
+			(int)pid, prefix[LOG_WARN], d - dropped_reported);
+		RETRY1(w, write(STDERR_FILENO, buf, len));
+		dropped_reported = d;
+	}
+	return total;
+}
+
+static void * writer_main (void * arg)
+{
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (drain()) continue;
+		__atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* something may have come in before we said we're sleeping */
+		if (drain() || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* returns at once if a producer has cleared it meanwhile */
+		syscall(SYS_futex, &sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+		__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+void log_init ()
+{
+	static int registered = 0;
+
+	pid = getpid();
+	/* in a forked child, the rings hold the parent's messages, which
+	 * the parent is going to write itself */
+	for (struct log_ring * r = rings; r; r = r->next) r->tail = r->head;
+	dropped_reported = dropped;
+	stopping = 0;
+	sleeping = 0;
+
+	if (pthread_create(&writer, NULL, writer_main, NULL)) {
+		running = 0; /* stay synchronous */
+		return;
+	}
+	running = 1;
+	if (!registered) {
+		atexit(log_shutdown);
+		registered = 1;
+	}
+}
+
+void log_shutdown ()
+{
+	if (!running) return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wake_writer();
+	pthread_join(writer, NULL);
+	running = 0;
+	drain();
+}
+
+unsigned long log_dropped ()
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -1,23 +1,52 @@
 #ifndef LOG__H__
 #define LOG__H__
 
-#include <stdio.h>
-#include <unistd.h>
+/* Leveled logging.
+ *
+ * Messages below LOG_LEVEL are compiled out (arguments are still
+ * type-checked, but never evaluated). Build with -DLOG_LEVEL=LOG_DEBUG
+ * to get per-command traces.
+ *
+ * After log_init(), messages are formatted into a per-thread ring buffer
+ * and written to stderr by a background thread, so callers never block
+ * on stderr. If a ring is full, the message is dropped and counted.
+ * Before log_init() (or after fork() in a process that doesn't call it
+ * again), messages are written to stderr directly. */
 
-#define ERR_STR  "** ERR: "
-#define WARN_STR "* WARN: "
-#define INFO_STR "(info): "
+#define LOG_ERR   0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
 
-#define log__base_p(p, s, ...) fprintf(stderr, "child %d: " p s "\n", getpid(), __VA_ARGS__)
-#define log__base(p, s) fprintf(stderr, "child %d: " p s "\n", getpid())
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+/* start the background writer for this process.
+ * call again in a forked child that wants asynchronous logging */
+void log_init ();
+/* write out everything that's buffered and stop the writer.
+ * registered with atexit() by log_init() */
+void log_shutdown ();
+/* number of messages dropped because a ring was full */
+unsigned long log_dropped ();
+
+void log_write (int level, char const * format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define log__base_p(l, s, ...) do { if ((l) <= LOG_LEVEL) log_write((l), s, __VA_ARGS__); } while (0)
+#define log__base(l, s) do { if ((l) <= LOG_LEVEL) log_write((l), "%s", s); } while (0)
+
+#define err(s) log__base(LOG_ERR, s)
+#define errp(s, ...) log__base_p(LOG_ERR, s, __VA_ARGS__)
 
-#define err(s) log__base(ERR_STR, s)
-#define errp(s, ...) log__base_p(ERR_STR, s, __VA_ARGS__)
+#define warn(s) log__base(LOG_WARN, s)
+#define warnp(s, ...) log__base_p(LOG_WARN, s, __VA_ARGS__)
 
-#define warn(s) log__base(WARN_STR, s)
-#define warnp(s, ...) log__base_p(WARN_STR, s, __VA_ARGS__)
+#define log(s) log__base(LOG_INFO, s)
+#define logp(s, ...) log__base_p(LOG_INFO, s, __VA_ARGS__)
 
-#define log(s) log__base(INFO_STR, s)
-#define logp(s, ...) log__base_p(INFO_STR, s, __VA_ARGS__)
+#define dbg(s) log__base(LOG_DEBUG, s)
+#define dbgp(s, ...) log__base_p(LOG_DEBUG, s, __VA_ARGS__)
 
 #endif
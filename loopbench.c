@@ -0,0 +1,441 @@
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gsasl.h>
+
+#include "commands.h"
+#include "common.h"
+#include "libnewtp.h"
+#include "log.h"
+#include "struct_helpers.h"
+#include "structs.h"
+#include "tools.h"
+
+/* Loopback benchmark of the server.
+ *
+ * Runs each workload against a running server for a fixed time, with a
+ * fixed number of requests in flight on one connection, and prints the
+ * results as one JSON object: operations and payload bytes per second,
+ * and percentiles of the latency from sending a request to receiving
+ * its reply. The first tenth of the time is warmup and isn't counted.
+ * The workloads work in <share>/loopbench, which is created as needed.
+ * bench.sh runs them against a server of its own (make bench).
+ *
+ * usage: ./loopbench [-P port] [-t seconds] [-d depth] [-s size] [-n entries]
+ *                    [-l label] <host> <share> [workload...]
+ *   workloads: read, write, stat, readdir, assign (default: all) */
+
+#define DATA_SIZE (64 * 1024 * 1024)	/* of the files read and written */
+#define MAX_DEPTH 1024
+
+/* handles: the files read and written, the directory (one handle per
+ * listing in flight), and one per ASSIGN in flight */
+#define H_SETUP 1
+#define H_READ  2
+#define H_WRITE 3
+#define H_DIR   4
+#define H_ASSIGN (H_DIR + 64)
+
+#define ATTRIBUTES "\x01\x06\x10\x02\x13"
+
+static struct newtp_conn * conn;
+static char * base;
+static int depth = 8, size = 32768, entries = 1000;
+static double seconds = 5;
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct newtp_req * request (uint8_t command, uint16_t handle, char const * payload, int len)
+{
+	struct newtp_req * r = newtp_req_new(conn, command, handle);
+	if (len) memcpy(newtp_req_payload(r, len), payload, len);
+	return r;
+}
+
+static void check_free (struct newtp_req * r, void * arg)
+{
+	if (r->reply.result != STAT_OK) {
+		fprintf(stderr, "%s failed: 0x%x\n", (char *)arg, r->reply.result);
+		exit(1);
+	}
+	newtp_req_free(r);
+}
+
+/* sends a request whose reply is only checked */
+static void send_checked (uint8_t command, uint16_t handle, char const * payload, int len, char * what)
+{
+	newtp_submit(request(command, handle, payload, len), check_free, what);
+}
+
+static void assign (uint16_t handle, char const * path)
+{
+	send_checked(CMD_ASSIGN, handle, path, strlen(path), "ASSIGN");
+}
+
+static char * entry_path (int i)
+{
+	static char path[1024];
+	snprintf(path, sizeof(path), "%s/dir/f%06d", base, i);
+	return path;
+}
+
+static void make_dir (char const * path)
+{
+	struct newtp_req * r;
+	int res;
+
+	assign(H_SETUP, path);
+	r = request(CMD_MAKEDIR, H_SETUP, NULL, 0);
+	res = newtp_run(r);
+	newtp_req_free(r);
+	if (res != STAT_OK && res != ERR_EXISTS) {
+		fprintf(stderr, "failed to create %s: 0x%x\n", path, res);
+		exit(1);
+	}
+}
+
+/* the data file, the file written to and the directory of entries */
+static void setup ()
+{
+	static char chunk[MAX_LENGTH];
+	char path[1024];
+	uint64_t pos;
+
+	make_dir(base);
+	snprintf(path, sizeof(path), "%s/dir", base);
+	make_dir(path);
+
+	snprintf(path, sizeof(path), "%s/data", base);
+	assign(H_READ, path);
+	for (int i = 0; i < MAX_LENGTH; i++) chunk[i] = i * 7;
+	for (pos = 0; pos < DATA_SIZE; pos += MAX_LENGTH - 8) {
+		int len = (DATA_SIZE - pos < MAX_LENGTH - 8) ? DATA_SIZE - pos : MAX_LENGTH - 8;
+		pack(chunk, "l", pos);
+		send_checked(CMD_WRITE, H_READ, chunk, 8 + len, "WRITE");
+	}
+	snprintf(path, sizeof(path), "%s/write", base);
+	assign(H_WRITE, path);
+
+	/* an empty WRITE creates a file */
+	pack(chunk, "l", (uint64_t)0);
+	for (int i = 0; i < entries; i++) {
+		assign(H_SETUP, entry_path(i));
+		send_checked(CMD_WRITE, H_SETUP, chunk, 8, "WRITE");
+	}
+	if (newtp_drain(conn) == -1) exit(1);
+}
+
+/**** workloads ****/
+
+struct workload {
+	char const * name;
+	/* sets the workload up for depth requests in flight, returns how
+	 * many it can have. may be NULL */
+	int (*prepare) (int depth);
+	/* the next request of a slot, not yet submitted */
+	struct newtp_req * (*next) (int slot);
+	/* checks a reply, returns the number of items it carried */
+	int (*done) (int slot, struct newtp_req * r);
+};
+
+static uint64_t counter;
+
+static struct newtp_req * next_offlen (uint8_t command, uint16_t handle)
+{
+	static char data[MAX_LENGTH];
+	uint64_t ofs = counter++ * size % (DATA_SIZE - size + 1);
+	struct newtp_req * r = newtp_req_new(conn, command, handle);
+	char * p;
+
+	if (command == CMD_READ) {
+		pack_params_offlen_p(newtp_req_payload(r, SIZEOF_params_offlen()), ofs, size);
+	} else {
+		p = newtp_req_payload(r, 8 + size);
+		pack(p, "l", ofs);
+		memcpy(p + 8, data, size);
+	}
+	return r;
+}
+
+static int done_ok (int slot, struct newtp_req * r)
+{
+	return r->reply.result == STAT_OK ? 1 : -1;
+}
+
+static struct newtp_req * next_read (int slot)
+{
+	return next_offlen(CMD_READ, H_READ);
+}
+
+static struct newtp_req * next_write (int slot)
+{
+	return next_offlen(CMD_WRITE, H_WRITE);
+}
+
+static int done_read (int slot, struct newtp_req * r)
+{
+	return (r->reply.result == STAT_OK && r->reply.length == size) ? 1 : -1;
+}
+
+static int done_write (int slot, struct newtp_req * r)
+{
+	uint16_t written = 0;
+
+	if (r->reply.result != STAT_OK) return -1;
+	if (r->reply.length >= 2) unpack(r->data, r->reply.length, "s", &written);
+	return written == size ? 1 : -1;
+}
+
+static struct newtp_req * next_stat (int slot)
+{
+	static char const query[] = { ATTR_TYPE, ATTR_SIZE, ATTR_MTIME, ATTR_PERMS, ATTR_UID };
+	return request(CMD_STAT, H_READ, query, sizeof(query));
+}
+
+/* each listing in flight has a handle of its own; a finished one is
+ * rewound before its next READDIR */
+static int rewind_dir[MAX_DEPTH];
+
+static int prepare_readdir (int depth)
+{
+	char path[1024];
+	int max = newtp_server_intro(conn)->max_opendirs;
+
+	if (depth > max) depth = max;
+	if (depth > H_ASSIGN - H_DIR) depth = H_ASSIGN - H_DIR;
+	snprintf(path, sizeof(path), "%s/dir", base);
+	for (int i = 0; i < depth; i++) {
+		assign(H_DIR + i, path);
+		rewind_dir[i] = 1;
+	}
+	return depth;
+}
+
+static struct newtp_req * next_readdir (int slot)
+{
+	if (rewind_dir[slot]) {
+		send_checked(CMD_REWINDDIR, H_DIR + slot, NULL, 0, "REWINDDIR");
+		rewind_dir[slot] = 0;
+	}
+	return request(CMD_READDIR, H_DIR + slot, ATTRIBUTES, strlen(ATTRIBUTES));
+}
+
+static int done_readdir (int slot, struct newtp_req * r)
+{
+	uint16_t items = 0;
+
+	if (r->reply.result != STAT_CONTINUED && r->reply.result != STAT_FINISHED) return -1;
+	if (r->reply.result == STAT_FINISHED) rewind_dir[slot] = 1;
+	if (r->reply.length >= 2) unpack(r->data, r->reply.length, "s", &items);
+	return items;
+}
+
+static struct newtp_req * next_assign (int slot)
+{
+	char * path = entry_path(counter++ % entries);
+	return request(CMD_ASSIGN, H_ASSIGN + slot, path, strlen(path));
+}
+
+static struct workload const workloads[] = {
+	{ "read", NULL, next_read, done_read },
+	{ "write", NULL, next_write, done_write },
+	{ "stat", NULL, next_stat, done_ok },
+	{ "readdir", prepare_readdir, next_readdir, done_readdir },
+	{ "assign", NULL, next_assign, done_ok },
+};
+
+/**** measurement ****/
+
+struct result {
+	char const * name;
+	int slots;
+	uint64_t ops, bytes, items;
+	uint64_t p50, p99, p999, max;
+};
+
+static uint64_t * samples;
+static uint64_t nsamples, cap;
+
+static int compare_u64 (void const * a, void const * b)
+{
+	uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile (double p)
+{
+	return nsamples ? samples[(uint64_t)((nsamples - 1) * p)] : 0;
+}
+
+/* counts a completed request if it finished within [from, to) */
+static void record (struct result * res, struct newtp_req * r, int items, uint64_t from, uint64_t to)
+{
+	if (r->done_ns < from || r->done_ns >= to) return;
+	if (nsamples == cap) {
+		cap = cap ? 2 * cap : 65536;
+		samples = xrealloc(samples, cap * sizeof(uint64_t));
+	}
+	samples[nsamples++] = r->done_ns - r->sent_ns;
+	res->ops++;
+	res->bytes += r->cmd.length + r->reply.length;
+	res->items += items;
+}
+
+static void run (struct workload const * w, struct result * res)
+{
+	static struct newtp_req * ring[MAX_DEPTH];
+	uint64_t from, to, last;
+	int slots = depth, slot = 0;
+
+	memset(res, 0, sizeof(struct result));
+	res->name = w->name;
+	nsamples = 0;
+	counter = 0;
+	if (w->prepare) slots = w->prepare(depth);
+	res->slots = slots;
+
+	/* room for the REWINDDIRs next to the READDIRs */
+	newtp_set_window(conn, 2 * MAX_DEPTH);
+	for (int i = 0; i < slots; i++) {
+		ring[i] = w->next(i);
+		newtp_submit(ring[i], NULL, NULL);
+	}
+	from = now_ns() + seconds * 1e8;
+	to = from + seconds * 1e9;
+
+	/* the slots take turns, so each waits for its oldest request */
+	do {
+		struct newtp_req * r = ring[slot];
+		int items;
+
+		newtp_wait(r);
+		items = w->done(slot, r);
+		if (items < 0) {
+			fprintf(stderr, "%s failed: 0x%x\n", w->name, r->reply.result);
+			exit(1);
+		}
+		record(res, r, items, from, to);
+		last = r->done_ns;
+		newtp_req_free(r);
+
+		ring[slot] = w->next(slot);
+		newtp_submit(ring[slot], NULL, NULL);
+		slot = (slot + 1) % slots;
+	} while (last < to);
+
+	for (int i = 0; i < slots; i++) {
+		newtp_wait(ring[i]);
+		if (w->done(i, ring[i]) >= 0) record(res, ring[i], 0, from, to);
+		newtp_req_free(ring[i]);
+	}
+	if (newtp_drain(conn) == -1) exit(1);
+
+	qsort(samples, nsamples, sizeof(uint64_t), compare_u64);
+	res->p50 = percentile(0.5);
+	res->p99 = percentile(0.99);
+	res->p999 = percentile(0.999);
+	res->max = nsamples ? samples[nsamples - 1] : 0;
+}
+
+static void print_string (char const * s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') putchar('\\');
+		if ((unsigned char)*s >= ' ') putchar(*s);
+	}
+	putchar('"');
+}
+
+static void print_results (char const * label, char const * host, struct result const * res, int count)
+{
+	printf("{\n  \"label\": ");
+	print_string(label);
+	printf(",\n  \"host\": ");
+	print_string(host);
+	printf(",\n  \"depth\": %d,\n  \"size\": %d,\n  \"seconds\": %g,\n  \"results\": [\n", depth, size, seconds);
+	for (int i = 0; i < count; i++) {
+		struct result const * r = res + i;
+		printf("    { \"workload\": \"%s\", \"depth\": %d, \"ops\": %llu, \"ops_per_s\": %.1f, "
+			"\"bytes_per_s\": %.0f, \"items_per_s\": %.1f,\n"
+			"      \"latency_ns\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu } }%s\n",
+			r->name, r->slots, (unsigned long long)r->ops, r->ops / seconds, r->bytes / seconds,
+			r->items / seconds, (unsigned long long)r->p50, (unsigned long long)r->p99,
+			(unsigned long long)r->p999, (unsigned long long)r->max, (i + 1 < count) ? "," : "");
+	}
+	printf("  ]\n}\n");
+}
+
+static void usage (char const * prog)
+{
+	fprintf(stderr, "usage: %s [-P port] [-t seconds] [-d depth] [-s size] [-n entries] [-l label]\n"
+		"       <host> <share> [workload...]\n"
+		"workloads: read write stat readdir assign (default: all)\n", prog);
+	exit(1);
+}
+
+int main (int argc, char ** argv)
+{
+	static struct result results[sizeof(workloads) / sizeof(workloads[0])];
+	int const nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+	char const * port = NEWTP_PORT, * label = "";
+	int opt, count = 0;
+	Gsasl * ctx;
+
+	setlocale(LC_ALL, "");
+	log_init();
+	if (gsasl_init(&ctx) != GSASL_OK) {
+		fprintf(stderr, "failed to initialize SASL\n");
+		return 1;
+	}
+
+	while ((opt = getopt(argc, argv, "P:t:d:s:n:l:")) != -1) {
+		if (opt == 'P') port = optarg;
+		else if (opt == 't') seconds = atof(optarg);
+		else if (opt == 'd') depth = atoi(optarg);
+		else if (opt == 's') size = atoi(optarg);
+		else if (opt == 'n') entries = atoi(optarg);
+		else if (opt == 'l') label = optarg;
+		else usage(argv[0]);
+	}
+	if (argc - optind < 2) usage(argv[0]);
+	if (seconds <= 0 || depth < 1 || depth > MAX_DEPTH || entries < 1 ||
+		size < 1 || size > MAX_LENGTH - 8) {
+		fprintf(stderr, "need seconds > 0, depth 1-%d, entries > 0 and size 1-%d\n",
+			MAX_DEPTH, MAX_LENGTH - 8);
+		return 1;
+	}
+
+	conn = newtp_connect(argv[optind], port, ctx);
+	if (!conn) return 1;
+	base = xmalloc(strlen(argv[optind + 1]) + 16);
+	sprintf(base, "/%s/loopbench", argv[optind + 1]);
+	setup();
+
+	for (int i = 0; i < nworkloads; i++) {
+		int wanted = optind + 2 == argc;
+		for (int j = optind + 2; j < argc; j++) if (!strcmp(argv[j], workloads[i].name)) wanted = 1;
+		if (!wanted) continue;
+		fprintf(stderr, "running %s\n", workloads[i].name);
+		run(workloads + i, results + count++);
+	}
+	for (int j = optind + 2; j < argc; j++) {
+		int known = 0;
+		for (int i = 0; i < nworkloads; i++) if (!strcmp(argv[j], workloads[i].name)) known = 1;
+		if (!known) fprintf(stderr, "unknown workload: %s\n", argv[j]);
+	}
+
+	print_results(label, argv[optind], results, count);
+	newtp_disconnect(conn);
+	gsasl_done(ctx);
+	return 0;
+}
@@ -1,14 +1,69 @@
 #!/usr/bin/env python3
 
+# Generates struct_helpers.h and struct_helpers.c from structs.h.
+#
+# For every struct, the encoder and decoder are straight-line code: each
+# field is stored or loaded at a fixed offset (or at a running offset after
+# a variable-length field) with a single byte-swap, instead of going
+# through the format-string interpreter in pack()/unpack().
+# Fixed-size structs are checked against the available length once.
+#
+# Encoders and fixed-size decoders are static inline in the header, so
+# that they can be inlined into callers. Decoders of structs with strings
+# allocate memory, so they live out-of-line in the .c file.
+# Structs with strings also get an unpack_<name>_view decoder, which
+# doesn't allocate: the strings point into the decoded buffer.
+
 FILENAME = 'struct_helpers'
 h_label = FILENAME.upper() + '__H__'
 
+SIZES = {
+    'uint8_t': 1,
+    'uint16_t': 2,
+    'uint32_t': 4,
+    'uint64_t': 8,
+}
+
+FORMATS = {
+    'uint8_t': 'c',
+    'uint16_t': 's',
+    'uint32_t': 'i',
+    'uint64_t': 'l',
+    'char *': 'B',
+}
+
 h_header = """\
 #ifndef {0}
 #define {0}
 
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
 #include "structs.h"
 
+/* big-endian loads and stores at arbitrary (unaligned) positions.
+ * memcpy of a constant size compiles to a single move. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WIRE_SWAP16(x) (x)
+#define WIRE_SWAP32(x) (x)
+#define WIRE_SWAP64(x) (x)
+#else
+#define WIRE_SWAP16(x) __builtin_bswap16(x)
+#define WIRE_SWAP32(x) __builtin_bswap32(x)
+#define WIRE_SWAP64(x) __builtin_bswap64(x)
+#endif
+
+static inline void wire_put_uint8_t (char * p, uint8_t v) {{ *(uint8_t *)p = v; }}
+static inline void wire_put_uint16_t (char * p, uint16_t v) {{ v = WIRE_SWAP16(v); memcpy(p, &v, 2); }}
+static inline void wire_put_uint32_t (char * p, uint32_t v) {{ v = WIRE_SWAP32(v); memcpy(p, &v, 4); }}
+static inline void wire_put_uint64_t (char * p, uint64_t v) {{ v = WIRE_SWAP64(v); memcpy(p, &v, 8); }}
+
+static inline uint8_t wire_get_uint8_t (char const * p) {{ return *(uint8_t const *)p; }}
+static inline uint16_t wire_get_uint16_t (char const * p) {{ uint16_t v; memcpy(&v, p, 2); return WIRE_SWAP16(v); }}
+static inline uint32_t wire_get_uint32_t (char const * p) {{ uint32_t v; memcpy(&v, p, 4); return WIRE_SWAP32(v); }}
+static inline uint64_t wire_get_uint64_t (char const * p) {{ uint64_t v; memcpy(&v, p, 8); return WIRE_SWAP64(v); }}
+
 """.format(h_label)
 
 h_footer = """\
@@ -16,96 +71,185 @@ h_footer = """\
 """.format(h_label)
 
 c_header = """\
-#include <arpa/inet.h>
 #include <assert.h>
-#include <errno.h>
+#include <stdint.h>
 #include <string.h>
-#include <stdio.h>
 
-#include "common.h"
 #include "structs.h"
-#include "log.h"
+#include "tools.h"
 #include "{0}.h"
 
 """.format(FILENAME)
 
 c_footer = ""
 
-def h_defs (name, format_str, fields):
+
+def is_string (field):
+    return field[0] == 'char *'
+
+
+def fixed_size (fields):
+    return sum(SIZES[tp] for tp, _ in fields if tp in SIZES)
+
+
+def string_len_field (fields, i):
+    # strings are preceded by their 16bit length
+    assert i > 0 and fields[i - 1][0] == 'uint16_t', "string must follow its length"
+    return fields[i - 1][1]
+
+
+def encoder_body (fields, value):
+    """straight-line stores; `value` maps field name to C expression"""
+    lines = []
+    if not any(map(is_string, fields)):
+        ofs = 0
+        for tp, name in fields:
+            lines.append("\twire_put_{0}(buf + {1}, {2});".format(tp, ofs, value(name)))
+            ofs += SIZES[tp]
+        lines.append("\treturn {0};".format(ofs))
+        return lines
+
+    lines.append("\tchar * p = buf;")
+    for i, (tp, name) in enumerate(fields):
+        if is_string((tp, name)):
+            ln = value(string_len_field(fields, i))
+            lines.append("\tif ({0}) memcpy(p, {1}, {0});".format(ln, value(name)))
+            lines.append("\tp += {0};".format(ln))
+        else:
+            lines.append("\twire_put_{0}(p, {1}); p += {2};".format(tp, value(name), SIZES[tp]))
+    lines.append("\treturn p - buf;")
+    return lines
+
+
+def decoder_body (fields, store_string):
+    """loads into struct s; strings are stored by store_string(name, len)"""
+    lines = []
+    total = fixed_size(fields)
+    if not any(map(is_string, fields)):
+        lines.append("\tif (available < {0}) return -1;".format(total))
+        ofs = 0
+        for tp, name in fields:
+            lines.append("\ts->{0} = wire_get_{1}(buf + {2});".format(name, tp, ofs))
+            ofs += SIZES[tp]
+        lines.append("\treturn {0};".format(ofs))
+        return lines
+
+    # first walk the lengths to check the whole struct fits,
+    # so that we never leave a half-decoded struct behind
+    lines.append("\tchar const * p = buf;")
+    lines.append("\tint left = available - {0};".format(total))
+    lines.append("\tif (left < 0) return -1;")
+    ofs = 0
+    last = max(i for i, f in enumerate(fields) if is_string(f))
+    for i, (tp, name) in enumerate(fields):
+        if is_string((tp, name)):
+            lines.append("\tuint16_t const {0}_len_ = wire_get_uint16_t(p + {1});".format(name, ofs - 2))
+            lines.append("\tleft -= {0}_len_;".format(name))
+            lines.append("\tif (left < 0) return -1;")
+            if i != last:
+                lines.append("\tp += {0} + {1}_len_;".format(ofs, name))
+            ofs = 0
+        else:
+            ofs += SIZES[tp]
+
+    lines.append("\tp = buf;")
+    for i, (tp, name) in enumerate(fields):
+        if is_string((tp, name)):
+            ln = "s->" + string_len_field(fields, i)
+            lines.extend(store_string(name, ln))
+            lines.append("\tp += {0};".format(ln))
+        else:
+            lines.append("\ts->{0} = wire_get_{1}(p); p += {2};".format(name, tp, SIZES[tp]))
+    lines.append("\treturn p - buf;")
+    return lines
+
+
+def alloc_string (name, ln):
+    return [
+        "\ts->{0} = xmalloc({1} + 1);".format(name, ln),
+        "\tmemcpy(s->{0}, p, {1});".format(name, ln),
+        "\ts->{0}[{1}] = 0;".format(name, ln),
+    ]
+
+
+def view_string (name, ln):
+    return ["\ts->{0} = (char *)p;".format(name)]
+
+
+def h_defs (name, fields):
     def len_item(x):
-        tp, name = x
+        tp, fname = x
         if tp == "char *":
-            return "(s)->{}_len".format(name)
+            return "(s)->{}_len".format(fname)
         else:
             return "sizeof({})".format(tp)
+    format_str = ''.join(FORMATS[tp] for tp, _ in fields)
     len_list = ' + '.join(map(len_item, fields))
-    field_types = ', '.join(map(lambda x: x[0] + " const", fields))
+    field_list = ', '.join(tp + " const " + fname for tp, fname in fields)
+    field_refs = ', '.join("s->" + fname for _, fname in fields)
+    has_strings = any(map(is_string, fields))
 
-    return """\
+    out = """\
 #define FORMAT_{name} "{format_str}"
 #define SIZEOF_{name}(s) ({len_list})
-int pack_{name} (char * const buf, struct {name} const * s);
-int pack_{name}_p (char * const buf, {field_types});
-int unpack_{name} (char const * const buf, int available, struct {name} * s);
-""".format(**locals())
 
-def c_functions (name, fields):
-    field_refs = ', '.join(map(lambda x: "s->" + x[1], fields))
-    field_prefs = ', '.join(map(lambda x: "&s->" + x[1], fields))
-    field_list = ', '.join(map(lambda x: x[0] + " const " + x[1], fields))
-    field_names = ', '.join(map(lambda x: x[1], fields))
-    return """\
-int pack_{name} (char * const buf, struct {name} const * s)
+static inline int pack_{name}_p (char * const buf, {field_list})
 {{
-    assert(s);
-    return pack_{name}_p(buf, {field_refs});
+\tassert(buf);
+{pack_body}
 }}
 
-int pack_{name}_p (char * const buf, {field_list})
+static inline int pack_{name} (char * const buf, struct {name} const * s)
 {{
-    int PACK_size;
+\tassert(s);
+\treturn pack_{name}_p(buf, {field_refs});
+}}
+
+""".format(pack_body='\n'.join(encoder_body(fields, lambda n: n)), **locals())
 
-    assert(buf);
-    PACK_size = pack(buf, FORMAT_{name}, {field_names});
-    /* assert(size == SIZEOF_{name}(s)); */
-    return PACK_size;
+    if has_strings:
+        out += """\
+/* allocates the strings, caller frees them */
+int unpack_{name} (char const * const buf, int available, struct {name} * s);
+
+/* strings point into buf (valid as long as buf is) and are not NUL-terminated */
+static inline int unpack_{name}_view (char const * const buf, int available, struct {name} * s)
+{{
+\tassert(s);
+\tassert(buf);
+{view_body}
+}}
+""".format(view_body='\n'.join(decoder_body(fields, view_string)), **locals())
+    else:
+        out += """\
+static inline int unpack_{name} (char const * const buf, int available, struct {name} * s)
+{{
+\tassert(s);
+\tassert(buf);
+{unpack_body}
 }}
+""".format(unpack_body='\n'.join(decoder_body(fields, None)), **locals())
+    return out
 
+
+def c_functions (name, fields):
+    if not any(map(is_string, fields)):
+        return None
+    return """\
 int unpack_{name} (char const * const buf, int available, struct {name} * s)
 {{
-    int size;
-
-    assert(s);
-    assert(buf);
-    size = unpack(buf, available, FORMAT_{name}, {field_prefs});
-    assert(size == SIZEOF_{name}(s) || size < 0);
-    return size;
+\tassert(s);
+\tassert(buf);
+{body}
 }}
-""".format(**locals())
-
-def make_format (p):
-    fmt = []
-    for tp, name in p:
-        if tp == 'uint8_t': fmt.append('c')
-        elif tp == 'uint16_t': fmt.append('s')
-        elif tp == 'uint32_t': fmt.append('i')
-        elif tp == 'uint64_t': fmt.append('l')
-        elif tp == 'char *':
-            fmt.append('B')
-        elif tp.startswith('char['):
-            n = tp[5:6]
-            fmt.append(n)
-            fmt.append('B')
-        else:
-            print("unknown type:",tp)
+""".format(body='\n'.join(decoder_body(fields, alloc_string)), **locals())
 
-    return ''.join(fmt)
 
 import re
 
-start = re.compile('^struct ([a-z_]+) {$')
-item = re.compile('([a-z0-9_]+(?: ?\*)?)\s+([a-z_]+);(?:\s*/\*.*\*/)?')
-end = re.compile('^};$')
+start = re.compile(r'^struct ([a-z_]+) {$')
+item = re.compile(r'([a-z0-9_]+(?: ?\*)?)\s+([a-z_]+);(?:\s*/\*.*\*/)?')
+end = re.compile(r'^};$')
 
 h = open(FILENAME + '.h', 'w')
 h.write(h_header)
@@ -127,16 +271,20 @@ for line in src:
     else:
         match = item.match(line)
         if match:
-            items.append((match.group(1), match.group(2)))
+            tp = match.group(1)
+            if tp not in FORMATS:
+                raise SystemExit("unknown type: " + tp)
+            items.append((tp, match.group(2)))
         else:
             match = end.match(line)
             if match:
-                format_str = make_format(items)
-                h.write(h_defs(struct, format_str, items))
+                h.write(h_defs(struct, items))
                 h.write("\n")
 
-                c.write(c_functions(struct, items))
-                c.write("\n")
+                fn = c_functions(struct, items)
+                if fn:
+                    c.write(fn)
+                    c.write("\n")
 
                 struct = None
 
@@ -0,0 +1,375 @@
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gsasl.h>
+
+#include "commands.h"
+#include "common.h"
+#include "libnewtp.h"
+#include "log.h"
+#include "structs.h"
+#include "tools.h"
+
+/* Metadata benchmark over a whole tree, e.g. one built by mktree.py.
+ *
+ * list   - lists the tree breadth-first, directories fully before their
+ *          subdirectories, with up to -j listings in flight (each on a
+ *          handle of its own, so at most the server's max_opendirs).
+ *          Every directory's listing is also timed on its own, and
+ *          grouped by size, to show how entries/s scale with it.
+ * stat   - ASSIGN and STAT of every file found, -d pairs in flight,
+ *          cycling through -H handles like newfs does.
+ * assign - ASSIGN of every file found, -d in flight, same handles.
+ *
+ * The tree is always listed first, as the other two need its paths.
+ * Prints one JSON object.
+ *
+ * usage: ./metabench [-P port] [-j listings] [-d depth] [-H handles] [-l label]
+ *                    <host> <path> [list|stat|assign...] */
+
+#define MAX_JOBS 64
+/* handles of the listings, then those of the storms */
+#define H_LIST  1
+#define H_STORM (H_LIST + MAX_JOBS)
+
+#define LONGEST_PATH 16384
+/* directories are grouped by entries in powers of ten, up to */
+#define SIZE_CLASSES 10
+
+static char const list_attrs[] = { ATTR_TYPE, ATTR_SIZE, ATTR_MTIME };
+#define LIST_FORMAT "cll"
+
+static struct newtp_conn * conn;
+static int jobs = 1, depth = 32, handles = 1024;
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* paths, stored back to back */
+struct paths {
+	char * buf;
+	size_t len, cap;
+	size_t * offs;
+	size_t count, ocap;
+};
+
+static struct paths dirs, files;
+
+static void paths_add (struct paths * p, char const * dir, int dlen, char const * name, int nlen)
+{
+	size_t need = dlen + 1 + nlen + 1;
+
+	if (p->len + need > p->cap) {
+		p->cap = (p->cap + need) * 2;
+		p->buf = xrealloc(p->buf, p->cap);
+	}
+	if (p->count == p->ocap) {
+		p->ocap = p->ocap ? 2 * p->ocap : 1024;
+		p->offs = xrealloc(p->offs, p->ocap * sizeof(size_t));
+	}
+	p->offs[p->count++] = p->len;
+	memcpy(p->buf + p->len, dir, dlen);
+	p->len += dlen;
+	if (nlen) {
+		p->buf[p->len++] = '/';
+		memcpy(p->buf + p->len, name, nlen);
+		p->len += nlen;
+	}
+	p->buf[p->len++] = 0;
+}
+
+static char * paths_get (struct paths * p, size_t i)
+{
+	return p->buf + p->offs[i];
+}
+
+static void free_reply (struct newtp_req * r, void * arg)
+{
+	int * errors = arg;
+	if (r->reply.result != STAT_OK) (*errors)++;
+	newtp_req_free(r);
+}
+
+struct latencies {
+	uint64_t * v;
+	size_t n, cap;
+	int errors;
+};
+
+static void latency_add (struct latencies * l, uint64_t ns)
+{
+	if (l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 65536;
+		l->v = xrealloc(l->v, l->cap * sizeof(uint64_t));
+	}
+	l->v[l->n++] = ns;
+}
+
+static int compare_u64 (void const * a, void const * b)
+{
+	uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_latencies (struct latencies * l, double seconds)
+{
+	qsort(l->v, l->n, sizeof(uint64_t), compare_u64);
+	printf("{ \"ops\": %zu, \"errors\": %d, \"seconds\": %.3f, \"ops_per_s\": %.1f, "
+		"\"latency_ns\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu } }",
+		l->n, l->errors, seconds, l->n / seconds,
+		(unsigned long long)(l->n ? l->v[(l->n - 1) / 2] : 0),
+		(unsigned long long)(l->n ? l->v[(size_t)((l->n - 1) * 0.99)] : 0),
+		(unsigned long long)(l->n ? l->v[(size_t)((l->n - 1) * 0.999)] : 0),
+		(unsigned long long)(l->n ? l->v[l->n - 1] : 0));
+}
+
+/**** listing ****/
+
+struct listing {
+	int busy;
+	uint16_t handle;
+	char * path;
+	int plen;
+	uint64_t start, entries;
+};
+
+static struct listing slots[MAX_JOBS];
+static int active, list_errors;
+static uint64_t pages, max_entries;
+
+/* per size class: directories, their entries and the time to list them */
+static struct {
+	uint64_t dirs, entries, ns;
+} classes[SIZE_CLASSES];
+
+static void list_done (struct listing * l, uint64_t done_ns)
+{
+	int c = 0;
+
+	for (uint64_t n = l->entries; n >= 10 && c < SIZE_CLASSES - 1; n /= 10) c++;
+	classes[c].dirs++;
+	classes[c].entries += l->entries;
+	classes[c].ns += done_ns - l->start;
+	if (l->entries > max_entries) max_entries = l->entries;
+	l->busy = 0;
+	active--;
+}
+
+static void submit_readdir (struct listing * l);
+
+static void page_done (struct newtp_req * r, void * arg)
+{
+	struct listing * l = arg;
+	int result = r->reply.result, pos = 2;
+	uint16_t items = 0;
+
+	if (result != STAT_CONTINUED && result != STAT_FINISHED) {
+		list_errors++;
+		list_done(l, r->done_ns);
+		newtp_req_free(r);
+		return;
+	}
+	pages++;
+	if (r->reply.length >= 2) unpack(r->data, r->reply.length, "s", &items);
+	for (; items && pos < r->reply.length; items--) {
+		struct dir_entry entry;
+		uint64_t size, mtime;
+		uint8_t type;
+
+		if (unpack_dir_entry_view(r->data + pos, r->reply.length - pos, &entry) < 0 ||
+			entry.attr_len != 17) {
+			list_errors++;
+			break;
+		}
+		unpack(entry.attr, entry.attr_len, LIST_FORMAT, &type, &size, &mtime);
+		if (type == TYPE_DIR) paths_add(&dirs, l->path, l->plen, entry.name, entry.name_len);
+		else paths_add(&files, l->path, l->plen, entry.name, entry.name_len);
+		l->entries++;
+		pos += SIZEOF_dir_entry(&entry);
+	}
+
+	if (result == STAT_CONTINUED) submit_readdir(l);
+	else list_done(l, r->done_ns);
+	newtp_req_free(r);
+}
+
+static void submit_readdir (struct listing * l)
+{
+	struct newtp_req * r = newtp_req_new(conn, CMD_READDIR, l->handle);
+	memcpy(newtp_req_payload(r, sizeof(list_attrs)), list_attrs, sizeof(list_attrs));
+	newtp_submit(r, page_done, l);
+}
+
+static void start_listing (struct listing * l, size_t dir)
+{
+	struct newtp_req * r;
+
+	/* the path is copied, as dirs grows meanwhile */
+	l->plen = strlen(paths_get(&dirs, dir));
+	memcpy(l->path, paths_get(&dirs, dir), l->plen + 1);
+	l->busy = 1;
+	l->entries = 0;
+	l->start = now_ns();
+	active++;
+
+	r = newtp_req_new(conn, CMD_ASSIGN, l->handle);
+	memcpy(newtp_req_payload(r, l->plen), l->path, l->plen);
+	newtp_submit(r, free_reply, &list_errors);
+	newtp_submit(newtp_req_new(conn, CMD_REWINDDIR, l->handle), free_reply, &list_errors);
+	submit_readdir(l);
+}
+
+static void run_list (char * root)
+{
+	size_t next = 0;
+	uint64_t start = now_ns(), total = 0;
+	double seconds;
+	int first = 1;
+
+	for (int i = 0; i < jobs; i++) {
+		slots[i].handle = H_LIST + i;
+		slots[i].path = xmalloc(LONGEST_PATH);
+	}
+	paths_add(&dirs, root, strlen(root), NULL, 0);
+
+	while (next < dirs.count || active) {
+		for (int i = 0; i < jobs && next < dirs.count; i++)
+			if (!slots[i].busy) start_listing(slots + i, next++);
+		if (active && newtp_poll(conn, -1) < 0) {
+			fprintf(stderr, "connection failed\n");
+			exit(1);
+		}
+	}
+	seconds = (now_ns() - start) / 1e9;
+
+	for (int c = 0; c < SIZE_CLASSES; c++) total += classes[c].entries;
+	printf("  \"tree\": { \"dirs\": %zu, \"files\": %zu, \"largest_dir\": %llu },\n",
+		dirs.count, files.count, (unsigned long long)max_entries);
+	printf("  \"list\": { \"entries\": %llu, \"pages\": %llu, \"errors\": %d, \"seconds\": %.3f, "
+		"\"entries_per_s\": %.1f, \"dirs_per_s\": %.1f },\n",
+		(unsigned long long)total, (unsigned long long)pages, list_errors, seconds,
+		total / seconds, dirs.count / seconds);
+	printf("  \"by_dir_size\": [");
+	for (int c = 0, lo = 0; c < SIZE_CLASSES; c++, lo = lo ? lo * 10 : 10) {
+		if (!classes[c].dirs) continue;
+		printf("%s\n    { \"min_entries\": %d, \"dirs\": %llu, \"entries\": %llu, "
+			"\"entries_per_s\": %.1f, \"ms_per_dir\": %.3f }", first ? "" : ",", lo,
+			(unsigned long long)classes[c].dirs, (unsigned long long)classes[c].entries,
+			classes[c].ns ? classes[c].entries / (classes[c].ns / 1e9) : 0,
+			classes[c].ns / 1e6 / classes[c].dirs);
+		first = 0;
+	}
+	printf("\n  ]");
+}
+
+/**** storms ****/
+
+static struct latencies storm;
+
+static void storm_done (struct newtp_req * r, void * arg)
+{
+	if (r->reply.result == STAT_OK) latency_add(&storm, r->done_ns - r->sent_ns);
+	else storm.errors++;
+	newtp_req_free(r);
+}
+
+/* ASSIGNs every file to the next handle, followed by a STAT if stat */
+static void run_storm (int stat)
+{
+	static char const query[] = { ATTR_TYPE, ATTR_SIZE, ATTR_MTIME, ATTR_PERMS, ATTR_UID };
+	uint64_t start;
+
+	memset(&storm, 0, sizeof(storm));
+	newtp_set_window(conn, stat ? 2 * depth : depth);
+	start = now_ns();
+	for (size_t i = 0; i < files.count; i++) {
+		uint16_t h = H_STORM + i % handles;
+		char * path = paths_get(&files, i);
+		int len = strlen(path);
+		struct newtp_req * r = newtp_req_new(conn, CMD_ASSIGN, h);
+
+		memcpy(newtp_req_payload(r, len), path, len);
+		if (stat) {
+			newtp_submit(r, free_reply, &storm.errors);
+			r = newtp_req_new(conn, CMD_STAT, h);
+			memcpy(newtp_req_payload(r, sizeof(query)), query, sizeof(query));
+		}
+		newtp_submit(r, storm_done, NULL);
+	}
+	if (newtp_drain(conn) < 0) {
+		fprintf(stderr, "connection failed\n");
+		exit(1);
+	}
+	printf(",\n  \"%s\": ", stat ? "stat" : "assign");
+	print_latencies(&storm, (now_ns() - start) / 1e9);
+	free(storm.v);
+}
+
+static void usage (char const * prog)
+{
+	fprintf(stderr, "usage: %s [-P port] [-j listings] [-d depth] [-H handles] [-l label]\n"
+		"       <host> <path> [list|stat|assign...]\n", prog);
+	exit(1);
+}
+
+int main (int argc, char ** argv)
+{
+	char const * port = NEWTP_PORT, * label = "";
+	int opt, want_stat = 0, want_assign = 0, max_handles;
+	Gsasl * ctx;
+
+	setlocale(LC_ALL, "");
+	log_init();
+	if (gsasl_init(&ctx) != GSASL_OK) {
+		fprintf(stderr, "failed to initialize SASL\n");
+		return 1;
+	}
+
+	while ((opt = getopt(argc, argv, "P:j:d:H:l:")) != -1) {
+		if (opt == 'P') port = optarg;
+		else if (opt == 'j') jobs = atoi(optarg);
+		else if (opt == 'd') depth = atoi(optarg);
+		else if (opt == 'H') handles = atoi(optarg);
+		else if (opt == 'l') label = optarg;
+		else usage(argv[0]);
+	}
+	if (argc - optind < 2 || jobs < 1 || jobs > MAX_JOBS || depth < 1 || handles < 1) usage(argv[0]);
+	for (int i = optind + 2; i < argc; i++) {
+		if (!strcmp(argv[i], "stat")) want_stat = 1;
+		else if (!strcmp(argv[i], "assign")) want_assign = 1;
+		else if (strcmp(argv[i], "list")) usage(argv[0]);
+	}
+	if (argc - optind == 2) want_stat = want_assign = 1;
+
+	conn = newtp_connect(argv[optind], port, ctx);
+	if (!conn) return 1;
+	if (jobs > newtp_server_intro(conn)->max_opendirs) jobs = newtp_server_intro(conn)->max_opendirs;
+	max_handles = newtp_server_intro(conn)->max_handles;
+	if (handles > max_handles - H_STORM) handles = max_handles - H_STORM;
+
+	printf("{\n  \"label\": \"%s\",\n  \"host\": \"%s\",\n  \"path\": \"%s\",\n", label, argv[optind], argv[optind + 1]);
+	printf("  \"jobs\": %d,\n  \"depth\": %d,\n  \"handles\": %d,\n", jobs, depth, handles);
+	fprintf(stderr, "listing %s\n", argv[optind + 1]);
+	run_list(argv[optind + 1]);
+	if (want_stat) {
+		fprintf(stderr, "stat storm over %zu files\n", files.count);
+		run_storm(1);
+	}
+	if (want_assign) {
+		fprintf(stderr, "assign storm over %zu files\n", files.count);
+		run_storm(0);
+	}
+	printf("\n}\n");
+
+	newtp_disconnect(conn);
+	gsasl_done(ctx);
+	return 0;
+}
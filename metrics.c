@@ -0,0 +1,287 @@
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "common.h"
+#include "log.h"
+#include "metrics.h"
+
+static struct {
+	uint8_t code;
+	char const * name;
+} const commands[] = {
+	{ CMD_ASSIGN,     "ASSIGN" },
+	{ CMD_STAT,       "STAT" },
+	{ CMD_SETATTR,    "SETATTR" },
+	{ CMD_STATVFS,    "STATVFS" },
+	{ CMD_READ,       "READ" },
+	{ CMD_WRITE,      "WRITE" },
+	{ CMD_TRUNCATE,   "TRUNCATE" },
+	{ CMD_FLUSH,      "FLUSH" },
+	{ CMD_DURABILITY, "DURABILITY" },
+	{ CMD_HASH,       "HASH" },
+	{ CMD_DELETE,     "DELETE" },
+	{ CMD_RENAME,     "RENAME" },
+	{ CMD_MAKEDIR,    "MAKEDIR" },
+	{ CMD_REWINDDIR,  "REWINDDIR" },
+	{ CMD_READDIR,    "READDIR" },
+};
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+/* last slot collects unknown commands */
+#define NUM_SLOTS (NUM_COMMANDS + 1)
+
+struct command_metrics {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t deferred;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t queue_sum;
+	uint64_t service_sum;
+	uint64_t queue[METRICS_BUCKETS];
+	uint64_t service[METRICS_BUCKETS];
+};
+
+struct metrics {
+	uint64_t sessions_total;
+	int64_t  sessions_active;
+	struct command_metrics cmd[NUM_SLOTS];
+};
+
+static struct metrics * metrics = NULL;
+static uint8_t slot_of[256];
+
+#define ADD(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#define LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+void metrics_init ()
+{
+	void * mem = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		warnp("cannot map shared metrics: %s", strerror(errno));
+		return;
+	}
+	memset(mem, 0, sizeof(struct metrics));
+	metrics = mem;
+
+	for (int i = 0; i < 256; i++) slot_of[i] = NUM_COMMANDS;
+	for (int i = 0; i < NUM_COMMANDS; i++) slot_of[commands[i].code] = i;
+}
+
+char const * metrics_command_name (uint8_t command)
+{
+	for (int i = 0; i < NUM_COMMANDS; i++)
+		if (commands[i].code == command) return commands[i].name;
+	return NULL;
+}
+
+uint64_t metrics_now ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_session (int started)
+{
+	if (!metrics) return;
+	if (started) {
+		ADD(metrics->sessions_total, 1);
+		ADD(metrics->sessions_active, 1);
+	} else {
+		ADD(metrics->sessions_active, -1);
+	}
+}
+
+static inline int bucket_of (uint64_t v)
+{
+	int exp, b;
+	if (v < METRICS_SUB) return v;
+	exp = 63 - __builtin_clzll(v);
+	if (exp > METRICS_MAX_EXP) return METRICS_BUCKETS - 1;
+	b = (exp - METRICS_SUB_BITS + 1) * METRICS_SUB
+		+ ((v >> (exp - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+	return b;
+}
+
+/* first bucket that only holds values >= 2^exp */
+static inline int bucket_of_pow2 (int exp)
+{
+	return (exp - METRICS_SUB_BITS + 1) * METRICS_SUB;
+}
+
+void metrics_record (uint8_t command, int result, uint64_t queue_ns, uint64_t service_ns,
+	int bytes_in, int bytes_out)
+{
+	struct command_metrics * m;
+	if (!metrics) return;
+
+	m = metrics->cmd + slot_of[command];
+	ADD(m->count, 1);
+	if (result < 0) ADD(m->deferred, 1);
+	else if (result >= 0x80) ADD(m->errors, 1);
+	ADD(m->bytes_in, bytes_in);
+	if (bytes_out > 0) ADD(m->bytes_out, bytes_out);
+	ADD(m->queue_sum, queue_ns);
+	ADD(m->service_sum, service_ns);
+	ADD(m->queue[bucket_of(queue_ns)], 1);
+	ADD(m->service[bucket_of(service_ns)], 1);
+}
+
+int metrics_listen (char const * path)
+{
+	struct sockaddr_un addr;
+	int s;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errp("metrics socket path too long: %s", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) return -1;
+	unlink(path); /* stale socket from previous run */
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(s, 4) == -1) {
+		errp("cannot listen on %s: %s", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static void print_histogram (FILE * f, char const * metric, char const * cmd,
+	uint64_t const * buckets, uint64_t sum)
+{
+	uint64_t cumulative = 0;
+	int b = 0;
+
+	/* export power-of-two boundaries from ~1us to ~17s */
+	for (int exp = 10; exp <= 34; exp++) {
+		int end = bucket_of_pow2(exp);
+		for (; b < end; b++) cumulative += LOAD(buckets[b]);
+		fprintf(f, "%s_bucket{command=\"%s\",le=\"%g\"} %llu\n", metric, cmd,
+			(double)((uint64_t)1 << exp) / 1e9, (unsigned long long)cumulative);
+	}
+	for (; b < METRICS_BUCKETS; b++) cumulative += LOAD(buckets[b]);
+	fprintf(f, "%s_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", metric, cmd, (unsigned long long)cumulative);
+	fprintf(f, "%s_sum{command=\"%s\"} %.9f\n", metric, cmd, (double)sum / 1e9);
+	fprintf(f, "%s_count{command=\"%s\"} %llu\n", metric, cmd, (unsigned long long)cumulative);
+}
+
+#define FOR_ACTIVE(i, m) \
+	for (int i = 0; i < NUM_SLOTS; i++) \
+		if ((m = metrics->cmd + i) && LOAD(m->count))
+
+#define SLOT_NAME(i) ((i) < NUM_COMMANDS ? commands[i].name : "UNKNOWN")
+
+static void print_counter (FILE * f, char const * metric, char const * help, int offset)
+{
+	struct command_metrics * m;
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+	FOR_ACTIVE(i, m) {
+		uint64_t * v = (uint64_t *)((char *)m + offset);
+		fprintf(f, "%s{command=\"%s\"} %llu\n", metric, SLOT_NAME(i), (unsigned long long)LOAD(*v));
+	}
+}
+
+/* the report goes out with send(), never blocking the accept loop
+ * for long, and a reader that went away costs an EPIPE, not SIGPIPE */
+#define SEND_TIMEOUT_MS 100
+#define SEND_DEADLINE_MS 1000
+
+static void send_report (int c, char const * buf, size_t len)
+{
+	struct timeval tv = { 0, SEND_TIMEOUT_MS * 1000 };
+	uint64_t deadline = metrics_now() + (uint64_t)SEND_DEADLINE_MS * 1000000;
+	ssize_t w;
+
+	setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	while (len > 0 && metrics_now() < deadline) {
+		w = send(c, buf, len, MSG_NOSIGNAL);
+		if (w == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+		if (w <= 0) return;
+		buf += w;
+		len -= w;
+	}
+}
+
+void metrics_serve (int sock)
+{
+	struct command_metrics * m;
+	struct pollfd pfd;
+	char request[512];
+	int c, r, http = 0;
+	char * report = NULL;
+	size_t len = 0;
+	FILE * f;
+
+	RETRY1(c, accept(sock, NULL, NULL));
+	if (c == -1) return;
+
+	/* plain connections get the bare report, HTTP clients (curl --unix-socket)
+	 * get it wrapped in a response. don't wait long for a request. */
+	pfd.fd = c;
+	pfd.events = POLLIN;
+	RETRY1(r, poll(&pfd, 1, 100));
+	if (r > 0) {
+		RETRY1(r, recv(c, request, sizeof(request), 0));
+		http = (r >= 4 && !strncmp(request, "GET ", 4));
+	}
+
+	f = open_memstream(&report, &len);
+	if (!f) {
+		close(c);
+		return;
+	}
+	if (http) fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+	if (!metrics) goto out;
+
+	fprintf(f, "# HELP newtp_sessions_total Sessions started.\n# TYPE newtp_sessions_total counter\n");
+	fprintf(f, "newtp_sessions_total %llu\n", (unsigned long long)LOAD(metrics->sessions_total));
+	fprintf(f, "# HELP newtp_sessions_active Sessions currently running.\n# TYPE newtp_sessions_active gauge\n");
+	fprintf(f, "newtp_sessions_active %lld\n", (long long)LOAD(metrics->sessions_active));
+
+	print_counter(f, "newtp_commands_total", "Commands processed.",
+		offsetof(struct command_metrics, count));
+	print_counter(f, "newtp_command_errors_total", "Commands that failed with an error status.",
+		offsetof(struct command_metrics, errors));
+	print_counter(f, "newtp_command_deferred_total", "Commands whose reply waited for group commit.",
+		offsetof(struct command_metrics, deferred));
+	print_counter(f, "newtp_command_bytes_in_total", "Bytes received in commands and payloads.",
+		offsetof(struct command_metrics, bytes_in));
+	print_counter(f, "newtp_command_bytes_out_total", "Bytes sent in replies and data.",
+		offsetof(struct command_metrics, bytes_out));
+
+	fprintf(f, "# HELP newtp_command_queue_seconds Time from command header to handler start.\n");
+	fprintf(f, "# TYPE newtp_command_queue_seconds histogram\n");
+	FOR_ACTIVE(i, m)
+		print_histogram(f, "newtp_command_queue_seconds", SLOT_NAME(i), m->queue, LOAD(m->queue_sum));
+
+	fprintf(f, "# HELP newtp_command_service_seconds Time to run the handler and send the reply.\n");
+	fprintf(f, "# TYPE newtp_command_service_seconds histogram\n");
+	FOR_ACTIVE(i, m)
+		print_histogram(f, "newtp_command_service_seconds", SLOT_NAME(i), m->service, LOAD(m->service_sum));
+
+out:
+	if (fclose(f) == 0) send_report(c, report, len);
+	free(report);
+	close(c);
+}
@@ -0,0 +1,51 @@
+#ifndef METRICS__H__
+#define METRICS__H__
+
+#include <stdint.h>
+
+/* Per-command statistics, aggregated over all sessions.
+ *
+ * Counters and latency histograms live in shared memory that is mapped
+ * before the server forks, and sessions update them with atomic adds,
+ * so recording never takes a lock.
+ *
+ * Histograms are log-linear (HDR-style): every power of two is split
+ * into METRICS_SUB linear sub-buckets, so the relative error of any
+ * recorded latency is below 1/METRICS_SUB.
+ *
+ * For every command we track:
+ *  - queue time: from receiving the command header to starting the handler
+ *    (receiving and decrypting the payload)
+ *  - service time: running the handler and sending the reply
+ *  - bytes in (command + payload) and bytes out (reply + data) */
+
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP 40 /* ~18 minutes in nanoseconds */
+#define METRICS_BUCKETS ((METRICS_MAX_EXP - METRICS_SUB_BITS + 2) * METRICS_SUB)
+
+/* map shared memory. must be called before forking sessions */
+void metrics_init ();
+
+/* name of a CMD_* code, NULL if there is no such command */
+char const * metrics_command_name (uint8_t command);
+
+/* monotonic time in nanoseconds */
+uint64_t metrics_now ();
+
+/* session start and end, for the active sessions gauge */
+void metrics_session (int started);
+
+/* record one finished command. result is the reply status code,
+ * or -1 if the reply was deferred */
+void metrics_record (uint8_t command, int result, uint64_t queue_ns, uint64_t service_ns,
+	int bytes_in, int bytes_out);
+
+/* create the Unix socket for metrics export, returns listening fd or -1 */
+int metrics_listen (char const * path);
+
+/* accept a connection on the metrics socket and write out the report
+ * in Prometheus text format */
+void metrics_serve (int sock);
+
+#endif
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commands.h"
+#include "common.h"
+#include "operations.h"
+#include "paths.h"
+#include "struct_helpers.h"
+#include "structs.h"
+
+/* Microbenchmarks of the wire encoding layer and server internals.
+ *
+ * Every generated encoder and decoder is timed against the generic
+ * format-string pack()/unpack() doing the same work, which is shown
+ * as the baseline. Next to the time per operation goes the number of
+ * bytes it encodes or decodes.
+ *
+ * usage: ./microbench [substring] - run only benchmarks whose name contains it */
+
+#define MIN_TIME_NS 200000000ULL /* run each benchmark at least this long */
+
+/* keep the compiler from optimizing the measured work away */
+#define CLOBBER() __asm__ __volatile__("" : : : "memory")
+volatile long sink;
+/* bytes encoded or decoded per iteration, set by each benchmark */
+static long bench_bytes;
+
+static char buf[MAX_LENGTH * 2];
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* sample values */
+static struct params_offlen s_offlen = { 1234567890123ULL, 65535 };
+static struct command s_command = { 0x1234, 0, CMD_READ, 42, 10 };
+static struct reply s_reply = { 0x1234, 0, STAT_OK, 65535 };
+static struct intro s_intro = { 16384, 5, 5, "posix", 25, "ANONYMOUS PLAIN SCRAM-SHA1", 0 };
+static struct extension s_extension = { 0x01, 9, "checksums" };
+static struct auth_initial s_auth_initial = { 5, "PLAIN", 16, "\0user\0password12" };
+static struct auth_outcome s_auth_outcome = { 0x11, 8, "success!" };
+static struct dir_entry s_dir_entry = { 12, "example.file", 46,
+	"\x01\x00\x00\x00\x00\x00\x00\x10\x00\x04\x00\x00\x00\x01\x00\x00\x03\xe8"
+	"\x00\x00\x03\xe8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+	"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" };
+static struct statvfs_result s_statvfs = { 0x0801, 1ULL << 40, 1ULL << 39, 0 };
+
+#define s_params_offlen s_offlen
+#define s_statvfs_result s_statvfs
+
+/**** benchmark bodies ****/
+
+#define BENCH(name) static void bench_##name (long iters)
+
+#define PACK_BENCH(st, generic, generated) \
+	BENCH(pack_##st##_generic) { \
+		bench_bytes = pack_##st(buf, &s_##st); \
+		for (long i = 0; i < iters; i++) { sink = generic; CLOBBER(); } \
+	} \
+	BENCH(pack_##st##_generated) { \
+		bench_bytes = pack_##st(buf, &s_##st); \
+		for (long i = 0; i < iters; i++) { sink = generated; CLOBBER(); } \
+	}
+
+PACK_BENCH(params_offlen,
+	pack(buf, FORMAT_params_offlen, s_offlen.offset, s_offlen.length),
+	pack_params_offlen(buf, &s_offlen))
+PACK_BENCH(command,
+	pack(buf, FORMAT_command, s_command.request_id, s_command.extension, s_command.command,
+		s_command.handle, s_command.length),
+	pack_command(buf, &s_command))
+PACK_BENCH(reply,
+	pack(buf, FORMAT_reply, s_reply.request_id, s_reply.extension, s_reply.result, s_reply.length),
+	pack_reply(buf, &s_reply))
+PACK_BENCH(intro,
+	pack(buf, FORMAT_intro, s_intro.max_handles, s_intro.max_opendirs, s_intro.platform_len,
+		s_intro.platform, s_intro.authstr_len, s_intro.authstr, s_intro.num_extensions),
+	pack_intro(buf, &s_intro))
+PACK_BENCH(extension,
+	pack(buf, FORMAT_extension, s_extension.code, s_extension.name_len, s_extension.name),
+	pack_extension(buf, &s_extension))
+PACK_BENCH(auth_initial,
+	pack(buf, FORMAT_auth_initial, s_auth_initial.mechanism_len, s_auth_initial.mechanism,
+		s_auth_initial.response_len, s_auth_initial.response),
+	pack_auth_initial(buf, &s_auth_initial))
+PACK_BENCH(auth_outcome,
+	pack(buf, FORMAT_auth_outcome, s_auth_outcome.result, s_auth_outcome.adata_len, s_auth_outcome.adata),
+	pack_auth_outcome(buf, &s_auth_outcome))
+PACK_BENCH(dir_entry,
+	pack(buf, FORMAT_dir_entry, s_dir_entry.name_len, s_dir_entry.name, s_dir_entry.attr_len, s_dir_entry.attr),
+	pack_dir_entry(buf, &s_dir_entry))
+PACK_BENCH(statvfs_result,
+	pack(buf, FORMAT_statvfs_result, s_statvfs.device_id, s_statvfs.capacity, s_statvfs.free_space,
+		s_statvfs.readonly),
+	pack_statvfs_result(buf, &s_statvfs))
+
+/* decoders work on an encoded copy of the sample, in a separate buffer */
+#define UNPACK_BENCH(st, generic, generated, cleanup) \
+	BENCH(unpack_##st##_generic) { \
+		static char in[256]; struct st s; int len = pack_##st(in, &s_##st); \
+		bench_bytes = len; \
+		for (long i = 0; i < iters; i++) { sink = generic; cleanup; CLOBBER(); } \
+	} \
+	BENCH(unpack_##st##_generated) { \
+		static char in[256]; struct st s; int len = pack_##st(in, &s_##st); \
+		bench_bytes = len; \
+		for (long i = 0; i < iters; i++) { sink = generated; cleanup; CLOBBER(); } \
+	}
+
+UNPACK_BENCH(params_offlen,
+	unpack(in, len, FORMAT_params_offlen, &s.offset, &s.length),
+	unpack_params_offlen(in, len, &s), )
+UNPACK_BENCH(command,
+	unpack(in, len, FORMAT_command, &s.request_id, &s.extension, &s.command, &s.handle, &s.length),
+	unpack_command(in, len, &s), )
+UNPACK_BENCH(reply,
+	unpack(in, len, FORMAT_reply, &s.request_id, &s.extension, &s.result, &s.length),
+	unpack_reply(in, len, &s), )
+UNPACK_BENCH(intro,
+	unpack(in, len, FORMAT_intro, &s.max_handles, &s.max_opendirs, &s.platform_len, &s.platform,
+		&s.authstr_len, &s.authstr, &s.num_extensions),
+	unpack_intro(in, len, &s),
+	free(s.platform); free(s.authstr))
+UNPACK_BENCH(extension,
+	unpack(in, len, FORMAT_extension, &s.code, &s.name_len, &s.name),
+	unpack_extension(in, len, &s),
+	free(s.name))
+UNPACK_BENCH(auth_initial,
+	unpack(in, len, FORMAT_auth_initial, &s.mechanism_len, &s.mechanism, &s.response_len, &s.response),
+	unpack_auth_initial(in, len, &s),
+	free(s.mechanism); free(s.response))
+UNPACK_BENCH(auth_outcome,
+	unpack(in, len, FORMAT_auth_outcome, &s.result, &s.adata_len, &s.adata),
+	unpack_auth_outcome(in, len, &s),
+	free(s.adata))
+UNPACK_BENCH(dir_entry,
+	unpack(in, len, FORMAT_dir_entry, &s.name_len, &s.name, &s.attr_len, &s.attr),
+	unpack_dir_entry(in, len, &s),
+	free(s.name); free(s.attr))
+UNPACK_BENCH(statvfs_result,
+	unpack(in, len, FORMAT_statvfs_result, &s.device_id, &s.capacity, &s.free_space, &s.readonly),
+	unpack_statvfs_result(in, len, &s), )
+
+/* borrowed views, compared with the allocating generic decoder */
+#define VIEW_BENCH(st) \
+	BENCH(unpack_view_##st##_generic) { bench_unpack_##st##_generic(iters); } \
+	BENCH(unpack_view_##st##_generated) { \
+		static char in[256]; struct st s; int len = pack_##st(in, &s_##st); \
+		bench_bytes = len; \
+		for (long i = 0; i < iters; i++) { sink = unpack_##st##_view(in, len, &s); CLOBBER(); } \
+	}
+
+VIEW_BENCH(intro)
+VIEW_BENCH(extension)
+VIEW_BENCH(auth_initial)
+VIEW_BENCH(auth_outcome)
+VIEW_BENCH(dir_entry)
+
+/* 64-bit byte order, on changing values */
+BENCH(htonll) {
+	bench_bytes = 8;
+	for (long i = 0; i < iters; i++) { sink = htonll(i); CLOBBER(); }
+}
+BENCH(ntohll) {
+	bench_bytes = 8;
+	for (long i = 0; i < iters; i++) { sink = ntohll(i); CLOBBER(); }
+}
+
+/**** attributes ****/
+
+/* what newfs and the client ask for in listings, and everything but
+ * ATTR_RIGHTS, which costs access() calls */
+static char const spec_list[] = { ATTR_RIGHTS, ATTR_MTIME, ATTR_PTYPE, ATTR_SIZE, ATTR_UID };
+static char const spec_all[] = { ATTR_TYPE, ATTR_SIZE, ATTR_DEV_ID, ATTR_LINKS, ATTR_ATIME,
+	ATTR_MTIME, ATTR_PTYPE, ATTR_PERMS, ATTR_CTIME, ATTR_UID, ATTR_GID };
+static struct stat s_stat;
+
+static void stat_setup ()
+{
+	if (!s_stat.st_mode && stat(".", &s_stat) == -1) {
+		perror("stat");
+		exit(1);
+	}
+}
+
+BENCH(attr_len_list) {
+	bench_bytes = sizeof(spec_list);
+	for (long i = 0; i < iters; i++) { sink = calculate_attr_len(spec_list, sizeof(spec_list)); CLOBBER(); }
+}
+BENCH(attr_len_all) {
+	bench_bytes = sizeof(spec_all);
+	for (long i = 0; i < iters; i++) { sink = calculate_attr_len(spec_all, sizeof(spec_all)); CLOBBER(); }
+}
+BENCH(encode_attrs_all) {
+	stat_setup();
+	bench_bytes = calculate_attr_len(spec_all, sizeof(spec_all));
+	for (long i = 0; i < iters; i++) {
+		sink = encode_attrs(&s_stat, ".", 1, buf, spec_all, sizeof(spec_all));
+		CLOBBER();
+	}
+}
+/* with the stat() and access() calls of a real STAT */
+BENCH(fill_stat_list) {
+	bench_bytes = calculate_attr_len(spec_list, sizeof(spec_list));
+	for (long i = 0; i < iters; i++) { sink = fill_stat(".", 1, buf, spec_list, sizeof(spec_list)); CLOBBER(); }
+}
+
+/**** READDIR pages ****/
+
+/* a full page as cmd_READDIR builds it from its stat results, and as
+ * the client takes it apart: entries with typical file names and the
+ * listing attributes (without ATTR_RIGHTS), until the next one doesn't
+ * fit */
+static char const spec_page[] = { ATTR_MTIME, ATTR_PTYPE, ATTR_SIZE, ATTR_UID };
+#define PAGE_FORMAT "lcli"
+#define PAGE_NAMES 4096
+static char page_names[PAGE_NAMES][24];
+static char page[MAX_LENGTH];
+static int page_len;
+
+static int encode_page (char * out, int generic)
+{
+	static char attrs[64];
+	struct dir_entry entry;
+	int filled = 2, entries = 0;
+
+	entry.attr = attrs;
+	entry.attr_len = calculate_attr_len(spec_page, sizeof(spec_page));
+	for (;;) {
+		entry.name = page_names[entries % PAGE_NAMES];
+		entry.name_len = strlen(entry.name);
+		if (filled + SIZEOF_dir_entry(&entry) > MAX_LENGTH) break;
+		encode_attrs(&s_stat, entry.name, 1, attrs, spec_page, sizeof(spec_page));
+		if (generic) filled += pack(out + filled, FORMAT_dir_entry, entry.name_len, entry.name,
+			entry.attr_len, entry.attr);
+		else filled += pack_dir_entry(out + filled, &entry);
+		entries++;
+	}
+	pack(out, "s", (uint16_t)entries);
+	return filled;
+}
+
+static void page_setup ()
+{
+	if (page_len) return;
+	stat_setup();
+	for (int i = 0; i < PAGE_NAMES; i++) snprintf(page_names[i], 24, "IMG_%05d.jpg", i);
+	page_len = encode_page(page, 0);
+}
+
+/* sums up the sizes, like a listing would print them */
+static long decode_page (int generic)
+{
+	struct dir_entry entry;
+	uint16_t items;
+	int pos = 2;
+	long total = 0;
+
+	unpack(page, page_len, "s", &items);
+	while (items-- && pos < page_len) {
+		uint64_t mtime, size;
+		uint32_t uid;
+		uint8_t type;
+
+		if (generic) {
+			if (unpack(page + pos, page_len - pos, FORMAT_dir_entry, &entry.name_len, &entry.name,
+				&entry.attr_len, &entry.attr) < 0) break;
+		} else if (unpack_dir_entry_view(page + pos, page_len - pos, &entry) < 0) break;
+		unpack(entry.attr, entry.attr_len, PAGE_FORMAT, &mtime, &type, &size, &uid);
+		total += size;
+		pos += SIZEOF_dir_entry(&entry);
+		if (generic) {
+			free(entry.name);
+			free(entry.attr);
+		}
+	}
+	return total;
+}
+
+BENCH(readdir_page_encode_generic) {
+	page_setup();
+	bench_bytes = page_len;
+	for (long i = 0; i < iters; i++) { sink = encode_page(buf, 1); CLOBBER(); }
+}
+BENCH(readdir_page_encode_generated) {
+	page_setup();
+	bench_bytes = page_len;
+	for (long i = 0; i < iters; i++) { sink = encode_page(buf, 0); CLOBBER(); }
+}
+BENCH(readdir_page_decode_generic) {
+	page_setup();
+	bench_bytes = page_len;
+	for (long i = 0; i < iters; i++) { sink = decode_page(1); CLOBBER(); }
+}
+BENCH(readdir_page_decode_generated) {
+	page_setup();
+	bench_bytes = page_len;
+	for (long i = 0; i < iters; i++) { sink = decode_page(0); CLOBBER(); }
+}
+
+/**** handle table ****/
+
+/* ASSIGN churn: every assignment replaces a handle, round-robin over the
+ * whole table, like the newfs client does. */
+#define CHURN_PATHS 4096
+static char * churn_short[CHURN_PATHS];
+static char * churn_long[CHURN_PATHS];
+
+static void churn_setup ()
+{
+	static int done = 0;
+	char dir[201];
+	if (done) return;
+	done = 1;
+
+	handle_init();
+	share_add("share", "/srv/newtp/share", 1);
+	memset(dir, 'd', 200);
+	dir[200] = 0;
+	for (int i = 0; i < CHURN_PATHS; i++) {
+		churn_short[i] = malloc(64);
+		snprintf(churn_short[i], 64, "/share/dir/file%05d", i);
+		churn_long[i] = malloc(256);
+		snprintf(churn_long[i], 256, "/share/%s/file%05d", dir, i);
+	}
+}
+
+static void churn (long iters, char ** paths)
+{
+	churn_setup();
+	bench_bytes = 0;
+	for (long i = 0; i < iters; i++) {
+		char * p = paths[i % CHURN_PATHS];
+		sink = handle_assign(i % MAXHANDLES, p, strlen(p));
+		CLOBBER();
+	}
+}
+
+BENCH(assign_short) { churn(iters, churn_short); }
+BENCH(assign_long) { churn(iters, churn_long); }
+
+/**** driver ****/
+
+struct bench {
+	char const * name;
+	void (*fn)(long);
+	void (*baseline)(long);
+};
+
+#define PAIR(op, st) { #op "/" #st, bench_##op##_##st##_generated, bench_##op##_##st##_generic }
+#define SINGLE(name, fn) { name, bench_##fn, NULL }
+
+static struct bench const benches[] = {
+	PAIR(pack, params_offlen),
+	PAIR(pack, command),
+	PAIR(pack, reply),
+	PAIR(pack, intro),
+	PAIR(pack, extension),
+	PAIR(pack, auth_initial),
+	PAIR(pack, auth_outcome),
+	PAIR(pack, dir_entry),
+	PAIR(pack, statvfs_result),
+	PAIR(unpack, params_offlen),
+	PAIR(unpack, command),
+	PAIR(unpack, reply),
+	PAIR(unpack, intro),
+	PAIR(unpack, extension),
+	PAIR(unpack, auth_initial),
+	PAIR(unpack, auth_outcome),
+	PAIR(unpack, dir_entry),
+	PAIR(unpack, statvfs_result),
+	PAIR(unpack_view, intro),
+	PAIR(unpack_view, extension),
+	PAIR(unpack_view, auth_initial),
+	PAIR(unpack_view, auth_outcome),
+	PAIR(unpack_view, dir_entry),
+	PAIR(readdir_page, encode),
+	PAIR(readdir_page, decode),
+	SINGLE("htonll", htonll),
+	SINGLE("ntohll", ntohll),
+	SINGLE("calculate_attr_len/list", attr_len_list),
+	SINGLE("calculate_attr_len/all", attr_len_all),
+	SINGLE("encode_attrs/all", encode_attrs_all),
+	SINGLE("fill_stat/list", fill_stat_list),
+	SINGLE("assign_churn/short", assign_short),
+	SINGLE("assign_churn/long", assign_long),
+};
+
+/* ns per call of fn, growing the iteration count until it runs long enough */
+static double measure (void (*fn)(long))
+{
+	long iters = 1000;
+	uint64_t start, elapsed;
+
+	while (1) {
+		start = now_ns();
+		fn(iters);
+		elapsed = now_ns() - start;
+		if (elapsed >= MIN_TIME_NS) break;
+		iters *= (elapsed < MIN_TIME_NS / 16) ? 16 : 2;
+	}
+	return (double)elapsed / iters;
+}
+
+int main (int argc, char ** argv)
+{
+	char const * filter = (argc > 1) ? argv[1] : NULL;
+
+	printf("%-28s %12s %10s %12s %8s\n", "benchmark", "time/op", "bytes/op", "baseline", "speedup");
+	for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		struct bench const * b = benches + i;
+		double t, base;
+		char bytes[16] = "-";
+		if (filter && !strstr(b->name, filter)) continue;
+		t = measure(b->fn);
+		if (bench_bytes) snprintf(bytes, sizeof(bytes), "%ld", bench_bytes);
+		if (b->baseline) {
+			base = measure(b->baseline);
+			printf("%-28s %9.2f ns %10s %9.2f ns %7.2fx\n", b->name, t, bytes, base, base / t);
+		} else {
+			printf("%-28s %9.2f ns %10s %12s %8s\n", b->name, t, bytes, "-", "-");
+		}
+	}
+	return 0;
+}
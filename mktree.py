@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Builds synthetic directory trees for metabench, directly on the
+# server's filesystem (under a share).
+#
+# A tree is <depth> levels of directories, each with <fanout>
+# subdirectories and <files> files of <size> bytes, named with <name_len>
+# characters. The shapes are presets of these:
+#
+#   wide   - one directory with many files           (files=100000)
+#   deep   - a chain of directories, a few files each (depth=200)
+#   tiny   - a bushy tree of many tiny files          (depth=3, fanout=10, files=100)
+#   long   - files with names of the maximum length   (files=10000, name_len=255)
+#   scale  - directories of 10, 100, ... up to <files> entries side by side,
+#            so metabench can show how listing scales with directory size
+#
+# Options given override the preset. Existing entries are kept, so a
+# tree can be grown or rebuilt in place.
+#
+# usage: ./mktree.py <dir> <shape> [--depth N] [--fanout N] [--files N]
+#                    [--size N] [--name-len N]
+
+import argparse
+import os
+import sys
+
+PRESETS = {
+    'wide':  dict(depth=0, fanout=0, files=100000, size=0, name_len=12),
+    'deep':  dict(depth=200, fanout=1, files=2, size=0, name_len=12),
+    'tiny':  dict(depth=3, fanout=10, files=100, size=64, name_len=12),
+    'long':  dict(depth=0, fanout=0, files=10000, size=0, name_len=255),
+    'scale': dict(depth=0, fanout=0, files=100000, size=0, name_len=12),
+}
+
+
+def name(prefix, i, length):
+    """prefix and number, padded with 'x' up to length"""
+    base = '%s%07d' % (prefix, i)
+    return base + 'x' * max(0, length - len(base))
+
+
+def make_files(path, count, size, name_len):
+    data = b'\xa5' * size
+    for i in range(count):
+        p = os.path.join(path, name('f', i, name_len))
+        if os.path.exists(p):
+            continue
+        with open(p, 'wb') as f:
+            f.write(data)
+
+
+def make_tree(path, depth, fanout, files, size, name_len):
+    """returns the number of directories and files below path"""
+    os.makedirs(path, exist_ok=True)
+    make_files(path, files, size, name_len)
+    dirs, count = 0, files
+    if depth > 0:
+        for i in range(fanout):
+            d, c = make_tree(os.path.join(path, name('d', i, name_len)),
+                             depth - 1, fanout, files, size, name_len)
+            dirs, count = dirs + d + 1, count + c
+    return dirs, count
+
+
+def main():
+    parser = argparse.ArgumentParser(description='build a synthetic tree for metabench')
+    parser.add_argument('dir')
+    parser.add_argument('shape', choices=sorted(PRESETS))
+    for opt in ('depth', 'fanout', 'files', 'size', 'name_len'):
+        parser.add_argument('--' + opt.replace('_', '-'), type=int)
+    args = parser.parse_args()
+
+    p = dict(PRESETS[args.shape])
+    for opt in p:
+        if getattr(args, opt) is not None:
+            p[opt] = getattr(args, opt)
+    if not 1 <= p['name_len'] <= 255:
+        sys.exit('name length must be 1-255')
+
+    if args.shape == 'scale':
+        dirs, count, n = 0, 0, 10
+        while n <= p['files']:
+            d = os.path.join(args.dir, 'dir%07d' % n)
+            os.makedirs(d, exist_ok=True)
+            make_files(d, n, p['size'], p['name_len'])
+            dirs, count, n = dirs + 1, count + n, n * 10
+    else:
+        dirs, count = make_tree(args.dir, p['depth'], p['fanout'], p['files'],
+                                p['size'], p['name_len'])
+    print('%s: %d directories, %d files' % (args.dir, dirs, count))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,52 +1,113 @@
-#include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/statvfs.h>
 #include <time.h>
 
-#include "clientops.h"
+#include "attrcache.h"
 #include "commands.h"
 #include "common.h"
+#include "libnewtp.h"
 #include "log.h"
+#include "readahead.h"
 #include "structs.h"
 #include "tools.h"
+#include "writeback.h"
 
 #define FUSE_USE_VERSION 28
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #define STAT_ATTR_QUERY "\x10\x11\x04\x13\x14\x02\x05\x06\x12"
+#define STAT_QUERY_LENGTH (sizeof(STAT_ATTR_QUERY) - 1)
 #define STAT_RESULT_LENGTH (1 + 2 + 4 + 4 + 4 + 8 + 8 + 8 + 8)
 
 
 #define MAX_HANDLES 16384
-#define HASH_MODULE 4679
 
-typedef struct {
-	int size;
-	int items;
-	uint16_t * bucket;
-} hash_bucket;
+/* inodes are allocated in blocks, which never move */
+#define NODE_BLOCK 4096
+/* initial size of the open-addressed (parent, name) -> inode table,
+ * which doubles whenever it gets half full */
+#define CHILD_SLOTS 1024
+
+/* directory listings of handles that share a lock are serialized */
+#define DIR_LOCKS 64
+
+#define ATTR_CACHE_ENTRIES 65536
+/* attribute cache keys are "parent.generation/name" */
+#define KEY_MAX (NAME_MAX + 48)
+
+/* inode number in listings of entries the kernel hasn't looked up,
+ * as the high-level FUSE library uses */
+#define UNKNOWN_INO 0xffffffff
+
+/* an inode the kernel knows about. its handle is assigned on first use,
+ * from the names of the inode and its parents up to the root */
+struct node {
+	fuse_ino_t parent;
+	char * name;		/* NULL once unlinked, "" for the root */
+	unsigned long generation;
+	uint64_t nlookup;	/* references held by the kernel */
+	int open;		/* open files and directories */
+	int busy;		/* operations in progress */
+	int handle;		/* -1 when none is assigned */
+	uint32_t hash;		/* of parent and name, while in the children table */
+	fuse_ino_t next;	/* in the free list */
+};
 
 struct connection_info {
+	struct newtp_conn * nc;
 	struct intro intro;
 
 	char * hostname;
 
-	char ** handles;
-	int * handles_open;
+	/* FUSE calls come from many threads. lock protects the inodes, the
+	 * handle table and opendirs. an inode is not freed, nor its handle
+	 * taken away, while it is open or busy (pinned by an operation) */
+	pthread_mutex_t lock;
+	struct node ** node_blocks;
+	fuse_ino_t node_count;
+	fuse_ino_t free_nodes;
+	fuse_ino_t * children;		/* 0 for empty slots */
+	uint32_t child_mask;
+	uint32_t child_count;
+	/* handles are reused in CLOCK order: the hand passes over handles
+	 * used since it last came by, clearing their bit */
+	fuse_ino_t * handle_owner;	/* inode of each handle, or 0 */
+	uint8_t * handle_used;
 	uint16_t max_handles;
 	uint16_t cur_handle;
-	hash_bucket * handle_ht;
+	unsigned long handle_hits, handle_assigns, handle_evictions;
+	/* write-back buffers, created when a handle is first opened and
+	 * shared by all its open files */
+	struct writeback ** writebacks;
+	/* open files of each handle, so a write or truncate through one can
+	 * drop what all of them read ahead. under files_lock, not lock */
+	struct open_file ** files;
+	pthread_mutex_t files_lock;
 
 	int opendirs;
+	pthread_mutex_t dir_locks[DIR_LOCKS];
 };
 
 static struct connection_info conn;
-static struct fuse_operations newtp_oper;
+static struct fuse_lowlevel_ops newtp_ll_oper;
+
+struct newfs_options {
+	double attr_timeout;
+	double negative_timeout;
+};
+static struct newfs_options options = { 1.0, 1.0 };
+
+#define NEWFS_OPT(t, p) { t, offsetof(struct newfs_options, p), 0 }
 
 static struct fuse_opt newtp_opts[] = {
+	NEWFS_OPT("attr_timeout=%lf", attr_timeout),
+	NEWFS_OPT("negative_timeout=%lf", negative_timeout),
 	FUSE_OPT_KEY("--help", 1),
 	FUSE_OPT_KEY("-h", 1),
 	FUSE_OPT_KEY("--version", 2),
@@ -58,14 +119,19 @@ static int newtp_opt_proc (void * data, const char * arg, int key, struct fuse_a
 {
 	switch(key) {
 		case 1: /* help */
-			fprintf(stderr, "usage: %s hostname mountpoint [options]\n\n", outargs->argv[0]);
+			fprintf(stderr, "usage: %s hostname mountpoint [options]\n\n"
+				"newfs options:\n"
+				"    -o attr_timeout=T      cache attributes for T seconds (1.0)\n"
+				"    -o negative_timeout=T  cache missing files for T seconds (1.0)\n\n",
+				outargs->argv[0]);
 			fuse_opt_add_arg(outargs, "-ho");
-			fuse_main(outargs->argc, outargs->argv, &newtp_oper, NULL);
+			fuse_parse_cmdline(outargs, NULL, NULL, NULL);
+			fuse_lowlevel_new(outargs, &newtp_ll_oper, sizeof(newtp_ll_oper), NULL);
 			exit(1);
 		case 2: /* version */
 			fprintf(stderr, "newfs version 0.1\n");
-			fuse_opt_add_arg(outargs, "-V");
-			fuse_main(outargs->argc, outargs->argv, &newtp_oper, NULL);
+			fuse_opt_add_arg(outargs, "--version");
+			fuse_lowlevel_new(outargs, &newtp_ll_oper, sizeof(newtp_ll_oper), NULL);
 			exit(1);
 		case FUSE_OPT_KEY_NONOPT:
 			if (!conn.hostname) {
@@ -76,118 +142,386 @@ static int newtp_opt_proc (void * data, const char * arg, int key, struct fuse_a
 	return 1; /* keep the argument */
 }
 
+static struct node * node_get (fuse_ino_t ino);
+
 int main(int argc, char** argv) {
-	int ret;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session * se;
+	struct fuse_chan * ch;
+	struct node * root;
+	char * mountpoint = NULL;
+	int multithreaded, foreground, ret = 1;
 	Gsasl * ctx;
 	memset(&conn, 0, sizeof(conn));
 
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	fuse_opt_parse(&args, NULL, newtp_opts, newtp_opt_proc);
-	fuse_opt_add_arg(&args, "-s");
+	if (fuse_opt_parse(&args, &options, newtp_opts, newtp_opt_proc) == -1 ||
+	    fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
 
-	if (!conn.hostname) {
+	if (!conn.hostname || !mountpoint) {
 		fprintf(stderr, "please specify hostname and mount point\n");
 		exit(1);
 	}
 
 	/* connect */
-	if (newtp_client_connect(conn.hostname, "63987", &conn.intro, NULL)) return 1;
 	gsasl_init(&ctx);
-	newtp_client_sasl_auth(ctx, &conn.intro);
+	conn.nc = newtp_connect(conn.hostname, NEWTP_PORT, ctx);
+	if (!conn.nc) return 1;
+	conn.intro = *newtp_server_intro(conn.nc);
 
-	/* initialize conn */
+	/* initialize conn. inode 0 is unused, the root is always there */
 	conn.max_handles = (MAX_HANDLES < conn.intro.max_handles) ? MAX_HANDLES : conn.intro.max_handles;
-	conn.handles = xmalloc(sizeof(char *) * conn.max_handles);
-	conn.handles_open = xmalloc(sizeof(int) * conn.max_handles);
-	conn.handle_ht = xmalloc(sizeof(hash_bucket) * HASH_MODULE);
+	conn.handle_owner = xcalloc(sizeof(fuse_ino_t) * conn.max_handles);
+	conn.writebacks = xcalloc(sizeof(struct writeback *) * conn.max_handles);
+	conn.files = xcalloc(sizeof(struct open_file *) * conn.max_handles);
+	conn.handle_used = xcalloc(conn.max_handles);
+	conn.children = xcalloc(sizeof(fuse_ino_t) * CHILD_SLOTS);
+	conn.child_mask = CHILD_SLOTS - 1;
+	conn.node_blocks = xmalloc(sizeof(struct node *));
+	conn.node_blocks[0] = xcalloc(sizeof(struct node) * NODE_BLOCK);
+	conn.node_count = FUSE_ROOT_ID + 1;
+	root = node_get(FUSE_ROOT_ID);
+	root->name = strdup("");
+	root->nlookup = 1;
+	root->handle = -1;
+	pthread_mutex_init(&conn.lock, NULL);
+	pthread_mutex_init(&conn.files_lock, NULL);
+	attr_cache_init(options.attr_timeout, ATTR_CACHE_ENTRIES);
+	for (int i = 0; i < DIR_LOCKS; i++) pthread_mutex_init(conn.dir_locks + i, NULL);
 
 	/* proceed */
-	ret = fuse_main(args.argc, args.argv, &newtp_oper, NULL);
+	ch = fuse_mount(mountpoint, &args);
+	if (ch) {
+		se = fuse_lowlevel_new(&args, &newtp_ll_oper, sizeof(newtp_ll_oper), NULL);
+		if (se) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
 
+	newtp_disconnect(conn.nc);
 	gsasl_done(ctx);
-	newtp_gnutls_disconnect(1);
-	return ret;
+	fuse_opt_free_args(&args);
+	free(mountpoint);
+	return ret ? 1 : 0;
 }
 
-/* the djb2 hashing function
- * http://www.cse.yorku.ca/~oz/hash.html */
-unsigned long djb2 (char const * str)
+/**** inodes ****/
+
+/* the functions below are called with conn.lock held */
+
+static struct node * node_get (fuse_ino_t ino)
 {
-	unsigned char * s = (unsigned char *)str;
-	unsigned long hash = 5381;
-	int c;
-	while ((c = *s++))
-		hash = ((hash << 5) + hash) ^ c; /* hash * 33 ^ c */
+	return conn.node_blocks[ino / NODE_BLOCK] + ino % NODE_BLOCK;
+}
+
+/* FNV-1a over the name, mixed with the parent */
+static uint32_t child_hash (fuse_ino_t parent, char const * name)
+{
+	uint32_t hash = 2166136261u ^ (uint32_t)(parent * 2654435761u);
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
 	return hash;
 }
 
+/* inode of name in directory parent, or 0 */
+static fuse_ino_t node_find (fuse_ino_t parent, char const * name)
+{
+	uint32_t hash = child_hash(parent, name);
+	uint32_t i = hash & conn.child_mask;
+	fuse_ino_t ino;
+
+	for (; (ino = conn.children[i]); i = (i + 1) & conn.child_mask) {
+		struct node * n = node_get(ino);
+		if (n->hash == hash && n->parent == parent && !strcmp(n->name, name)) break;
+	}
+	return ino;
+}
+
+/* puts ino in the first free slot from where its hash points */
+static void child_insert (fuse_ino_t ino)
+{
+	uint32_t i = node_get(ino)->hash & conn.child_mask;
+	while (conn.children[i]) i = (i + 1) & conn.child_mask;
+	conn.children[i] = ino;
+}
+
+static void node_hash (fuse_ino_t ino)
+{
+	struct node * n = node_get(ino);
+
+	if (2 * (conn.child_count + 1) > conn.child_mask + 1) {
+		fuse_ino_t * old = conn.children;
+		uint32_t size = conn.child_mask + 1;
+		conn.children = xcalloc(sizeof(fuse_ino_t) * size * 2);
+		conn.child_mask = size * 2 - 1;
+		for (uint32_t i = 0; i < size; i++) {
+			if (old[i]) child_insert(old[i]);
+		}
+		free(old);
+	}
+	n->hash = child_hash(n->parent, n->name);
+	child_insert(ino);
+	conn.child_count++;
+}
+
+static void node_unhash (fuse_ino_t ino)
+{
+	uint32_t i = node_get(ino)->hash & conn.child_mask, j;
+
+	while (conn.children[i] != ino) i = (i + 1) & conn.child_mask;
+	/* move later entries of the run back into the hole, unless that
+	 * would put them before the slot their hash points to */
+	for (j = (i + 1) & conn.child_mask; conn.children[j]; j = (j + 1) & conn.child_mask) {
+		uint32_t home = node_get(conn.children[j])->hash & conn.child_mask;
+		if (((j - home) & conn.child_mask) >= ((j - i) & conn.child_mask)) {
+			conn.children[i] = conn.children[j];
+			i = j;
+		}
+	}
+	conn.children[i] = 0;
+	conn.child_count--;
+}
+
+/* the file is gone from its directory, but the kernel may still use it */
+static void node_unlink (fuse_ino_t ino)
+{
+	struct node * n = node_get(ino);
+	node_unhash(ino);
+	free(n->name);
+	n->name = NULL;
+}
+
+/* frees the inode once neither the kernel nor an operation uses it */
+static void node_check (fuse_ino_t ino)
+{
+	struct node * n = node_get(ino);
+	if (n->nlookup || n->open || n->busy || ino == FUSE_ROOT_ID) return;
+	if (n->name) node_unlink(ino);
+	if (n->handle >= 0) conn.handle_owner[n->handle] = 0;
+	n->handle = -1;
+	n->next = conn.free_nodes;
+	conn.free_nodes = ino;
+}
+
+/* finds or adds the inode of name in parent, and pins it */
+static fuse_ino_t child_pin (fuse_ino_t parent, char const * name)
+{
+	fuse_ino_t ino = node_find(parent, name);
+	struct node * n;
+
+	if (!ino) {
+		ino = conn.free_nodes;
+		if (ino) {
+			conn.free_nodes = node_get(ino)->next;
+		} else {
+			if (conn.node_count % NODE_BLOCK == 0) {
+				int blocks = conn.node_count / NODE_BLOCK;
+				conn.node_blocks = xrealloc(conn.node_blocks, sizeof(struct node *) * (blocks + 1));
+				conn.node_blocks[blocks] = xcalloc(sizeof(struct node) * NODE_BLOCK);
+			}
+			ino = conn.node_count++;
+		}
+		n = node_get(ino);
+		n->parent = parent;
+		n->name = strdup(name);
+		/* the kernel tells reused inode numbers apart by generation */
+		n->generation++;
+		n->nlookup = 0;
+		n->open = 0;
+		n->busy = 0;
+		n->handle = -1;
+		node_hash(ino);
+	}
+	node_get(ino)->busy++;
+	return ino;
+}
+
+/* writes the path of ino on the server, as "/share/dir/name" or "" for
+ * the root, into buf of MAX_LENGTH bytes. returns its length or negative
+ * errno. the names are put together from the end of buf */
+static int node_path (fuse_ino_t ino, char * buf)
+{
+	int pos = MAX_LENGTH;
+	while (ino != FUSE_ROOT_ID) {
+		struct node * n = node_get(ino);
+		int len;
+		if (!n->name) return -ENOENT;
+		len = strlen(n->name);
+		if (len + 1 > pos) return -ENAMETOOLONG;
+		pos -= len;
+		memcpy(buf + pos, n->name, len);
+		buf[--pos] = '/';
+		ino = n->parent;
+	}
+	memmove(buf, buf + pos, MAX_LENGTH - pos);
+	return MAX_LENGTH - pos;
+}
+
+/* attribute cache key of name in parent */
+static int child_key (char * key, fuse_ino_t parent, char const * name)
+{
+	return snprintf(key, KEY_MAX, "%lx.%lx/%s", (unsigned long)parent,
+		node_get(parent)->generation, name);
+}
+
+/* key of ino itself, -1 for the root and unlinked files */
+static int node_key (char * key, fuse_ino_t ino)
+{
+	struct node * n = node_get(ino);
+	if (ino == FUSE_ROOT_ID || !n->name) return -1;
+	return child_key(key, n->parent, n->name);
+}
+
+/* a renamed directory moves everything below it on the server. handles
+ * of inodes there are dropped and assigned again when used; those in use
+ * keep referring to their old paths */
+static void drop_handles_below (fuse_ino_t dir)
+{
+	for (int h = 0; h < conn.max_handles; h++) {
+		fuse_ino_t ino = conn.handle_owner[h];
+		struct node * n;
+		if (!ino || ino == dir) continue;
+		n = node_get(ino);
+		if (n->open || n->busy) continue;
+		for (fuse_ino_t up = n->parent; up && up != FUSE_ROOT_ID; up = node_get(up)->parent) {
+			if (up == dir) {
+				n->handle = -1;
+				conn.handle_owner[h] = 0;
+				break;
+			}
+			if (!node_get(up)->name) break;
+		}
+	}
+}
+
+/* the functions below take conn.lock themselves */
 
-void replace_handle (uint16_t slot, char const * newpath, int len)
-{
-	unsigned long hash = djb2(newpath) % HASH_MODULE;
-	hash_bucket * bucket;
-
-	/* is the slot occupied? */
-	if (conn.handles[slot]) {
-		/* destroy it */
-		conn.handles_open[slot] = 0;
-		unsigned long h2 = djb2(conn.handles[slot]) % HASH_MODULE;
-		free(conn.handles[slot]);
-		/* delete hashtable entry */
-		bucket = conn.handle_ht + h2;
-		int p;
-		for (p = 0; (p < bucket->items) && (bucket->bucket[p] != slot); p++) { /* nothing */ }
-		for (; p < bucket->size - 1; p++)
-			bucket->bucket[p] = bucket->bucket[p + 1];
-		bucket->items--;
-	}
-
-	/* install new entry */
-	conn.handles[slot] = xmalloc(len + 1);
-	strcpy(conn.handles[slot], newpath);
-	/* place into hashtable */
-	bucket = conn.handle_ht + hash;
-	if (bucket->items == bucket->size) {
-		if (bucket->size == 0) bucket->size = 32;
-		else bucket->size *= 2;
-		bucket->bucket = xrealloc(bucket->bucket, sizeof(uint16_t) * bucket->size);
-	}
-	bucket->bucket[bucket->items++] = slot;
-}
-
-/* gets handle from hashtable or assigns a new one */
-uint16_t get_handle (char const * path) {
-	struct reply reply;
-	if (strcmp(path, "/") == 0) path = "";
-	unsigned long hash = djb2(path) % HASH_MODULE;
-	int len = strlen(path);
-	hash_bucket * bucket;
-
-	/* perform hash lookup */
-	bucket = conn.handle_ht + hash;
-	for (int i = 0; i < bucket->items; i++) {
-		uint16_t handle = bucket->bucket[i];
-		if (strcmp(conn.handles[handle], path)) continue;
-		/* found it */
+static void pin_node (fuse_ino_t ino)
+{
+	pthread_mutex_lock(&conn.lock);
+	node_get(ino)->busy++;
+	pthread_mutex_unlock(&conn.lock);
+}
+
+static void unpin_node (fuse_ino_t ino)
+{
+	pthread_mutex_lock(&conn.lock);
+	node_get(ino)->busy--;
+	node_check(ino);
+	pthread_mutex_unlock(&conn.lock);
+}
+
+/* handle of the pinned inode ino, assigned if it has none.
+ * returns negative errno on failure */
+static int get_handle (fuse_ino_t ino)
+{
+	struct newtp_req * r;
+	struct node * n;
+	int handle = -1, len, res;
+
+	pthread_mutex_lock(&conn.lock);
+	n = node_get(ino);
+	if (n->handle >= 0) {
+		handle = n->handle;
+		conn.handle_used[handle] = 1;
+		conn.handle_hits++;
+		pthread_mutex_unlock(&conn.lock);
 		return handle;
 	}
-	/* path is not in table */
 
-	/* can we allocate more? */
-	int ch = conn.cur_handle;
-	/* find first non-open handle. that should not take long
-	 * if the slot is free, it will not be open */
-	while (conn.handles_open[ch]) ch = (ch + 1) % conn.max_handles;
-	replace_handle(ch, path, len);
+	/* find a free handle, or one neither pinned nor used lately. after
+	 * two rounds every unpinned handle has had its bit cleared */
+	for (int tries = 0; tries < 2 * conn.max_handles && handle < 0; tries++) {
+		int ch = conn.cur_handle;
+		conn.cur_handle = (ch + 1) % conn.max_handles;
+		if (conn.handle_owner[ch]) {
+			struct node * owner = node_get(conn.handle_owner[ch]);
+			if (owner->open || owner->busy) continue;
+			if (conn.handle_used[ch]) {
+				conn.handle_used[ch] = 0;
+				continue;
+			}
+			owner->handle = -1;
+			conn.handle_evictions++;
+		}
+		handle = ch;
+	}
+	if (handle < 0) {
+		pthread_mutex_unlock(&conn.lock);
+		return -ENFILE;
+	}
 
-	conn.cur_handle = (ch + 1) % conn.max_handles;
+	r = newtp_req_new(conn.nc, CMD_ASSIGN, handle);
+	len = node_path(ino, newtp_req_payload(r, MAX_LENGTH));
+	if (len < 0) {
+		conn.handle_owner[handle] = 0;
+		pthread_mutex_unlock(&conn.lock);
+		newtp_req_free(r);
+		return len;
+	}
+	newtp_req_payload(r, len);
+	conn.handle_owner[handle] = ino;
+	conn.handle_used[handle] = 1;
+	conn.handle_assigns++;
+	n->handle = handle;
+
+	/* assign on server. the command is sent before the lock is released,
+	 * so anyone finding the handle in the table sends theirs after it */
+	newtp_submit(r, NULL, NULL);
+	pthread_mutex_unlock(&conn.lock);
+
+	res = newtp_result_to_errno(newtp_wait(r));
+	newtp_req_free(r);
+	if (res < 0) {
+		pthread_mutex_lock(&conn.lock);
+		if (n->handle == handle) {
+			n->handle = -1;
+			conn.handle_owner[handle] = 0;
+		}
+		pthread_mutex_unlock(&conn.lock);
+		return res;
+	}
+	return handle;
+}
+
+/* gets the data written through handle to the server, before operations
+ * that look at or change the file by path. returns 0 or negative errno */
+static int sync_handle (uint16_t handle)
+{
+	struct writeback * wb;
+	pthread_mutex_lock(&conn.lock);
+	wb = conn.writebacks[handle];
+	pthread_mutex_unlock(&conn.lock);
+	return wb ? wb_sync(wb) : 0;
+}
 
-	/* assign on server */
-	strcpy(data_out, path);
-	reply_for_command(0, CMD_ASSIGN, ch, len, &reply);
-	assert(reply.result == STAT_OK);
+static void drop_attrs (fuse_ino_t ino)
+{
+	char key[KEY_MAX];
+	int len;
+	pthread_mutex_lock(&conn.lock);
+	len = node_key(key, ino);
+	pthread_mutex_unlock(&conn.lock);
+	if (len >= 0) attr_cache_drop(key);
+}
 
-	return ch;
+static void drop_child_attrs (fuse_ino_t parent, char const * name)
+{
+	char key[KEY_MAX];
+	pthread_mutex_lock(&conn.lock);
+	child_key(key, parent, name);
+	pthread_mutex_unlock(&conn.lock);
+	attr_cache_drop(key);
 }
 
 /**** value converters ****/
@@ -213,315 +547,731 @@ void newtp_attr_to_stat (struct stat * st, char * attrs)
 	newtp_time_to_timespec(&st->st_ctim, ctime);
 }
 
-int newtp_result_to_errno (int result)
+/* runs the request and frees it. returns 0 or negative errno */
+static int run_and_free (struct newtp_req * r)
+{
+	int res = newtp_result_to_errno(newtp_run(r));
+	newtp_req_free(r);
+	return res;
+}
+
+/* waits for a submitted request and frees it. returns 0 or negative errno */
+static int wait_and_free (struct newtp_req * r)
+{
+	int res = newtp_result_to_errno(newtp_wait(r));
+	newtp_req_free(r);
+	return res;
+}
+
+static struct newtp_req * submit_stat (uint16_t handle)
 {
-	if (result < 0x80) return 0;
-	switch(result) {
-		case ERR_DENIED:   return -EACCES;
-		case ERR_BUSY:     return -EBUSY;
-		case ERR_BADPATH:
-		case ERR_NOTFOUND: return -ENOENT;
-		case ERR_NOTDIR:   return -ENOTDIR;
-		case ERR_NOTFILE:  return -ENFILE;
+	struct newtp_req * r = newtp_req_new(conn.nc, CMD_STAT, handle);
+	memcpy(newtp_req_payload(r, STAT_QUERY_LENGTH), STAT_ATTR_QUERY, STAT_QUERY_LENGTH);
+	newtp_submit(r, NULL, NULL);
+	return r;
+}
 
-		case ERR_BADOFFSET:return -EINVAL;
-		case ERR_TOOBIG:   return -EFBIG;
-		case ERR_DEVFULL:  return -ENOSPC;
-		case ERR_NOTEMPTY: return -ENOTEMPTY;
-		default:           return -EIO;
+/* waits for a STAT and frees it. returns 0 or negative errno */
+static int finish_stat (struct newtp_req * r, struct stat * st)
+{
+	int res = newtp_result_to_errno(newtp_wait(r));
+	if (res == 0) {
+		if (r->reply.length < STAT_RESULT_LENGTH) res = -EIO;
+		else newtp_attr_to_stat(st, r->data);
 	}
+	newtp_req_free(r);
+	return res;
 }
-#define MAYBE_RET {\
-	int _r = newtp_result_to_errno(reply.result); \
-	if (_r < 0) return _r; \
+
+/* attributes of the pinned inode ino from the server */
+static int stat_node (fuse_ino_t ino, struct stat * st)
+{
+	int handle = get_handle(ino);
+	if (handle < 0) return handle;
+	sync_handle(handle);
+	return finish_stat(submit_stat(handle), st);
+}
+
+/* reply to lookup, mkdir and create with the pinned inode ino, which
+ * the kernel references once more. unpins ino */
+static void reply_entry (fuse_req_t req, fuse_ino_t ino, struct stat const * st,
+		struct fuse_file_info * fi)
+{
+	struct fuse_entry_param e;
+	struct node * n;
+
+	memset(&e, 0, sizeof(e));
+	pthread_mutex_lock(&conn.lock);
+	n = node_get(ino);
+	n->nlookup++;
+	n->busy--;
+	e.ino = ino;
+	e.generation = n->generation;
+	pthread_mutex_unlock(&conn.lock);
+	e.attr = *st;
+	e.attr.st_ino = ino;
+	e.attr_timeout = e.entry_timeout = options.attr_timeout;
+	if (fi) fuse_reply_create(req, &e, fi);
+	else fuse_reply_entry(req, &e);
 }
 
 /**** filesystem calls ****/
 
-int newtp_getattr (char const * path, struct stat * st)
+static void newtp_init (void * userdata, struct fuse_conn_info * fci)
 {
-	struct reply reply;
-	int handle;
+	/* FUSE has daemonized by now, so the log writer thread survives */
+	log_init();
+	/* as does the receiver, which lets FUSE threads share the connection */
+	if (newtp_start_receiver(conn.nc) < 0) exit(1);
+}
 
-	memset(st, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
-		st->st_mode = S_IFDIR | 0755;
-		return 0;
+static void newtp_destroy (void * userdata)
+{
+	unsigned long uses = conn.handle_hits + conn.handle_assigns;
+	logp("handles: %lu uses, %.1f%% hits, %lu assigns, %lu evictions", uses,
+		uses ? 100.0 * conn.handle_hits / uses : 0.0, conn.handle_assigns, conn.handle_evictions);
+	attr_cache_report();
+}
+
+static void newtp_lookup (fuse_req_t req, fuse_ino_t parent, char const * name)
+{
+	char key[KEY_MAX];
+	struct stat st;
+	fuse_ino_t ino;
+	int len, res;
+
+	pthread_mutex_lock(&conn.lock);
+	ino = child_pin(parent, name);
+	len = child_key(key, parent, name);
+	pthread_mutex_unlock(&conn.lock);
+
+	res = attr_cache_get(key, &st);
+	if (res > 0) {
+		res = stat_node(ino, &st);
+		if (res == 0) attr_cache_put(key, len, &st);
+	}
+	if (res == 0) {
+		reply_entry(req, ino, &st, NULL);
+		return;
+	}
+	unpin_node(ino);
+	if (res == -ENOENT && options.negative_timeout > 0) {
+		/* the kernel remembers that the name is missing */
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = options.negative_timeout;
+		fuse_reply_entry(req, &e);
+	} else {
+		fuse_reply_err(req, -res);
 	}
+}
 
-	handle = get_handle(path);
-	strcpy(data_out, STAT_ATTR_QUERY);
-	reply_for_command(0, CMD_STAT, handle, strlen(STAT_ATTR_QUERY), &reply);
-	MAYBE_RET;
+static void newtp_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	pthread_mutex_lock(&conn.lock);
+	node_get(ino)->nlookup -= nlookup;
+	node_check(ino);
+	pthread_mutex_unlock(&conn.lock);
+	fuse_reply_none(req);
+}
 
-	if (reply.length < STAT_RESULT_LENGTH) return -EIO;
+static void newtp_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+	char key[KEY_MAX];
+	struct stat st;
+	int len, res = 0;
+
+	memset(&st, 0, sizeof(struct stat));
+	if (ino == FUSE_ROOT_ID) {
+		st.st_mode = S_IFDIR | 0755;
+	} else {
+		pthread_mutex_lock(&conn.lock);
+		node_get(ino)->busy++;
+		len = node_key(key, ino);
+		pthread_mutex_unlock(&conn.lock);
+		if (len < 0 || attr_cache_get(key, &st) != 0) {
+			res = stat_node(ino, &st);
+			if (res == 0 && len >= 0) attr_cache_put(key, len, &st);
+		}
+		unpin_node(ino);
+	}
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, options.attr_timeout);
+}
 
-	newtp_attr_to_stat(st, data_in);
+/* files opened by open and create carry their handle and readahead
+ * state in fi->fh */
+struct open_file {
+	fuse_ino_t ino;
+	uint16_t handle;
+	struct readahead ra;
+	struct writeback * wb;
+	struct open_file * next;	/* in conn.files[handle] */
+};
 
-	return 0;
+/* call with conn.lock held */
+static void open_file_new (struct fuse_file_info * fi, fuse_ino_t ino, uint16_t handle)
+{
+	struct open_file * of = xmalloc(sizeof(struct open_file));
+	of->ino = ino;
+	of->handle = handle;
+	ra_init(&of->ra, conn.nc, handle);
+	if (!conn.writebacks[handle]) {
+		conn.writebacks[handle] = xmalloc(sizeof(struct writeback));
+		wb_init(conn.writebacks[handle], conn.nc, handle);
+	}
+	of->wb = conn.writebacks[handle];
+	pthread_mutex_lock(&conn.files_lock);
+	of->next = conn.files[handle];
+	conn.files[handle] = of;
+	pthread_mutex_unlock(&conn.files_lock);
+	node_get(ino)->open++;
+	fi->fh = (uintptr_t)of;
 }
 
-int newtp_opendir (char const * path, struct fuse_file_info * fi)
+static void open_file_free (struct open_file * of)
 {
-	struct reply reply;
-	/* "/" is forbidden in NewTP */
+	struct open_file ** p;
+	pthread_mutex_lock(&conn.files_lock);
+	for (p = conn.files + of->handle; *p != of; p = &(*p)->next);
+	*p = of->next;
+	pthread_mutex_unlock(&conn.files_lock);
+	ra_destroy(&of->ra);
+	free(of);
+}
 
-	int handle = get_handle(path);
-	if (conn.opendirs > conn.intro.max_opendirs) /* reached max number of open dirs */
-		return -ENFILE;
+/* data read ahead through any open file of the handle is stale */
+static void drop_readahead (uint16_t handle)
+{
+	pthread_mutex_lock(&conn.files_lock);
+	for (struct open_file * of = conn.files[handle]; of; of = of->next) ra_drop(&of->ra);
+	pthread_mutex_unlock(&conn.files_lock);
+}
+
+static struct open_file * file_of (struct fuse_file_info * fi)
+{
+	return (struct open_file *)(uintptr_t)fi->fh;
+}
+
+static void newtp_setattr (fuse_req_t req, fuse_ino_t ino, struct stat * attr,
+		int to_set, struct fuse_file_info * fi)
+{
+	struct newtp_req * r[7];
+	struct timespec now;
+	struct stat st;
+	int n = 0, handle, res;
+
+	pin_node(ino);
+	handle = get_handle(ino);
+	if (handle < 0) {
+		unpin_node(ino);
+		fuse_reply_err(req, -handle);
+		return;
+	}
+	/* buffered writes could extend the file again, or set mtime */
+	sync_handle(handle);
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	/* all changes and the STAT for the reply are sent together */
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		r[n] = newtp_req_new(conn.nc, CMD_SETATTR, handle);
+		pack(newtp_req_payload(r[n], 3), "cs", (uint8_t)ATTR_PERMS, (uint16_t)(attr->st_mode & 0x0fff));
+		newtp_submit(r[n++], NULL, NULL);
+	}
+	if (to_set & FUSE_SET_ATTR_UID) {
+		r[n] = newtp_req_new(conn.nc, CMD_SETATTR, handle);
+		pack(newtp_req_payload(r[n], 5), "ci", (uint8_t)ATTR_UID, (uint32_t)attr->st_uid);
+		newtp_submit(r[n++], NULL, NULL);
+	}
+	if (to_set & FUSE_SET_ATTR_GID) {
+		r[n] = newtp_req_new(conn.nc, CMD_SETATTR, handle);
+		pack(newtp_req_payload(r[n], 5), "ci", (uint8_t)ATTR_GID, (uint32_t)attr->st_gid);
+		newtp_submit(r[n++], NULL, NULL);
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		r[n] = newtp_req_new(conn.nc, CMD_TRUNCATE, handle);
+		pack(newtp_req_payload(r[n], 8), "l", (uint64_t)attr->st_size);
+		newtp_submit(r[n++], NULL, NULL);
+	}
+	if (to_set & FUSE_SET_ATTR_ATIME) {
+		struct timespec ts = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atim;
+		r[n] = newtp_req_new(conn.nc, CMD_SETATTR, handle);
+		pack(newtp_req_payload(r[n], 9), "cl", (uint8_t)ATTR_ATIME, (uint64_t)newtp_timespec_to_time(ts));
+		newtp_submit(r[n++], NULL, NULL);
+	}
+	if (to_set & FUSE_SET_ATTR_MTIME) {
+		struct timespec ts = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now : attr->st_mtim;
+		r[n] = newtp_req_new(conn.nc, CMD_SETATTR, handle);
+		pack(newtp_req_payload(r[n], 9), "cl", (uint8_t)ATTR_MTIME, (uint64_t)newtp_timespec_to_time(ts));
+		newtp_submit(r[n++], NULL, NULL);
+	}
+	r[n] = submit_stat(handle);
+
+	res = 0;
+	for (int i = 0; i < n; i++) {
+		int e = newtp_result_to_errno(newtp_wait(r[i]));
+		if (res == 0) res = e;
+		newtp_req_free(r[i]);
+	}
+	n = finish_stat(r[n], &st);
+	if (res == 0) res = n;
+	drop_attrs(ino);
+	/* after the TRUNCATE, so nothing read ahead before it is left,
+	 * whichever file (or path, without fi) it came through */
+	if (to_set & FUSE_SET_ATTR_SIZE) drop_readahead(handle);
+	unpin_node(ino);
+
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, options.attr_timeout);
+}
 
+/* open directories keep their listing, which readdir hands out in parts */
+struct open_dir {
+	uint16_t handle;
+	char * buf;		/* entries, as added by fuse_add_direntry */
+	size_t size, cap;
+	int loaded;
+};
+
+static struct open_dir * dir_of (struct fuse_file_info * fi)
+{
+	return (struct open_dir *)(uintptr_t)fi->fh;
+}
+
+static void newtp_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+	struct open_dir * d;
+	int handle, res;
+
+	pin_node(ino);
+	handle = get_handle(ino);
+	res = handle < 0 ? handle : 0;
+	if (res == 0 && conn.opendirs > conn.intro.max_opendirs) /* reached max number of open dirs */
+		res = -ENFILE;
 	/* rewind */
-	reply_for_command(0, CMD_REWINDDIR, handle, 0, &reply);
-	MAYBE_RET;
-	/* success */
-	conn.opendirs++;
-	conn.handles_open[handle] = 1;
-	fi->fh = handle;
-	return 0;
+	if (res == 0) res = run_and_free(newtp_req_new(conn.nc, CMD_REWINDDIR, handle));
+	if (res == 0) {
+		/* success */
+		pthread_mutex_lock(&conn.lock);
+		conn.opendirs++;
+		node_get(ino)->open++;
+		pthread_mutex_unlock(&conn.lock);
+		d = xcalloc(sizeof(struct open_dir));
+		d->handle = handle;
+		fi->fh = (uintptr_t)d;
+	}
+	unpin_node(ino);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_open(req, fi);
 }
 
-int newtp_releasedir (char const * path, struct fuse_file_info * fi)
+static void newtp_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
 {
-	int handle = fi->fh;
-	conn.handles_open[handle] = 0;
+	struct open_dir * d = dir_of(fi);
+	pthread_mutex_lock(&conn.lock);
+	node_get(ino)->open--;
 	conn.opendirs--;
-	return 0;
+	node_check(ino);
+	pthread_mutex_unlock(&conn.lock);
+	free(d->buf);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void dir_add (fuse_req_t req, struct open_dir * d, char const * name, struct stat const * st)
+{
+	size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	if (d->size + len > d->cap) {
+		d->cap = (d->size + len > 2 * d->cap) ? d->size + len + 4096 : 2 * d->cap;
+		d->buf = xrealloc(d->buf, d->cap);
+	}
+	fuse_add_direntry(req, d->buf + d->size, len, name, st, d->size + len);
+	d->size += len;
 }
 
-int newtp_readdir (char const * path, void * buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info * fi)
+/* reads the whole listing into d, and the attributes of the entries
+ * into the cache. returns 0 or negative errno */
+static int dir_load (fuse_req_t req, fuse_ino_t ino, struct open_dir * d)
 {
-	struct reply reply;
+	struct newtp_req * rewind, * r;
 	struct dir_entry entry;
 	struct stat st;
-	int handle = fi->fh;
-	int remaining;
+	pthread_mutex_t * dir_lock = conn.dir_locks + d->handle % DIR_LOCKS;
+	int remaining, res = 0;
 	uint16_t items;
 	char * item;
+	char key[KEY_MAX];
 
-	memset(&st,    0, sizeof(struct stat));
-	memset(&entry, 0, sizeof(struct dir_entry));
-
+	d->size = 0;
+	memset(&st, 0, sizeof(struct stat));
 	st.st_mode = S_IFDIR | 0755;
-	filler(buf, "." , &st, 0);
-	filler(buf, "..", &st, 0);
-
-	strcpy(data_out, STAT_ATTR_QUERY);
+	st.st_ino = ino;
+	dir_add(req, d, ".", &st);
+	pthread_mutex_lock(&conn.lock);
+	st.st_ino = (ino == FUSE_ROOT_ID) ? ino : node_get(ino)->parent;
+	pthread_mutex_unlock(&conn.lock);
+	dir_add(req, d, "..", &st);
+
+	/* the server keeps one listing position per handle, so listings
+	 * of the same directory must not interleave. each starts from the
+	 * beginning; the rewind travels together with the first READDIR */
+	pthread_mutex_lock(dir_lock);
+	rewind = newtp_req_new(conn.nc, CMD_REWINDDIR, d->handle);
+	newtp_submit(rewind, NULL, NULL);
+	r = newtp_req_new(conn.nc, CMD_READDIR, d->handle);
+	memcpy(newtp_req_payload(r, STAT_QUERY_LENGTH), STAT_ATTR_QUERY, STAT_QUERY_LENGTH);
 	do {
-		reply_for_command(0, CMD_READDIR, handle, strlen(STAT_ATTR_QUERY), &reply);
-		if (reply.result >= 0x80 || reply.length < 2) return -EIO;
-		unpack(data_in, 2, "s", &items);
-		remaining = reply.length - 2;
-		item = data_in + 2;
+		newtp_run(r);
+		if (rewind) {
+			if (newtp_wait(rewind) >= 0x80) r->reply.result = rewind->reply.result;
+			newtp_req_free(rewind);
+			rewind = NULL;
+		}
+		if (r->reply.result >= 0x80 || r->reply.length < 2) {
+			res = -EIO;
+			break;
+		}
+		unpack(r->data, 2, "s", &items);
+		remaining = r->reply.length - 2;
+		item = r->data + 2;
 		for (int i = 0; i < items; i++) {
-			int len = unpack_dir_entry(item, remaining, &entry);
+			int len = unpack_dir_entry_view(item, remaining, &entry);
+			int key_len;
+			fuse_ino_t child;
+			struct writeback * wb = NULL;
 			if (len < 0 || entry.attr_len < STAT_RESULT_LENGTH) {
-				free(entry.name); free(entry.attr);
 				err("malformed packet in directory listing");
-				return -EIO;
+				res = -EIO;
+				break;
 			}
 			newtp_attr_to_stat(&st, entry.attr);
-			filler(buf, entry.name, &st, 0);
-			free(entry.name); free(entry.attr);
-			entry.name = entry.attr = NULL;
+			/* terminate the name in place. this overwrites attr_len,
+			 * which is already decoded */
+			entry.name[entry.name_len] = 0;
+			pthread_mutex_lock(&conn.lock);
+			child = node_find(ino, entry.name);
+			key_len = child_key(key, ino, entry.name);
+			if (child && node_get(child)->handle >= 0) wb = conn.writebacks[node_get(child)->handle];
+			pthread_mutex_unlock(&conn.lock);
+			/* the server doesn't know the size and mtime of files with
+			 * unsent or unanswered writes. checked after the put, as
+			 * newtp_write drops the attrs after buffering */
+			attr_cache_put(key, key_len, &st);
+			if (wb && wb_dirty(wb)) attr_cache_drop(key);
+			st.st_ino = child ? child : UNKNOWN_INO;
+			dir_add(req, d, entry.name, &st);
 			item += len; remaining -= len;
 		}
-	} while (reply.result != STAT_FINISHED);
+	} while (res == 0 && r->reply.result != STAT_FINISHED);
+	pthread_mutex_unlock(dir_lock);
 
-	return 0;
+	newtp_req_free(r);
+	return res;
 }
 
-int newtp_read (char const * path, char * buf, size_t size, off_t offset,
+static void newtp_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 		struct fuse_file_info * fi)
 {
-	struct reply reply;
-	struct params_offlen params;
-	int handle = fi->fh;
-	size_t total = 0;
-	
-	params.offset = offset;
-	while (total < size) {
-		if (size - total > MAX_LENGTH) params.length = MAX_LENGTH;
-		else params.length = size - total;
-		pack_params_offlen(data_out, &params);
-		reply_for_command(0, CMD_READ, handle, SIZEOF_params_offlen(), &reply);
-		MAYBE_RET;
-		memcpy(buf + total, data_in, reply.length);
-		total += reply.length;
-		params.offset += reply.length;
-		if (reply.length < params.length) return total;
-	}
-	return total;
-}
-
-int newtp_write (char const * path, char const * buf, size_t size, off_t offset,
-		struct fuse_file_info * fi)
-{
-	struct reply reply;
-	int handle = fi->fh;
-	size_t total = 0;
-	uint64_t off = offset;
-	uint16_t len = 0, retlen = 0;
-
-	while (total < size) {
-		if (size - total > MAX_LENGTH - 8) len = MAX_LENGTH - 8;
-		else len = size - total;
-		pack(data_out, "l", off);
-		memcpy(data_out + 8, buf + total, len);
-		reply_for_command(0, CMD_WRITE, handle, len + 8, &reply);
-		MAYBE_RET;
-		assert(reply.length >= 2);
-		unpack(data_in, reply.length, "s", &retlen);
-		total += retlen;
-		off += retlen;
-		if (retlen < len) return total;
+	struct open_dir * d = dir_of(fi);
+	int res;
+
+	/* a listing from the start reads the directory again */
+	if (off == 0 || !d->loaded) {
+		res = dir_load(req, ino, d);
+		if (res < 0) {
+			fuse_reply_err(req, -res);
+			return;
+		}
+		d->loaded = 1;
 	}
-	return total;
+	if ((size_t)off >= d->size) fuse_reply_buf(req, NULL, 0);
+	else fuse_reply_buf(req, d->buf + off, (d->size - off < size) ? d->size - off : size);
 }
 
-int newtp_open (char const * path, struct fuse_file_info * fi)
+static void newtp_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info * fi)
 {
-	int handle = get_handle(path);
-	/* mark the handle as open */
-	conn.handles_open[handle] = 1;
-	/* FUSE stats the file and checks for permissions,
-	 * if there's a race, we can't do anything anyway */
-	fi->fh = handle;
-	return 0;
+	struct open_file * of = file_of(fi);
+	char * buf;
+	/* reads see what was written before them */
+	int res = wb_sync(of->wb);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	buf = xmalloc(size);
+	res = ra_read(&of->ra, buf, size, off);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_buf(req, buf, res);
+	free(buf);
 }
 
-int newtp_release (char const * path, struct fuse_file_info * fi)
+static void newtp_write (fuse_req_t req, fuse_ino_t ino, char const * buf, size_t size,
+		off_t off, struct fuse_file_info * fi)
 {
-	int handle = fi->fh;
-	conn.handles_open[handle] = 0;
-	return 0;
+	struct open_file * of = file_of(fi);
+	int res;
+	/* data read ahead may be stale */
+	drop_readahead(of->handle);
+	res = wb_write(of->wb, buf, size, off);
+	/* size and times change. after buffering, so a listing running
+	 * meanwhile can't put back what the server had before */
+	drop_attrs(ino);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
 }
 
-int newtp_create (char const * path, mode_t mode, struct fuse_file_info * fi)
+/* called on every close of the file, reports errors of buffered writes */
+static void newtp_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	(void) mode; /* we don't use mode */
-	pack(data_out, "l", (uint64_t)0);
-	reply_for_command(0, CMD_WRITE, handle, 8, &reply);
-	MAYBE_RET;
-	/* created successfully, that's as much as we can hope for */
-	conn.handles_open[handle] = 1;
-	fi->fh = handle;
-	return 0;
+	fuse_reply_err(req, -wb_sync(file_of(fi)->wb));
 }
 
-int newtp_truncate (char const * path, off_t offset)
+static void newtp_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info * fi)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	uint64_t off = offset;
-
-	pack(data_out, "l", off);
-	reply_for_command(0, CMD_TRUNCATE, handle, 8, &reply);
-	return newtp_result_to_errno(reply.result);
+	struct open_file * of = file_of(fi);
+	struct newtp_req * r;
+	int res = wb_sync(of->wb);
+	if (res == 0) {
+		r = newtp_req_new(conn.nc, CMD_FLUSH, of->handle);
+		pack(newtp_req_payload(r, 1), "c", (uint8_t)(datasync ? DURABLE_DATA : DURABLE_FULL));
+		res = run_and_free(r);
+	}
+	fuse_reply_err(req, -res);
 }
 
-int newtp_unlink (char const * path)
+static void newtp_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	reply_for_command(0, CMD_DELETE, handle, 0, &reply);
-	return newtp_result_to_errno(reply.result);
+	int handle;
+	pin_node(ino);
+	handle = get_handle(ino);
+	if (handle < 0) {
+		unpin_node(ino);
+		fuse_reply_err(req, -handle);
+		return;
+	}
+	/* mark the handle as open */
+	pthread_mutex_lock(&conn.lock);
+	/* the kernel checked permissions with getattr,
+	 * if there's a race, we can't do anything anyway */
+	open_file_new(fi, ino, handle);
+	node_get(ino)->busy--;
+	pthread_mutex_unlock(&conn.lock);
+	fuse_reply_open(req, fi);
 }
 
-int newtp_mkdir (char const * path, mode_t mode)
+static void newtp_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	(void) mode; /* modes not supported, as we well know */
-	reply_for_command(0, CMD_MAKEDIR, handle, 0, &reply);
-	return newtp_result_to_errno(reply.result);
+	struct open_file * of = file_of(fi);
+	/* flush has reported any errors already */
+	wb_sync(of->wb);
+	/* off the handle's list before the handle can be reused */
+	open_file_free(of);
+	pthread_mutex_lock(&conn.lock);
+	node_get(ino)->open--;
+	node_check(ino);
+	pthread_mutex_unlock(&conn.lock);
+	fuse_reply_err(req, 0);
 }
 
-int newtp_rename (char const * path, char const * newpath)
+static void newtp_create (fuse_req_t req, fuse_ino_t parent, char const * name,
+		mode_t mode, struct fuse_file_info * fi)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	int len = strlen(newpath);
-	strcpy(data_out, newpath);
-	reply_for_command(0, CMD_RENAME, handle, len, &reply);
-	MAYBE_RET;
-	replace_handle(handle, newpath, len);
-	return 0;
+	struct newtp_req * r;
+	struct stat st;
+	fuse_ino_t ino;
+	int handle, res, written;
+	(void) mode; /* we don't use mode */
+
+	pthread_mutex_lock(&conn.lock);
+	ino = child_pin(parent, name);
+	pthread_mutex_unlock(&conn.lock);
+
+	handle = get_handle(ino);
+	res = handle < 0 ? handle : 0;
+	if (res == 0) {
+		r = newtp_req_new(conn.nc, CMD_WRITE, handle);
+		pack(newtp_req_payload(r, 8), "l", (uint64_t)0);
+		newtp_submit(r, NULL, NULL);
+		res = finish_stat(submit_stat(handle), &st);
+		written = wait_and_free(r);
+		if (written < 0) res = written;
+	}
+	drop_child_attrs(parent, name);
+	drop_attrs(parent);
+	if (res < 0) {
+		unpin_node(ino);
+		fuse_reply_err(req, -res);
+		return;
+	}
+	/* created successfully, that's as much as we can hope for */
+	pthread_mutex_lock(&conn.lock);
+	open_file_new(fi, ino, handle);
+	pthread_mutex_unlock(&conn.lock);
+	reply_entry(req, ino, &st, fi);
 }
 
-int newtp_utimens (char const * path, struct timespec const ts[2])
+static void newtp_mkdir (fuse_req_t req, fuse_ino_t parent, char const * name, mode_t mode)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	uint64_t atime = newtp_timespec_to_time(ts[0]);
-	uint64_t mtime = newtp_timespec_to_time(ts[1]);
-	struct timespec now;
-	clock_gettime(CLOCK_REALTIME, &now);
-
-	if (ts[0].tv_nsec == UTIME_NOW) atime = newtp_timespec_to_time(now);
-	if (ts[1].tv_nsec == UTIME_NOW) mtime = newtp_timespec_to_time(now);
+	struct newtp_req * r;
+	struct stat st;
+	fuse_ino_t ino;
+	int handle, res, made;
+	(void) mode; /* modes not supported, as we well know */
 
-	if (ts[0].tv_nsec != UTIME_OMIT) {
-		pack(data_out, "cl", (uint8_t)ATTR_ATIME, atime);
-		reply_for_command(0, CMD_SETATTR, handle, 9, &reply);
-		MAYBE_RET;
+	pthread_mutex_lock(&conn.lock);
+	ino = child_pin(parent, name);
+	pthread_mutex_unlock(&conn.lock);
+
+	handle = get_handle(ino);
+	res = handle < 0 ? handle : 0;
+	if (res == 0) {
+		r = newtp_req_new(conn.nc, CMD_MAKEDIR, handle);
+		newtp_submit(r, NULL, NULL);
+		res = finish_stat(submit_stat(handle), &st);
+		made = wait_and_free(r);
+		if (made < 0) res = made;
 	}
-	if (ts[1].tv_nsec != UTIME_OMIT) {
-		pack(data_out, "cl", (uint8_t)ATTR_MTIME, mtime);
-		reply_for_command(0, CMD_SETATTR, handle, 9, &reply);
-		MAYBE_RET;
+	drop_child_attrs(parent, name);
+	drop_attrs(parent);
+	if (res < 0) {
+		unpin_node(ino);
+		fuse_reply_err(req, -res);
+		return;
 	}
-
-	return 0;
+	reply_entry(req, ino, &st, NULL);
 }
 
-int newtp_chown (char const * path, uid_t uid, gid_t gid)
+/* unlink and rmdir */
+static void newtp_unlink (fuse_req_t req, fuse_ino_t parent, char const * name)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	if (uid != (uid_t)-1) {
-		pack(data_out, "ci", (uint8_t)ATTR_UID, (uint32_t)uid);
-		reply_for_command(0, CMD_SETATTR, handle, 5, &reply);
-		MAYBE_RET;
+	fuse_ino_t ino;
+	int handle, res;
+
+	pthread_mutex_lock(&conn.lock);
+	ino = child_pin(parent, name);
+	pthread_mutex_unlock(&conn.lock);
+
+	handle = get_handle(ino);
+	res = handle < 0 ? handle : 0;
+	if (res == 0) {
+		sync_handle(handle);
+		res = run_and_free(newtp_req_new(conn.nc, CMD_DELETE, handle));
 	}
-	if (gid != (gid_t)-1) {
-		pack(data_out, "ci", (uint8_t)ATTR_GID, (uint32_t)gid);
-		reply_for_command(0, CMD_SETATTR, handle, 5, &reply);
-		MAYBE_RET;
+	drop_child_attrs(parent, name);
+	drop_attrs(parent);
+	if (res == 0) {
+		pthread_mutex_lock(&conn.lock);
+		node_unlink(ino);
+		pthread_mutex_unlock(&conn.lock);
 	}
-	return 0;
+	unpin_node(ino);
+	fuse_reply_err(req, -res);
 }
 
-int newtp_chmod (char const * path, mode_t mode)
+static void newtp_rename (fuse_req_t req, fuse_ino_t parent, char const * name,
+		fuse_ino_t newparent, char const * newname)
 {
-	struct reply reply;
-	int handle = get_handle(path);
-	pack(data_out, "cs", (uint8_t)ATTR_PERMS, (uint16_t)(mode & 0x0fff));
-	reply_for_command(0, CMD_SETATTR, handle, 3, &reply);
-	return newtp_result_to_errno(reply.result);
-}
+	struct newtp_req * r;
+	fuse_ino_t ino, target;
+	int handle, len, res;
+
+	pthread_mutex_lock(&conn.lock);
+	ino = child_pin(parent, name);
+	pthread_mutex_unlock(&conn.lock);
+
+	handle = get_handle(ino);
+	res = handle < 0 ? handle : 0;
+	if (res == 0) {
+		int nlen = strlen(newname);
+		char * payload;
+		sync_handle(handle);
+		r = newtp_req_new(conn.nc, CMD_RENAME, handle);
+		payload = newtp_req_payload(r, MAX_LENGTH);
+		pthread_mutex_lock(&conn.lock);
+		len = node_path(newparent, payload);
+		pthread_mutex_unlock(&conn.lock);
+		if (len >= 0 && len + 1 + nlen > MAX_LENGTH) len = -ENAMETOOLONG;
+		if (len < 0) {
+			newtp_req_free(r);
+			res = len;
+		} else {
+			payload[len] = '/';
+			memcpy(payload + len + 1, newname, nlen);
+			newtp_req_payload(r, len + 1 + nlen);
+			res = run_and_free(r);
+		}
+	}
 
+	drop_child_attrs(parent, name);
+	drop_child_attrs(newparent, newname);
+	drop_attrs(parent);
+	drop_attrs(newparent);
+	if (res == 0) {
+		/* the handle follows the file on the server, the inode here */
+		pthread_mutex_lock(&conn.lock);
+		target = node_find(newparent, newname);
+		if (target && target != ino) node_unlink(target);
+		node_unhash(ino);
+		free(node_get(ino)->name);
+		node_get(ino)->name = strdup(newname);
+		node_get(ino)->parent = newparent;
+		node_hash(ino);
+		drop_handles_below(ino);
+		pthread_mutex_unlock(&conn.lock);
+	}
+	unpin_node(ino);
+	fuse_reply_err(req, -res);
+}
 
-int newtp_statfs (char const * path, struct statvfs * st)
+static void newtp_statfs (fuse_req_t req, fuse_ino_t ino)
 {
-	struct reply reply;
-	struct statvfs_result r;
-	int handle = get_handle(path);
-	reply_for_command(0, CMD_STATVFS, handle, 0, &reply);
-	MAYBE_RET;
-	unpack_statvfs_result(data_in, reply.length, &r);
-	st->f_bsize = 1;
-	st->f_blocks = r.capacity;
-	st->f_bfree = st->f_bavail = r.free_space;
-	if (r.readonly) st->f_flag |= ST_RDONLY; /* although this field is ignored */
-	return 0;
+	struct newtp_req * r;
+	struct statvfs_result sr;
+	struct statvfs st;
+	int handle, res;
+
+	pin_node(ino);
+	handle = get_handle(ino);
+	if (handle < 0) {
+		unpin_node(ino);
+		fuse_reply_err(req, -handle);
+		return;
+	}
+	r = newtp_req_new(conn.nc, CMD_STATVFS, handle);
+	res = newtp_result_to_errno(newtp_run(r));
+	unpin_node(ino);
+	if (res == 0 && unpack_statvfs_result(r->data, r->reply.length, &sr) < 0) res = -EIO;
+	newtp_req_free(r);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	memset(&st, 0, sizeof(struct statvfs));
+	st.f_bsize = 1;
+	st.f_blocks = sr.capacity;
+	st.f_bfree = st.f_bavail = sr.free_space;
+	st.f_namemax = NAME_MAX;
+	if (sr.readonly) st.f_flag |= ST_RDONLY; /* although this field is ignored */
+	fuse_reply_statfs(req, &st);
 }
 
 
-static struct fuse_operations newtp_oper = {
+static struct fuse_lowlevel_ops newtp_ll_oper = {
+	.init       = newtp_init,
+	.destroy    = newtp_destroy,
+	.lookup     = newtp_lookup,
+	.forget     = newtp_forget,
 	.getattr    = newtp_getattr,
+	.setattr    = newtp_setattr,
 	.opendir    = newtp_opendir,
 	.readdir    = newtp_readdir,
 	.releasedir = newtp_releasedir,
@@ -529,24 +1279,20 @@ static struct fuse_operations newtp_oper = {
 	.open       = newtp_open,
 	.read       = newtp_read,
 	.write      = newtp_write,
+	.flush      = newtp_flush,
 	.release    = newtp_release,
-	.truncate   = newtp_truncate,
+	.fsync      = newtp_fsync,
 	.unlink     = newtp_unlink,
 	.rmdir      = newtp_unlink,
 	.mkdir      = newtp_mkdir,
 	.rename     = newtp_rename,
-	.utimens    = newtp_utimens,
-	.chmod      = newtp_chmod,
-	.chown      = newtp_chown,
 	.statfs     = newtp_statfs,
 
 /* remaining operations:
-	.access     = newtp_access, // would be implemented in getattr anyway
+	.access     = newtp_access, // permissions are checked with getattr
 	.readlink   = newtp_readlink,
 	.symlink    = newtp_symlink,
 	.link       = newtp_link,
-	.flush      = newtp_flush,  // no-op
-	.fsync      = newtp_fsync,  // no-op
 */
 
 };
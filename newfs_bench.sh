@@ -0,0 +1,79 @@
+#!/bin/sh
+# Parallel find/cat workloads on a newfs mount, multithreaded against
+# the single-threaded (-s) baseline.
+#
+# usage: ./newfs_bench.sh <hostname> <dir> [jobs]
+#   dir   - directory on the mount to work in, e.g. /share/data.
+#           regular files in it are read by cat, subdirectories walked by find
+#   jobs  - number of parallel processes (default 8)
+#
+# The server must be running on <hostname>. Needs fusermount.
+
+HOST=$1
+DIR=$2
+JOBS=${3:-8}
+
+if [ -z "$HOST" ] || [ -z "$DIR" ]; then
+	echo "usage: $0 <hostname> <dir> [jobs]" >&2
+	exit 1
+fi
+
+NEWFS=$(dirname "$0")/newfs
+MNT=$(mktemp -d)
+trap 'fusermount -u "$MNT" 2>/dev/null; rmdir "$MNT"' EXIT
+
+now () {
+	date +%s.%N
+}
+
+elapsed () {
+	awk -v a="$1" -v b="$2" 'BEGIN { printf "%8.3f s", b - a }'
+}
+
+# runs "$@" in $JOBS parallel copies and prints the wall time
+parallel () {
+	start=$(now)
+	i=0
+	while [ $i -lt $JOBS ]; do
+		"$@" > /dev/null 2>&1 &
+		i=$((i + 1))
+	done
+	wait
+	elapsed "$start" "$(now)"
+}
+
+cat_all () {
+	for f in "$MNT$DIR"/*; do
+		[ -f "$f" ] && cat "$f"
+	done
+}
+
+find_all () {
+	find "$MNT$DIR" -type f
+}
+
+# time of one ls while a big cat is running
+ls_under_load () {
+	big=$(ls -S "$MNT$DIR" | head -n 1)
+	cat "$MNT$DIR/$big" > /dev/null &
+	pid=$!
+	sleep 0.2
+	start=$(now)
+	ls -l "$MNT$DIR" > /dev/null
+	elapsed "$start" "$(now)"
+	wait $pid
+}
+
+run () {
+	mode=$1; shift
+	# direct_io keeps the page cache from answering repeated reads
+	"$NEWFS" "$HOST" "$MNT" -o direct_io "$@" || exit 1
+	sleep 0.5
+	printf "%-16s cat x%d: %s   find x%d: %s   ls under cat: %s\n" "$mode" \
+		"$JOBS" "$(parallel cat_all)" "$JOBS" "$(parallel find_all)" "$(ls_under_load)"
+	fusermount -u "$MNT"
+	sleep 0.5
+}
+
+run "single-threaded" -s
+run "multithreaded"
@@ -11,8 +11,13 @@
 #include <sys/statvfs.h>
 #include <unistd.h>
 
+#include <gnutls/crypto.h>
+#include <gnutls/gnutls.h>
+
+#include "arena.h"
 #include "commands.h"
 #include "common.h"
+#include "flush.h"
 #include "log.h"
 #include "operations.h"
 #include "paths.h"
@@ -21,6 +26,8 @@
 
 #define LONGEST_PATH 16384
 
+struct arena cmd_arena = ARENA_INIT;
+
 #define REPLY(s, len) pack_reply_p(response, cmd->request_id, 0, (s), (len)) + (len)
 
 #define VALIDATE_HANDLE(h) \
@@ -94,23 +101,18 @@ int calculate_attr_len (char const * attr_spec, int len)
 	return sum;
 }
 
-int fill_stat (char const * path, int writable, char * attributes, char const * attr_spec, int spec_len)
+int encode_attrs (struct stat const * st, char const * path, int writable, char * attributes,
+	char const * attr_spec, int spec_len)
 {
 	/* we assume that attributes have the proper size */
-	struct stat st;
-	int ret;
 	unsigned int value;
 	uint64_t bigvalue;
 
-	ret = stat(path, &st); /* XXX maybe stat optionally */
-
-	if (ret == -1) return -1;
-	
 	for (int i = 0; i < spec_len; i++) {
 		switch (*attr_spec++) {
 			case ATTR_TYPE:
-				if (S_ISREG(st.st_mode)) value = TYPE_FILE;
-				else if (S_ISDIR(st.st_mode)) value = TYPE_DIR;
+				if (S_ISREG(st->st_mode)) value = TYPE_FILE;
+				else if (S_ISDIR(st->st_mode)) value = TYPE_DIR;
 				else value = TYPE_OTHER;
 				attributes += pack(attributes, "c", (uint8_t)value);
 				break;
@@ -118,58 +120,58 @@ int fill_stat (char const * path, int writable, char * attributes, char const *
 			case ATTR_RIGHTS:
 				value = 0;
 				/* XXX more detailed check for access() failure? */
-				if (!access(path, R_OK | (S_ISDIR(st.st_mode) ? X_OK : 0))) value |= RIGHTS_READ;
+				if (!access(path, R_OK | (S_ISDIR(st->st_mode) ? X_OK : 0))) value |= RIGHTS_READ;
 				if (writable && !access(path, W_OK)) value |= RIGHTS_WRITE;
 				attributes += pack(attributes, "c", (uint8_t)value);
 				break;
 
 			case ATTR_SIZE:
-				bigvalue = st.st_size;
+				bigvalue = st->st_size;
 				attributes += pack(attributes, "l", bigvalue);
 				break;
 
 			case ATTR_DEV_ID:
-				value = st.st_dev;
+				value = st->st_dev;
 				attributes += pack(attributes, "i", (uint32_t)value);
 				break;
 
 			case ATTR_LINKS:
-				value = st.st_nlink;
+				value = st->st_nlink;
 				attributes += pack(attributes, "i", (uint32_t)value);
 				break;
 
 			case ATTR_ATIME:
-				bigvalue = newtp_timespec_to_time(st.st_atim);
+				bigvalue = newtp_timespec_to_time(st->st_atim);
 				attributes += pack(attributes, "l", bigvalue);
 				break;
 
 			case ATTR_MTIME:
-				bigvalue = newtp_timespec_to_time(st.st_mtim);
+				bigvalue = newtp_timespec_to_time(st->st_mtim);
 				attributes += pack(attributes, "l", bigvalue);
 				break;
 
 			case ATTR_CTIME:
-				bigvalue = newtp_timespec_to_time(st.st_ctim);
+				bigvalue = newtp_timespec_to_time(st->st_ctim);
 				attributes += pack(attributes, "l", bigvalue);
 				break;
 
 			case ATTR_PTYPE:
-				value = (st.st_mode & S_IFMT) >> 12;
+				value = (st->st_mode & S_IFMT) >> 12;
 				attributes += pack(attributes, "c", (uint8_t)value);
 				break;
 
 			case ATTR_PERMS:
-				value = st.st_mode & (uint32_t)0x00000fff;
+				value = st->st_mode & (uint32_t)0x00000fff;
 				attributes += pack(attributes, "s", (uint16_t)value);
 				break;
 
 			case ATTR_UID:
-				value = st.st_uid;
+				value = st->st_uid;
 				attributes += pack(attributes, "i", (uint32_t)value);
 				break;
 
 			case ATTR_GID:
-				value = st.st_gid;
+				value = st->st_gid;
 				attributes += pack(attributes, "i", (uint32_t)value);
 				break;
 
@@ -179,14 +181,22 @@ int fill_stat (char const * path, int writable, char * attributes, char const *
 				return -1;
 		}
 	}
-	return ret;
+	return 0;
+}
+
+int fill_stat (char const * path, int writable, char * attributes, char const * attr_spec, int spec_len)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1) return -1; /* XXX maybe stat optionally */
+	return encode_attrs(&st, path, writable, attributes, attr_spec, spec_len);
 }
 
 /**** actual command implementations ****/
 
 int cmd_ASSIGN (struct command * cmd, char * payload, char * response)
 {
-	logp("CMD_ASSIGN -> %d", cmd->handle);
+	dbgp("CMD_ASSIGN -> %d", cmd->handle);
 	int res = handle_assign(cmd->handle, payload, cmd->length);
 	return REPLY(res, 0);
 }
@@ -200,12 +210,12 @@ int list_shares (struct command * cmd, char * response, char const * attr_spec,
 	int result = STAT_FINISHED;
 	struct dir_entry entry;
 	struct share * share = NULL;
-	log("listing root");
+	dbg("listing root");
 
 	/* `buf` is starting at position after the reply packet,
 	 * `filled` is size of payload in use, starts at length of entries counter */
 
-	attrs = xmalloc(attr_len);
+	attrs = arena_alloc(&cmd_arena, attr_len);
 	entry.attr = attrs;
 	entry.attr_len = attr_len;
 
@@ -239,8 +249,6 @@ int list_shares (struct command * cmd, char * response, char const * attr_spec,
 		++entries;
 	}
 
-	free(attrs);
-
 	/* write number of entries at start of buf */
 	pack(buf, "s", (uint16_t)entries);
 	return REPLY(result, filled);
@@ -250,7 +258,7 @@ int cmd_REWINDDIR (struct command * cmd, char * payload, char * response)
 {
 	struct handle * h;
 	VALIDATE_HANDLE(h);
-	logp("CMD_REWINDDIR %d (%s)", cmd->handle, h->path);
+	dbgp("CMD_REWINDDIR %d (%s)", cmd->handle, h->path);
 	
 	if (!h->path[0]) return REPLY(STAT_OK, 0);
 
@@ -294,7 +302,7 @@ int cmd_READDIR (struct command * cmd, char * payload, char * response)
 	struct handle * h;
 
 	VALIDATE_HANDLE(h);
-	logp("CMD_READDIR %d (%s)", cmd->handle, h->path);
+	dbgp("CMD_READDIR %d (%s)", cmd->handle, h->path);
 
 	attr_len = calculate_attr_len(payload, cmd->length);
 	if (attr_len < 0) {
@@ -310,11 +318,11 @@ int cmd_READDIR (struct command * cmd, char * payload, char * response)
 	}
 
 	/* allocate sufficient attr length */
-	attrs = xmalloc(attr_len);
+	attrs = arena_alloc(&cmd_arena, attr_len);
 	entry.attr = attrs;
 	entry.attr_len = attr_len;
 	/* prepare path buffer */
-	pathbuf = xmalloc(LONGEST_PATH);
+	pathbuf = arena_alloc(&cmd_arena, LONGEST_PATH);
 	strncpyz(pathbuf, h->path, h->plen);
 	pathbuf[h->plen] = '/';
 	nameptr = pathbuf + h->plen + 1;
@@ -381,9 +389,6 @@ int cmd_READDIR (struct command * cmd, char * payload, char * response)
 		errno = 0;
 	}
 
-	free(pathbuf);
-	free(attrs);
-
 	if (!dirent) {
 		/* close directory */
 		closedir(h->dir);
@@ -399,7 +404,7 @@ int cmd_READDIR (struct command * cmd, char * payload, char * response)
 		}
 	}
 
-	logp("sent %d items, %d bytes", entries, filled);
+	dbgp("sent %d items, %d bytes", entries, filled);
 	pack(buf, "s", (uint16_t)entries);
 	return REPLY(result, filled);
 }
@@ -410,7 +415,7 @@ int cmd_STAT (struct command * cmd, char * payload, char * response)
 	int attr_len;
 
 	VALIDATE_HANDLE(h);
-	logp("CMD_STAT %d (%s)",  cmd->handle, h->path);
+	dbgp("CMD_STAT %d (%s)",  cmd->handle, h->path);
 
 	attr_len = calculate_attr_len(payload, cmd->length);
 	if (attr_len < 0) {
@@ -445,7 +450,7 @@ int cmd_SETATTR (struct command * cmd, char * payload, char * response)
 	VALIDATE_HANDLE(h);
 
 	DIE_OR(unpack(payload, cmd->length, "c", &attr));
-	logp("CMD_SETATTR %d (%s): attr 0x%02x",  cmd->handle, h->path, attr);
+	dbgp("CMD_SETATTR %d (%s): attr 0x%02x",  cmd->handle, h->path, attr);
 
 	switch(attr) {
 		case ATTR_ATIME:
@@ -501,7 +506,7 @@ int cmd_READ (struct command * cmd, char * payload, char * response)
 	DIE_OR(unpack_params_offlen(payload, cmd->length, &params));
 
 	VALIDATE_HANDLE(h);
-	logp("CMD_READ %d (%s): ofs %llu, len %d", cmd->handle, h->path, (long long unsigned)params.offset, params.length);
+	dbgp("CMD_READ %d (%s): ofs %llu, len %d", cmd->handle, h->path, (long long unsigned)params.offset, params.length);
 
 	if (h->fd > 0 && h->open_w) {
 		close(h->fd);
@@ -521,18 +526,15 @@ int cmd_READ (struct command * cmd, char * payload, char * response)
 		h->open_w = 0;
 	}
 	/* TODO check whether the open handle belongs to the correct path */
-	RETRY1(err, lseek(h->fd, params.offset, SEEK_SET));
-	if (err == -1) {
-		/* something bad went wronger */
-		return REPLY(ERR_BADOFFSET, 0);
-	}
 
-	/* manual retry-loop */
+	/* manual retry-loop. positional reads leave the file offset alone */
 	while (done < params.length) {
-		err = read(h->fd, buf + done, params.length - done);
+		err = pread(h->fd, buf + done, params.length - done, params.offset + done);
 		if (err == -1) {
 			if (errno == EINTR) continue;
-			else if (errno == EISDIR || errno == EFAULT) {
+			else if (errno == EINVAL) {
+				return REPLY(ERR_BADOFFSET, done);
+			} else if (errno == EISDIR || errno == EFAULT) {
 				return REPLY(ERR_NOTFILE, done);
 			} else if (errno == EIO) {
 				return REPLY(ERR_IO, done);
@@ -556,7 +558,7 @@ int cmd_WRITE (struct command * cmd, char * payload, char * response)
 	struct handle * h;
 	int err;
 	int write_length;
-	uint16_t total;
+	uint16_t total = 0;
 	uint64_t offset;
 
 	/* be a good guy and pick parameters first */
@@ -568,7 +570,7 @@ int cmd_WRITE (struct command * cmd, char * payload, char * response)
 
 	/* TODO make sure that handles to "files" in "root" return STAT_DENIED instead of NOTFOUND */
 	VALIDATE_HANDLE(h);
-	logp("CMD_WRITE %d (%s): ofs %llu, len %d", cmd->handle, h->path, (long long unsigned)offset, write_length);
+	dbgp("CMD_WRITE %d (%s): ofs %llu, len %d", cmd->handle, h->path, (long long unsigned)offset, write_length);
 
 	if (!h->writable) return REPLY(ERR_DENIED, sizeof(uint16_t));
 
@@ -590,26 +592,22 @@ int cmd_WRITE (struct command * cmd, char * payload, char * response)
 		h->open_w = 1;
 	}
 
-	/* we created the file if we could, now we can return in case of zero write */
+	/* we created the file if we could, now we can return in case of zero write,
+	 * which is a request for full sync */
 	if (write_length == 0) {
-		if (fsync(h->fd) == -1) {
-			return REPLY(ERR_IO, sizeof(uint16_t)); /* TODO only IO? */
-		} else {
-			return REPLY(STAT_OK, sizeof(uint16_t));
-		}
+		err = flush_queue(h, cmd->request_id, DURABLE_FULL, 1, 0);
+		if (err != STAT_OK) return REPLY(err, sizeof(uint16_t));
+		return REPLY_DEFERRED;
 	}
 
 	/* TODO check whether the open handle belongs to the correct path */
-	RETRY1(err, lseek(h->fd, offset, SEEK_SET));
-	if (err == -1) {
-		/* something bad went wronger */
-		return REPLY(ERR_FAIL, sizeof(uint16_t));
-	}
 
-	/* manual retry-loop */
+	/* manual retry-loop. sessions writing other ranges of the file at
+	 * the same time each have their own fd, and positional writes don't
+	 * depend on a shared offset */
 	payload += sizeof(uint64_t);
 	while (write_length > 0) {
-		err = write(h->fd, payload, write_length);
+		err = pwrite(h->fd, payload, write_length, offset + total);
 		if (err == -1) {
 			if (errno == EINTR) continue;
 			if (errno == EIO) err = ERR_IO;
@@ -625,9 +623,117 @@ int cmd_WRITE (struct command * cmd, char * payload, char * response)
 	}
 	/* we have received and written all the requested data */
 	pack(response + SIZEOF_reply(), "s", total);
+	if (h->durability != DURABLE_NONE) {
+		/* reply when it's durable */
+		err = flush_queue(h, cmd->request_id, h->durability, 1, total);
+		if (err != STAT_OK) return REPLY(err, sizeof(uint16_t));
+		return REPLY_DEFERRED;
+	}
 	return REPLY(STAT_OK, sizeof(uint16_t));
 }
 
+int cmd_FLUSH (struct command * cmd, char * payload, char * response)
+{
+	struct handle * h;
+	uint8_t mode;
+	int err;
+
+	DIE_OR(unpack(payload, cmd->length, "c", &mode));
+	VALIDATE_HANDLE(h);
+	dbgp("CMD_FLUSH %d (%s): mode %d", cmd->handle, h->path, mode);
+
+	if (mode > DURABLE_FULL) return REPLY(ERR_BADVALUE, 0);
+	if (mode == DURABLE_NONE) return REPLY(STAT_OK, 0);
+	if (!h->path[0]) return REPLY(ERR_NOTFILE, 0);
+
+	if (h->fd == -1) {
+		/* fsync works on any fd referring to the file, so reading is enough */
+		RETRY1(h->fd, open(h->path, O_RDONLY));
+		if (h->fd == -1) {
+			if (errno == EACCES) err = ERR_DENIED;
+			else if (errno == ENOENT) err = ERR_NOTFOUND;
+			else if (errno == ENOTDIR) err = ERR_NOTFOUND;
+			else err = ERR_FAIL;
+			return REPLY(err, 0);
+		}
+		h->open_w = 0;
+	}
+
+	err = flush_queue(h, cmd->request_id, mode, 0, 0);
+	if (err != STAT_OK) return REPLY(err, 0);
+	return REPLY_DEFERRED;
+}
+
+int cmd_DURABILITY (struct command * cmd, char * payload, char * response)
+{
+	struct handle * h;
+	uint8_t mode;
+
+	DIE_OR(unpack(payload, cmd->length, "c", &mode));
+	VALIDATE_HANDLE(h);
+	dbgp("CMD_DURABILITY %d (%s): mode %d", cmd->handle, h->path, mode);
+
+	if (mode > DURABLE_FULL) return REPLY(ERR_BADVALUE, 0);
+	h->durability = mode;
+	return REPLY(STAT_OK, 0);
+}
+
+/* bytes read at once by HASH */
+#define HASH_BUFFER (64 * 1024)
+
+int cmd_HASH (struct command * cmd, char * payload, char * response)
+{
+	struct handle * h;
+	gnutls_hash_hd_t hd;
+	uint64_t offset, length, done = 0;
+	char * buf;
+	int fd, n, err = STAT_OK;
+
+	DIE_OR(unpack(payload, cmd->length, "ll", &offset, &length));
+	VALIDATE_HANDLE(h);
+	dbgp("CMD_HASH %d (%s): ofs %llu, len %llu", cmd->handle, h->path,
+		(long long unsigned)offset, (long long unsigned)length);
+
+	if (length > HASH_MAX_LENGTH) return REPLY(ERR_BADVALUE, 0);
+
+	/* an fd of its own: the handle's may be open for writing only */
+	RETRY1(fd, open(h->path, O_RDONLY));
+	if (fd == -1) {
+		if (errno == EACCES) err = ERR_DENIED;
+		else if (errno == ENOENT) err = ERR_NOTFOUND;
+		else if (errno == ENOTDIR) err = ERR_NOTFOUND;
+		else if (errno == EISDIR) err = ERR_NOTFILE;
+		else err = ERR_FAIL;
+		return REPLY(err, 0);
+	}
+	if (gnutls_hash_init(&hd, GNUTLS_DIG_SHA256) < 0) {
+		close(fd);
+		return REPLY(ERR_SERVFAIL, 0);
+	}
+
+	buf = arena_alloc(&cmd_arena, HASH_BUFFER);
+	while (done < length) {
+		n = pread(fd, buf, (length - done > HASH_BUFFER) ? HASH_BUFFER : length - done, offset + done);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			else if (errno == EINVAL) err = ERR_BADOFFSET;
+			else if (errno == EISDIR) err = ERR_NOTFILE;
+			else if (errno == EIO) err = ERR_IO;
+			else err = ERR_FAIL;
+			break;
+		}
+		if (n == 0) break; /* end of file */
+		gnutls_hash(hd, buf, n);
+		done += n;
+	}
+	close(fd);
+
+	pack(response + SIZEOF_reply(), "l", done);
+	gnutls_hash_deinit(hd, response + SIZEOF_reply() + sizeof(uint64_t));
+	if (err != STAT_OK) return REPLY(err, 0);
+	return REPLY(STAT_OK, sizeof(uint64_t) + HASH_SIZE);
+}
+
 int cmd_TRUNCATE (struct command * cmd, char * payload, char * response)
 {
 	struct handle * h;
@@ -636,7 +742,7 @@ int cmd_TRUNCATE (struct command * cmd, char * payload, char * response)
 
 	DIE_OR(unpack(payload, cmd->length, "l", &offset));
 	VALIDATE_HANDLE(h);
-	logp("CMD_TRUNCATE %d (%s): ofs %llu", cmd->handle, h->path, (long long unsigned)offset);
+	dbgp("CMD_TRUNCATE %d (%s): ofs %llu", cmd->handle, h->path, (long long unsigned)offset);
 	if (!h->writable) return REPLY(ERR_DENIED, sizeof(uint16_t));
 
 	RETRY0(res, truncate(h->path, offset));
@@ -662,7 +768,7 @@ int cmd_DELETE (struct command * cmd, char * payload, char * response)
 	struct handle * h;
 	int res, err = STAT_OK;
 	VALIDATE_HANDLE(h);
-	logp("CMD_DELETE %d (%s)", cmd->handle, h->path);
+	dbgp("CMD_DELETE %d (%s)", cmd->handle, h->path);
 	if (!h->writable) return REPLY(ERR_DENIED, 0);
 	res = remove(h->path);
 	if (res == -1) {
@@ -689,16 +795,14 @@ int cmd_RENAME (struct command * cmd, char * payload, char * response)
 	struct handle * h, * nh;
 	int res, err = STAT_OK;
 	VALIDATE_HANDLE(h);
-	logp("CMD_RENAME %d (%s)", cmd->handle, h->path);
+	dbgp("CMD_RENAME %d (%s)", cmd->handle, h->path);
 	if (!h->writable) return REPLY(ERR_DENIED, 0);
 
 	nh = handle_make(payload, cmd->length);
-	if (!nh) return ERR_BADPATH;
+	if (!nh) return REPLY(ERR_BADPATH, 0);
 	else if (!nh->path) {
-		/* TODO too intimate knowledge of handle internals */
-		free(nh->name);
-		free(nh);
-		return ERR_NOTFOUND;
+		handle_free(nh);
+		return REPLY(ERR_NOTFOUND, 0);
 		/* TODO ERR_DENIED for moving to root */
 	}
 
@@ -718,6 +822,7 @@ int cmd_RENAME (struct command * cmd, char * payload, char * response)
 		else if (errno == EROFS) err = ERR_DENIED;
 		else if (errno == EXDEV) err = ERR_CROSSDEV;
 		else err = ERR_FAIL;
+		handle_free(nh);
 	} else {
 		handle_assign_ptr(cmd->handle, nh);
 	}
@@ -729,7 +834,7 @@ int cmd_MAKEDIR (struct command * cmd, char * payload, char * response)
 	struct handle * h;
 	int res, err = STAT_OK;
 	VALIDATE_HANDLE(h);
-	logp("CMD_MAKEDIR %d (%s)", cmd->handle, h->path);
+	dbgp("CMD_MAKEDIR %d (%s)", cmd->handle, h->path);
 	if (!h->writable) return REPLY(ERR_DENIED, 0);
 	res = mkdir(h->path, 0777);
 	if (res == -1) {
@@ -756,7 +861,7 @@ int cmd_STATVFS (struct command * cmd, char * payload, char * response)
 	struct statvfs_result r;
 	int res, err = STAT_OK;
 	VALIDATE_HANDLE(h);
-	logp("CMD_STATVFS %d (%s)", cmd->handle, h->path);
+	dbgp("CMD_STATVFS %d (%s)", cmd->handle, h->path);
 
 	path = h->path;
 	/* special-case the root directory by statvfs'ing first share.
@@ -764,7 +869,7 @@ int cmd_STATVFS (struct command * cmd, char * payload, char * response)
 	 * only calls statvfs on the root. */
 	if (!*path) {
 		sh = share_next(NULL);
-		assert(sh);
+		if (!sh) return REPLY(ERR_NOTFOUND, 0);
 		path = sh->path;
 	}
 
@@ -789,3 +894,40 @@ int cmd_STATVFS (struct command * cmd, char * payload, char * response)
 	pack_statvfs_result(response + SIZEOF_reply(), &r);
 	return REPLY(STAT_OK, SIZEOF_statvfs_result(r));
 }
+
+/**** dispatch ****/
+
+#define HANDLE_CMD(x) \
+	case CMD_##x:\
+		len = cmd_##x(cmd, payload, response); \
+		break;
+
+int handle_command (struct command * cmd, char * payload, char * response)
+{
+	int len = 0;
+
+	switch (cmd->command) {
+		HANDLE_CMD(ASSIGN)
+		HANDLE_CMD(STAT)
+		HANDLE_CMD(SETATTR)
+		HANDLE_CMD(STATVFS)
+		HANDLE_CMD(READ)
+		HANDLE_CMD(WRITE)
+		HANDLE_CMD(TRUNCATE)
+		HANDLE_CMD(FLUSH)
+		HANDLE_CMD(DURABILITY)
+		HANDLE_CMD(HASH)
+		HANDLE_CMD(DELETE)
+		HANDLE_CMD(RENAME)
+		HANDLE_CMD(MAKEDIR)
+		HANDLE_CMD(REWINDDIR)
+		HANDLE_CMD(READDIR)
+		default:
+			logp("unknown command: %x", cmd->command);
+			return REPLY(ERR_BADCOMMAND, 0);
+	}
+
+	if (len == 0) len = REPLY(ERR_FAIL, 0);
+	else if (len < 0 && len != REPLY_DEFERRED) len = REPLY(ERR_SERVFAIL, 0);
+	return len;
+}
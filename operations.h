@@ -1,6 +1,9 @@
 #ifndef SERVER__H__
 #define SERVER__H__
 
+#include <sys/stat.h>
+
+#include "arena.h"
 #include "structs.h"
 
 #define DECLARE_CMD(x) \
@@ -13,6 +16,9 @@ DECLARE_CMD(STATVFS)
 DECLARE_CMD(READ)
 DECLARE_CMD(WRITE)
 DECLARE_CMD(TRUNCATE)
+DECLARE_CMD(FLUSH)
+DECLARE_CMD(DURABILITY)
+DECLARE_CMD(HASH)
 DECLARE_CMD(DELETE)
 DECLARE_CMD(RENAME)
 DECLARE_CMD(MAKEDIR)
@@ -21,4 +27,27 @@ DECLARE_CMD(READDIR)
 
 #define MAX_OPENDIRS 5
 
+/* attributes of STAT and READDIR */
+
+/* length of the attributes attr_spec asks for, -1 if it is invalid */
+int calculate_attr_len (char const * attr_spec, int len);
+/* encodes the attributes of path, which st describes, into attributes,
+ * which must have room for them. returns 0 or -1 */
+int encode_attrs (struct stat const * st, char const * path, int writable, char * attributes,
+	char const * attr_spec, int spec_len);
+/* stat() and encode_attrs(). returns -1 with errno set on failure */
+int fill_stat (char const * path, int writable, char * attributes, char const * attr_spec, int spec_len);
+
+/* scratch memory for the command being handled.
+ * reset after the reply is sent, don't keep pointers into it */
+extern struct arena cmd_arena;
+
+/* returned by cmd_* functions when the reply was queued
+ * to be sent later (see flush.h) */
+#define REPLY_DEFERRED -1
+
+/* runs the cmd_* function of cmd->command. returns the length of the
+ * reply in response, which is never empty, or REPLY_DEFERRED */
+int handle_command (struct command * cmd, char * payload, char * response);
+
 #endif
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -13,92 +14,121 @@
 #define MAXHANDLES 16384
 struct handle * handles[MAXHANDLES];
 
-int handle_init ()
+/* string pool. strings are rounded up to a power of two between
+ * STR_MIN and STR_MAX, carved out of STR_CHUNK-sized chunks and recycled
+ * through per-size free lists. longer strings go to the heap. */
+#define STR_MIN 32
+#define STR_CLASSES 8 /* 32 .. 4096 */
+#define STR_CHUNK (64 * 1024)
+
+static char * str_free_list[STR_CLASSES];
+static char * str_chunk = NULL;
+static int str_chunk_left = 0;
+
+static int str_class (int size)
 {
-	for (int i = 0; i < MAXHANDLES; i++) handles[i] = NULL;
-	return MAXHANDLES;
+	int c = 0;
+	while ((STR_MIN << c) < size) c++;
+	return c;
 }
 
-/* share operations */
-#define SHARE_HT_MOD 41
-#define SHARE_HT_SLOT 5
-#define SHARE_HT_LEN (SHARE_HT_MOD * SHARE_HT_SLOT)
-struct share * share_ht = NULL;
-
-int share_hash (char const * name, int nlen)
+static char * str_alloc (int size)
 {
-	int hash = 0;
-	for (int i = 0; i < nlen; hash += name[i++]);
-	return hash % SHARE_HT_MOD;
+	int c = str_class(size);
+	char * s;
+
+	if (c >= STR_CLASSES) return xmalloc(size);
+	if ((s = str_free_list[c])) {
+		str_free_list[c] = *(char **)s;
+		return s;
+	}
+	if (str_chunk_left < (STR_MIN << c)) {
+		/* the rest of the old chunk is lost, it's smaller than one string */
+		str_chunk = xmalloc(STR_CHUNK);
+		str_chunk_left = STR_CHUNK;
+	}
+	s = str_chunk;
+	str_chunk += STR_MIN << c;
+	str_chunk_left -= STR_MIN << c;
+	return s;
 }
 
-int share_add (char const * name, char const * path, int writable)
+static void str_free (char * s, int size)
 {
-	int nlen = strlen(name);
-	int plen = strlen(path);
-	int hash = share_hash(name, nlen);
-	struct share * shptr;
+	int c = str_class(size);
+	if (c >= STR_CLASSES) {
+		free(s);
+		return;
+	}
+	*(char **)s = str_free_list[c];
+	str_free_list[c] = s;
+}
 
-	if (!share_ht) share_ht = xmalloc(SHARE_HT_LEN * sizeof(struct share)); /* initialize */
-	/* find first available position in hashtable */
-	shptr = share_ht + hash * SHARE_HT_SLOT;
-	while (shptr->used) {
-		if (shptr->nlen == nlen && !strncmp(shptr->name, name, nlen)) return 0; /* duplicate entry */
-		shptr++;
-		if (shptr == share_ht + hash * SHARE_HT_SLOT) return 0; /* table is COMPLETELY FULL! */
-		if (shptr - share_ht >= SHARE_HT_LEN) shptr = share_ht; /* wrap around */
+/* strings of a handle are stored inline if they fit, in the pool otherwise */
+static char * hstr_get (struct handle * h, int size)
+{
+	char * s;
+	if (h->inline_used + size <= HANDLE_INLINE) {
+		s = h->inline_buf + h->inline_used;
+		h->inline_used += size;
+		return s;
 	}
-	shptr->used = 1;
-	shptr->name = xmalloc(nlen + 1);
-	strncpyz(shptr->name, name, nlen);
-	shptr->nlen = nlen;
-	shptr->path = xmalloc(plen + 1);
-	shptr->plen = plen;
-	strncpyz(shptr->path, path, plen);
-	shptr->writable = writable;
-	return 1;
+	return str_alloc(size);
 }
 
-struct share * share_find (char const * name, int nlen)
+static void hstr_put (struct handle * h, char * s, int size)
 {
-	if (!share_ht) return NULL; /* no shares :( */
-	int hash = share_hash(name, nlen);
-	struct share * shptr = share_ht + hash * SHARE_HT_SLOT;
-	while (shptr->used) {
-		if (shptr->nlen == nlen && !strncmp(shptr->name, name, nlen)) return shptr; /* FOUND! */
-		shptr++;
-		if (shptr == share_ht + hash * SHARE_HT_SLOT) return NULL; /* got back to start and found nothing */
-		if (shptr - share_ht >= SHARE_HT_LEN) shptr = share_ht; /* wrap around */
+	if (s >= h->inline_buf && s < h->inline_buf + HANDLE_INLINE) {
+		/* inline space is only reclaimed from the end */
+		if (s + size == h->inline_buf + h->inline_used) h->inline_used -= size;
+		return;
 	}
-	return NULL;
+	str_free(s, size);
 }
 
-struct share * share_next (struct share * seed)
+static void handle_drop_path (struct handle * h)
 {
-	/* nothing */
-	if (!share_ht) return NULL;
-	/* seed out of range */
-	if (seed && (seed < share_ht || seed - share_ht >= SHARE_HT_LEN)) return NULL;
+	if (!h->path) return;
+	hstr_put(h, h->path, h->plen + 1);
+	h->path = NULL;
+}
 
-	if (seed) seed++;
-	else seed = share_ht;
+/* handle pool */
+static struct handle * handle_free_list = NULL;
 
-	while (seed - share_ht < SHARE_HT_LEN) {
-		if (seed->used) return seed;
-		seed++;
+static struct handle * handle_alloc ()
+{
+	struct handle * h;
+	if (!handle_free_list) {
+		struct handle * slab = xmalloc(HANDLE_SLAB * sizeof(struct handle));
+		for (int i = HANDLE_SLAB - 1; i >= 0; i--) {
+			slab[i].next_free = handle_free_list;
+			handle_free_list = slab + i;
+		}
 	}
-	return NULL;
+	h = handle_free_list;
+	handle_free_list = h->next_free;
+	/* the inline strings don't need clearing */
+	memset(h, 0, offsetof(struct handle, inline_buf));
+	return h;
+}
+
+int handle_init ()
+{
+	for (int i = 0; i < MAXHANDLES; i++) handles[i] = NULL;
+	return MAXHANDLES;
 }
 
-void delhandle (struct handle * handle)
+void handle_free (struct handle * h)
 {
 	int c;
-	if (handle->path && *handle->path)
-		free(handle->path); /* might be constant "" */
-	free(handle->name);
-	if (handle->dir) closedir(handle->dir);
-	if (handle->fd) RETRY1(c, close(handle->fd));
-	free(handle);
+	if (h->dir) closedir(h->dir);
+	if (h->fd != -1) RETRY1(c, close(h->fd));
+	/* path was allocated after name */
+	handle_drop_path(h);
+	hstr_put(h, h->name, h->sharelen + h->pathlen + 1);
+	h->next_free = handle_free_list;
+	handle_free_list = h;
 }
 
 int check_path (char const * buf, int len)
@@ -145,10 +175,10 @@ int handle_assign (uint16_t handle, char const * buf, int len)
 int handle_assign_ptr (uint16_t handle, struct handle * h)
 {
 	if (handle >= MAXHANDLES) return ERR_BADHANDLE;
-	if (handles[handle]) delhandle(handles[handle]);
+	if (handles[handle]) handle_free(handles[handle]);
 	handles[handle] = h;
 
-	logp("handle %d is now \"%s\"", handle, h->name);
+	dbgp("handle %d is now \"%s\"", handle, h->name);
 	return STAT_OK;
 }
 
@@ -165,10 +195,11 @@ struct handle * handle_make (char const * buf, int len)
 
 	while (buf[shlen] != '/' && shlen < len) shlen++;
 
-	struct handle * h = xmalloc(sizeof(struct handle));
+	struct handle * h = handle_alloc();
 
-	h->name = xmalloc(len + 1);
-	strncpyz(h->name, buf, len);
+	h->name = hstr_get(h, len + 1);
+	memcpy(h->name, buf, len);
+	h->name[len] = 0;
 	h->sharelen = shlen;
 	h->pathlen = len - shlen;
 
@@ -180,55 +211,71 @@ struct handle * handle_make (char const * buf, int len)
 
 struct handle * handle_get (uint16_t handle)
 {
+	struct handle * h;
 	if (handle >= MAXHANDLES) return NULL;
-/*	struct handle * h = handles[handle];
-	if (h == NULL) return NULL;*/
-	return handles[handle];
+	h = handles[handle];
+	/* shares were reloaded since the path was resolved */
+	if (h && h->generation != share_generation()) handle_fill_path(h);
+	return h;
+}
+
+/* path changed or went away, make sure we close filehandles */
+static void handle_close_files (struct handle * h)
+{
+	int e;
+	if (h->fd != -1) {
+		RETRY1(e, close(h->fd));
+		h->fd = -1;
+		h->open_w = 0;
+	}
+	if (h->dir) {
+		closedir(h->dir);
+		h->dir = NULL;
+		h->entry_name = NULL;
+		h->entry_len = 0;
+	}
 }
 
 void handle_fill_path (struct handle * h)
 {
-	if (h->path) return;
+	struct share * sh;
+
+	if (h->path && h->generation == share_generation()) return;
+	/* h->share may point into a freed table by now, don't look at it */
+	h->generation = share_generation();
 
 	if (!h->name[0]) { /* root - special case */
-		h->path = "";
+		if (!h->path) {
+			h->path = hstr_get(h, 1);
+			h->path[0] = 0;
+			h->plen = 0;
+		}
+		h->share = NULL;
 		h->writable = 0;
 		return;
 	}
 
-	/* XXX all the following assumes that shares can change at any time.
-	 * That might be useful in the future.
-	 * TODO remains to put in some concurrency checks */
-
-	/* do we know a share? */
-	if (!h->share || h->sharelen != h->share->nlen || strncmp(h->name, h->share->name, h->sharelen)) {
-		h->share = share_find(h->name, h->sharelen);
-		if (!h->share) { /* no share exists */
-			free(h->path);
-			h->path = NULL;
-			h->writable = 0;
-			return;
-		}
+	sh = share_find(h->name, h->sharelen);
+	h->share = sh;
+	if (!sh) { /* no share exists */
+		handle_close_files(h);
+		handle_drop_path(h);
+		h->writable = 0;
+		return;
 	}
-	/* ok, how about the path */
-	if (!h->path || strncmp(h->path, h->share->path, h->share->plen)) {
-		/* if not exists, or not valid */
-		free(h->path);
-		h->plen = h->share->plen + h->pathlen;
-		h->path = xmalloc(h->plen + 1);
-		strncpy(h->path, h->share->path, h->share->plen);
-		strncpyz(h->path + h->share->plen, h->name + h->sharelen, h->pathlen);
-		/* path changed, make sure we close filehandle */
-		int e;
-		RETRY1(e, close(h->fd));
-		h->fd = -1;
+
+	/* keep the path (and open files) if the share still points to the same place */
+	if (!h->path || h->plen != sh->plen + h->pathlen || memcmp(h->path, sh->path, sh->plen)) {
+		handle_close_files(h);
+		handle_drop_path(h);
+		h->plen = sh->plen + h->pathlen;
+		h->path = hstr_get(h, h->plen + 1);
+		memcpy(h->path, sh->path, sh->plen);
+		memcpy(h->path + sh->plen, h->name + h->sharelen, h->pathlen);
+		h->path[h->plen] = 0;
 	}
-	/* we only checked the share part the rest -should- remain untouched */
-	if (h->path[h->share->plen]) {
-		assert(h->path[h->share->plen] == '/');
-		assert(!strncmp(h->path + h->share->plen, h->name + h->sharelen, h->pathlen));
-	} /* else we are working with share's root */
-	
-	h->writable = h->share->writable;
-	return;
+
+	h->writable = sh->writable;
+	/* a share turned read-only must not keep writing through an open fd */
+	if (!h->writable && h->open_w) handle_close_files(h);
 }
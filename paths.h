@@ -2,37 +2,48 @@
 #define PATHS__H__
 
 #include <dirent.h>
+#include <stdint.h>
+#include "shares.h"
 #include "structs.h"
 
-struct share {
-	int used;
-	char * name;
-	int nlen;
-	char * path;
-	int plen;
-	int writable;
-};
+/* bytes of name and path that are stored within the handle itself.
+ * longer strings come from the session's string pool */
+#define HANDLE_INLINE 120
+
+/* handles are allocated from a pool in slabs of HANDLE_SLAB */
+#define HANDLE_SLAB 256
 
 struct handle {
+	/* fields used by every command come first, so that they share
+	 * a cache line */
+
 	/* full (not necessarily absolute) filesystem path,
 	writable state. info updated in handle_get call. */
 	char * path;
+	struct share * share;
+	int fd;
 	int plen;
-	int writable;
+	/* lengths of the share and path parts of name */
+	uint16_t sharelen, pathlen;
+	uint8_t writable;
+	uint8_t open_w;
+	/* DURABLE_* mode that WRITEs on this handle wait for */
+	uint8_t durability;
+	uint8_t inline_used;
+	/* share_generation() when path was resolved */
+	uint32_t generation;
 
-	/* assigned path string, lengths, share info */
+	/* assigned path string */
 	char * name;
-	int sharelen, pathlen;
-	struct share * share;
 
-	/* fd and dir handles */
-	int fd;
-	int open_w;
+	/* dir handle and cache for directory reading */
 	DIR *dir;
-	
-	/* cache for directory reading */
 	char * entry_name;
 	int entry_len;
+
+	struct handle * next_free;
+
+	char inline_buf[HANDLE_INLINE];
 };
 
 /* initialize handles and return maxhandles */
@@ -42,6 +53,9 @@ int handle_init ();
  * returns NULL if the path is bad. */
 struct handle * handle_make (char const * buf, int len);
 
+/* close a handle object and return it to the pool */
+void handle_free (struct handle * h);
+
 /* try to assign the path from buf/len into handle.
 return STAT_OK on success, or appropriate
 ERR_* error code. */
@@ -58,14 +72,10 @@ struct handle * handle_get (uint16_t handle);
 /* check whether path is acceptable */
 int check_path (char const * buf, int len);
 
-/* build handle path based on current share config */
+/* build handle path based on current share config.
+ * does nothing if the path was resolved under the current config */
 void handle_fill_path (struct handle * h);
 
 #define MAXHANDLES 16384
 
-int share_add (char const * name, char const * path, int writable);
-/*void share_del (char const * name); maybe later */
-struct share * share_find(char const * name, int nlen);
-struct share * share_next(struct share * seed);
-
 #endif
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "libnewtp.h"
+#include "readahead.h"
+#include "struct_helpers.h"
+
+/* chunk reads sent at once by a single direct read */
+#define READ_BATCH 16
+
+/* reads this close to where the last one ended still count as
+ * sequential: the kernel may send the reads of a stream out of order */
+#define RA_SLACK (4 * RA_CHUNK)
+
+/* reads without readahead. all chunks of a batch are in flight together,
+ * and each is received straight into its place in buf.
+ * returns bytes read or negative errno */
+static int read_direct (struct newtp_conn * c, uint16_t handle, char * buf, size_t size, uint64_t offset)
+{
+	struct newtp_req * r[READ_BATCH];
+	size_t total = 0;
+	int n, res = 0, more = 1;
+
+	while (more && total < size) {
+		for (n = 0; n < READ_BATCH && total + (size_t)n * RA_CHUNK < size; n++) {
+			size_t ofs = total + (size_t)n * RA_CHUNK;
+			uint16_t len = (size - ofs > RA_CHUNK) ? RA_CHUNK : size - ofs;
+			r[n] = newtp_req_new(c, CMD_READ, handle);
+			pack_params_offlen_p(newtp_req_payload(r[n], SIZEOF_params_offlen()), offset + ofs, len);
+			newtp_req_dest(r[n], buf + ofs, len);
+			newtp_submit(r[n], NULL, NULL);
+		}
+		/* everything after the first short or failed chunk is dropped */
+		for (int i = 0; i < n; i++) {
+			int result = newtp_wait(r[i]);
+			if (more) {
+				if (result >= 0x80 || r[i]->data != r[i]->dest) {
+					res = result >= 0x80 ? newtp_result_to_errno(result) : -EIO;
+					more = 0;
+				} else {
+					total += r[i]->reply.length;
+					if (r[i]->reply.length < r[i]->dest_size) more = 0;
+				}
+			}
+			newtp_req_free(r[i]);
+		}
+	}
+	return (total == 0 && res < 0) ? res : total;
+}
+
+void ra_init (struct readahead * ra, struct newtp_conn * conn, uint16_t handle)
+{
+	memset(ra, 0, sizeof(struct readahead));
+	pthread_mutex_init(&ra->lock, NULL);
+	ra->conn = conn;
+	ra->handle = handle;
+	ra->eof = UINT64_MAX;
+	ra->window = RA_MIN_WINDOW;
+}
+
+/* the functions below are called with ra->lock held */
+
+/* removes the first chunk, learning from its timing */
+static void pop (struct readahead * ra)
+{
+	struct newtp_req * r = ra->ring[ra->head];
+
+	/* a READ in flight can't be freed */
+	newtp_wait(r);
+	newtp_estimate_add(&ra->est, r);
+	newtp_req_free(r);
+	ra->head = (ra->head + 1) % RA_SLOTS;
+	ra->count--;
+	ra->start += RA_CHUNK;
+}
+
+static void drop_all (struct readahead * ra)
+{
+	while (ra->count) pop(ra);
+	ra->eof = UINT64_MAX;
+}
+
+/* sends READs until window bytes after pos are covered */
+static void fill (struct readahead * ra, uint64_t pos)
+{
+	uint64_t end;
+
+	if (!ra->count) ra->start = pos;
+	end = ra->start + (uint64_t)ra->count * RA_CHUNK;
+	while (ra->count < RA_SLOTS && end < ra->eof && end < pos + ra->window) {
+		struct newtp_req * r = newtp_req_new(ra->conn, CMD_READ, ra->handle);
+		pack_params_offlen_p(newtp_req_payload(r, SIZEOF_params_offlen()), end, RA_CHUNK);
+		newtp_submit(r, NULL, NULL);
+		ra->ring[(ra->head + ra->count) % RA_SLOTS] = r;
+		ra->count++;
+		end += RA_CHUNK;
+	}
+}
+
+int ra_read (struct readahead * ra, char * buf, size_t size, uint64_t offset)
+{
+	uint64_t pos = offset;
+	size_t done = 0;
+	int res = 0, seq, waited = 0, at_eof = 0;
+
+	pthread_mutex_lock(&ra->lock);
+
+	seq = (offset + RA_SLACK >= ra->next && offset <= ra->next + RA_SLACK) ||
+		(ra->count && offset >= ra->start && offset < ra->start + (uint64_t)ra->count * RA_CHUNK);
+	if (!seq) {
+		drop_all(ra);
+		ra->window = RA_MIN_WINDOW;
+	}
+
+	/* chunks before the read are not needed any more */
+	while (ra->count && ra->start + RA_CHUNK <= pos && pos < ra->eof) pop(ra);
+
+	while (done < size && ra->count && pos >= ra->start) {
+		struct newtp_req * r = ra->ring[ra->head];
+		uint64_t cstart = ra->start;
+		int len;
+
+		if (!r->done) waited = 1;
+		if (newtp_wait(r) >= 0x80) {
+			res = newtp_result_to_errno(r->reply.result);
+			drop_all(ra);
+			break;
+		}
+		len = r->reply.length;
+		if (pos < cstart + len) {
+			size_t n = cstart + len - pos;
+			if (n > size - done) n = size - done;
+			memcpy(buf + done, r->data + (pos - cstart), n);
+			done += n;
+			pos += n;
+		}
+		if (len < RA_CHUNK) {
+			ra->eof = cstart + len;
+			if (pos >= ra->eof) {
+				at_eof = 1;
+				break;
+			}
+		}
+		if (pos < cstart + RA_CHUNK) break;
+		pop(ra);
+	}
+
+	/* whatever the window doesn't cover is read directly */
+	if (!at_eof && res == 0 && done < size) {
+		int n = read_direct(ra->conn, ra->handle, buf + done, size - done, pos);
+		if (n < 0) {
+			res = n;
+		} else {
+			if (seq) waited = 1;
+			done += n;
+			pos += n;
+			if (pos > ra->eof) ra->eof = UINT64_MAX;
+		}
+	}
+
+	ra->next = pos;
+	if (seq) {
+		/* the reader waited for data: keep more ahead, as long as that
+		 * is below twice the bandwidth-delay product, or there are no
+		 * estimates yet */
+		if (waited) {
+			double target = 2 * newtp_estimate_bdp(&ra->est);
+			if (!target || ra->window < target) ra->window *= 2;
+			if (ra->window > RA_MAX_WINDOW) ra->window = RA_MAX_WINDOW;
+		}
+		fill(ra, pos);
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+	return (done == 0 && res < 0) ? res : done;
+}
+
+void ra_drop (struct readahead * ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	drop_all(ra);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+void ra_destroy (struct readahead * ra)
+{
+	ra_drop(ra);
+	pthread_mutex_destroy(&ra->lock);
+}
@@ -0,0 +1,51 @@
+#ifndef READAHEAD__H__
+#define READAHEAD__H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "commands.h"
+#include "libnewtp.h"
+
+/* Readahead of newfs' open files.
+ *
+ * Every read sends all of its chunks at once. When reads follow each
+ * other through the file, READs for the data after them are sent ahead,
+ * and later reads are served from their replies. The amount kept ahead
+ * (the window) starts small and grows while the reader has to wait for
+ * data, up to about twice the bandwidth-delay product measured on the
+ * replies, and never beyond RA_MAX_WINDOW per file. */
+
+#define RA_CHUNK      MAX_LENGTH
+/* well below NEWTP_WINDOW, so one stream leaves room for other requests */
+#define RA_SLOTS      32
+#define RA_MIN_WINDOW (2 * RA_CHUNK)
+#define RA_MAX_WINDOW (RA_SLOTS * RA_CHUNK)
+
+struct readahead {
+	pthread_mutex_t lock;
+	struct newtp_conn * conn;
+	uint16_t handle;
+
+	uint64_t next;		/* where the previous read ended */
+	/* READs sent ahead, in file order: the one in slot
+	 * (head + i) % RA_SLOTS covers RA_CHUNK bytes from start + i * RA_CHUNK */
+	struct newtp_req * ring[RA_SLOTS];
+	int head, count;
+	uint64_t start;
+	uint64_t eof;		/* where a READ came back short, or UINT64_MAX */
+	size_t window;
+
+	/* from the replies */
+	struct newtp_estimate est;
+};
+
+void ra_init (struct readahead * ra, struct newtp_conn * conn, uint16_t handle);
+/* returns bytes read or negative errno */
+int ra_read (struct readahead * ra, char * buf, size_t size, uint64_t offset);
+/* forget the data read ahead, after the file has changed */
+void ra_drop (struct readahead * ra);
+void ra_destroy (struct readahead * ra);
+
+#endif
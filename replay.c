@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "capture.h"
+#include "commands.h"
+#include "common.h"
+#include "flush.h"
+#include "log.h"
+#include "metrics.h"
+#include "operations.h"
+#include "paths.h"
+#include "shares.h"
+#include "structs.h"
+#include "tools.h"
+
+/* Replays a session captured with server -C or -Cp through the server's
+ * command handlers, without network or TLS, at the recorded pace (or
+ * -x times faster) or, with -f, as fast as possible. Group commit runs
+ * as in the server: held-back replies are released when the flush window
+ * closes, or when the next command is not due yet.
+ *
+ * Commands run against the shares given, as the server would; replay
+ * onto a copy of the data the capture started from, as writes, renames
+ * and deletes are done again. Results that differ from the recorded ones
+ * are counted as mismatches: a capture without payloads has no paths, so
+ * most of its commands fail.
+ *
+ * Prints one JSON object with the time every command took, per command,
+ * next to the service times recorded, so runs of different builds over
+ * the same capture can be compared.
+ *
+ * usage: ./replay [-f] [-x speed] [-l label] [-c config] <capture> <shares> */
+
+static struct latencies {
+	uint64_t * v;
+	size_t n, cap;
+	uint64_t mismatches;
+	/* service times recorded in the capture */
+	uint64_t * rec;
+	size_t rn, rcap;
+} stats[256];
+
+/* commands waiting for their reply from flush_commit */
+static struct {
+	uint64_t started;
+	uint8_t command;
+	uint8_t waiting;
+} deferred[65536];
+
+static uint64_t now_ns ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until (uint64_t t)
+{
+	struct timespec ts = { t / 1000000000, t % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void push (uint64_t ** v, size_t * n, size_t * cap, uint64_t value)
+{
+	if (*n == *cap) {
+		*cap = *cap ? 2 * *cap : 1024;
+		*v = xrealloc(*v, *cap * sizeof(uint64_t));
+	}
+	(*v)[(*n)++] = value;
+}
+
+/* flush_commit hands us the held-back replies here */
+static int take_replies (void * data, int len)
+{
+	uint64_t now = now_ns();
+	char * buf = data;
+	struct reply reply;
+
+	for (int pos = 0; unpack_reply(buf + pos, len - pos, &reply) > 0; pos += SIZEOF_reply() + reply.length) {
+		struct latencies * l;
+
+		if (!deferred[reply.request_id].waiting) continue;
+		deferred[reply.request_id].waiting = 0;
+		l = stats + deferred[reply.request_id].command;
+		push(&l->v, &l->n, &l->cap, now - deferred[reply.request_id].started);
+	}
+	return len;
+}
+
+static int compare_u64 (void const * a, void const * b)
+{
+	uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_percentiles (uint64_t * v, size_t n)
+{
+	qsort(v, n, sizeof(uint64_t), compare_u64);
+	printf("{ \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu }",
+		(unsigned long long)(n ? v[(n - 1) / 2] : 0),
+		(unsigned long long)(n ? v[(size_t)((n - 1) * 0.99)] : 0),
+		(unsigned long long)(n ? v[(size_t)((n - 1) * 0.999)] : 0),
+		(unsigned long long)(n ? v[n - 1] : 0));
+}
+
+static void usage (char const * prog)
+{
+	fprintf(stderr, "usage: %s [-f] [-x speed] [-l label] [-c config] <capture> <shares>\n"
+		"shares are given as to the server: [-ro|-rw] /path/to/share=name\n", prog);
+	exit(1);
+}
+
+int main (int argc, char ** argv)
+{
+	struct capture_reader reader;
+	struct capture_record rec;
+	struct latencies * l;
+	char const * label = "", * capture = NULL;
+	char * inbuf, * outbuf;
+	int fast = 0, res, len, first = 1;
+	double speed = 1;
+	uint64_t start, due, now, behind = 0, commands = 0, mismatches = 0;
+
+	setlocale(LC_ALL, "");
+	log_init();
+
+	for (int i = 1; i < argc; i++) {
+		int writable;
+
+		if (!strcmp(argv[i], "-f")) { fast = 1; continue; }
+		if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "-l") || !strcmp(argv[i], "-c") ||
+			!strcmp(argv[i], "-ro") || !strcmp(argv[i], "-rw")) {
+			if (i + 1 == argc) usage(argv[0]);
+			if (argv[i][1] == 'x') speed = atof(argv[++i]);
+			else if (argv[i][1] == 'l') label = argv[++i];
+			else if (argv[i][1] == 'c') share_set_config(argv[++i]);
+			else {
+				writable = argv[i][2] == 'w';
+				if (share_add_spec(argv[++i], writable) == -1) exit(1);
+			}
+			continue;
+		}
+		if (argv[i][0] == '-') usage(argv[0]);
+		if (!capture) capture = argv[i];
+		else if (share_add_spec(argv[i], 0) == -1) exit(1);
+	}
+	if (!capture || speed <= 0) usage(argv[0]);
+	if (share_reload() == -1) exit(1);
+	flush_init();
+	share_init();
+	handle_init();
+	flush_set_sender(take_replies);
+
+	if (capture_reader_open(&reader, capture) == -1) {
+		fprintf(stderr, "%s: %s\n", capture, errno == EINVAL ? "not a capture" : strerror(errno));
+		return 1;
+	}
+	inbuf = xmalloc(MAX_LENGTH * 2);
+	outbuf = xmalloc(MAX_LENGTH * 2);
+
+	start = now_ns();
+	while ((res = capture_read(&reader, &rec, inbuf)) == 1) {
+		due = start + (uint64_t)(rec.received / speed);
+		/* idle until the command is due, letting the flush window close
+		 * on the way, as the server would while the client is quiet */
+		while (!fast && (now = now_ns()) < due) {
+			if (!flush_pending()) {
+				sleep_until(due);
+			} else if (flush_timeout() == 0) {
+				flush_commit();
+			} else {
+				uint64_t closes = now + (uint64_t)flush_timeout() * 1000000;
+				sleep_until(closes < due ? closes : due);
+			}
+		}
+		if (!fast && now_ns() - due > behind) behind = now_ns() - due;
+
+		share_check(0);
+		now = now_ns();
+		len = handle_command(&rec.cmd, inbuf, outbuf);
+		l = stats + rec.cmd.command;
+		if (len > 0) {
+			push(&l->v, &l->n, &l->cap, now_ns() - now);
+			if (rec.result != CAPTURE_DEFERRED && (uint8_t)outbuf[3] != rec.result) {
+				l->mismatches++;
+				mismatches++;
+			}
+		} else {
+			deferred[rec.cmd.request_id].started = now;
+			deferred[rec.cmd.request_id].command = rec.cmd.command;
+			deferred[rec.cmd.request_id].waiting = 1;
+		}
+		push(&l->rec, &l->rn, &l->rcap, rec.service);
+		commands++;
+		arena_reset(&cmd_arena);
+
+		/* the next command is always there when not paced */
+		if (flush_pending() && flush_timeout() == 0) flush_commit();
+	}
+	if (flush_pending()) flush_commit();
+	now = now_ns();
+	if (res == -1) fprintf(stderr, "%s: damaged after %llu commands\n", capture, (unsigned long long)commands);
+	capture_reader_close(&reader);
+
+	printf("{\n  \"label\": \"%s\",\n  \"capture\": \"%s\",\n", label, capture);
+	printf("  \"payloads\": %s,\n  \"mode\": \"%s\",\n  \"speed\": %g,\n",
+		reader.flags & CAPTURE_PAYLOADS ? "true" : "false", fast ? "fast" : "paced", fast ? 0 : speed);
+	printf("  \"commands\": %llu,\n  \"mismatches\": %llu,\n  \"seconds\": %.3f,\n  \"ops_per_s\": %.1f,\n",
+		(unsigned long long)commands, (unsigned long long)mismatches, (now - start) / 1e9,
+		commands / ((now - start) / 1e9));
+	printf("  \"max_behind_ns\": %llu,\n  \"by_command\": [", (unsigned long long)behind);
+	for (int c = 0; c < 256; c++) {
+		char const * name = metrics_command_name(c);
+		if (!stats[c].rn) continue;
+		printf("%s\n    { \"command\": \"%s\", \"count\": %zu, \"mismatches\": %llu,\n      \"replay_ns\": ",
+			first ? "" : ",", name ? name : "unknown", stats[c].rn, (unsigned long long)stats[c].mismatches);
+		print_percentiles(stats[c].v, stats[c].n);
+		printf(",\n      \"captured_ns\": ");
+		print_percentiles(stats[c].rec, stats[c].rn);
+		printf(" }");
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+	return res == -1;
+}
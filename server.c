@@ -3,6 +3,7 @@
 #include <locale.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,9 +16,12 @@
 #include <gsasl.h>
 #include <gnutls/gnutls.h>
 
+#include "capture.h"
 #include "commands.h"
 #include "common.h"
+#include "flush.h"
 #include "log.h"
+#include "metrics.h"
 #include "operations.h"
 #include "paths.h"
 #include "structs.h"
@@ -39,6 +43,11 @@ int child = 0;
 int childsock;
 
 char * SASL_password = NULL;
+char * metrics_path = NULL;
+char const * port = MYPORT;
+char * capture_dir = NULL;
+int capture_flags = 0;
+int metrics_sock = -1;
 Gsasl * SASL_context = NULL;
 
 char * inbuf;
@@ -54,8 +63,14 @@ void close_server_sockets ()
 
 void at_exit ()
 {
-	if (child) close(childsock);
-	else close_server_sockets();
+	if (child) {
+		close(childsock);
+		metrics_session(0);
+		if (capture_dir) capture_close();
+	} else {
+		close_server_sockets();
+		if (metrics_path) unlink(metrics_path);
+	}
 	if (SASL_context) gsasl_done(SASL_context);
 }
 
@@ -65,58 +80,48 @@ void sighandler (int signal)
 	exit(0); /* invokes at_exit handler */
 }
 
+void hup_handler (int signal)
+{
+	share_request_reload();
+}
+
 
 /***** child process functions *****/
 
-#define HANDLE_CMD(x) \
-	case CMD_##x:\
-		len = cmd_##x(&cmd, inbuf, outbuf); \
-		break;
-
 void do_work ()
 {
 	struct command cmd;
-	int len;
+	int len, result;
+	uint64_t received, started, done;
 
 	while (1) {
 		safe_recv_full(inbuf, SIZEOF_command());
+		received = metrics_now();
 		unpack_command(inbuf, SIZEOF_command(), &cmd);
 		if (cmd.length) safe_recv_full(inbuf, cmd.length);
+		started = metrics_now();
 
-		logp("received command: request_id 0x%04x, ext 0x%02x, cmd 0x%02x, length %d",
-			cmd.request_id, cmd.extension, cmd.command, cmd.length);
-
-		len = 0;
-
-		switch (cmd.command) {
-			HANDLE_CMD(ASSIGN)
-			HANDLE_CMD(STAT)
-			HANDLE_CMD(SETATTR)
-			HANDLE_CMD(STATVFS)
-			HANDLE_CMD(READ)
-			HANDLE_CMD(WRITE)
-			HANDLE_CMD(TRUNCATE)
-			HANDLE_CMD(DELETE)
-			HANDLE_CMD(RENAME)
-			HANDLE_CMD(MAKEDIR)
-			HANDLE_CMD(REWINDDIR)
-			HANDLE_CMD(READDIR)
-			default:
-				logp("unknown command: %x", cmd.command);
-				len = pack_reply_p(outbuf, cmd.request_id, 0, ERR_BADCOMMAND, 0);
-				break;
-		}
+		/* between commands, nothing refers to the shares */
+		share_check(0);
 
-		if (len == 0) {
-			len = pack_reply_p(outbuf, cmd.request_id, 0, ERR_FAIL, 0);
-		}
+		dbgp("received command: request_id 0x%04x, ext 0x%02x, cmd 0x%02x, length %d",
+			cmd.request_id, cmd.extension, cmd.command, cmd.length);
 
-		if (len > 0) {
-			safe_send_full(outbuf, len);
-		} else {
-			len = pack_reply_p(outbuf, cmd.request_id, 0, ERR_SERVFAIL, 0);
-			safe_send_full(outbuf, len);
-		}
+		len = handle_command(&cmd, inbuf, outbuf);
+		if (len > 0) safe_send_full(outbuf, len);
+
+		/* result code is the fourth byte of reply */
+		result = (len > 0) ? (uint8_t)outbuf[3] : -1;
+		done = metrics_now();
+		metrics_record(cmd.command, result, started - received, done - started,
+			SIZEOF_command() + cmd.length, len);
+		if (capture_dir) capture_command(&cmd, inbuf, received, done - started, result);
+		arena_reset(&cmd_arena);
+
+		/* commit pending syncs when the window closes, or sooner
+		 * if the client is waiting for us */
+		if (flush_pending() && (flush_timeout() == 0 || !wait_for_data(flush_timeout())))
+			flush_commit();
 	}
 }
 
@@ -141,11 +146,16 @@ void do_sasl_auth ()
 		inbuf[cmd.length] = 0;
 		mechanism = inbuf;
 	} else {
-		res = unpack(inbuf, cmd.length, "sBsB", &mech_len, &mechanism, &resp_len, &response);
+		struct auth_initial initial;
+		res = unpack_auth_initial_view(inbuf, cmd.length, &initial);
 		if (res < 0) {
 			ext = 0; err = ERR_BADPACKET;
 			goto fail;
 		}
+		mechanism = initial.mechanism; mech_len = initial.mechanism_len;
+		response = initial.response; resp_len = initial.response_len;
+		/* overwrites response_len, which is already decoded */
+		mechanism[mech_len] = 0;
 	}
 
 	logp("client uses mechanism '%s'", mechanism);
@@ -156,7 +166,6 @@ void do_sasl_auth ()
 	}
 	
 	res = gsasl_server_start(SASL_context, mechanism, &session);
-	if (mechanism != inbuf) free(mechanism);
 	
 
 	if (res != GSASL_OK) {
@@ -174,7 +183,6 @@ void do_sasl_auth ()
 
 	/* start the session (response might be NULL) */
 	res = gsasl_step(session, response, resp_len, &output, &output_len);
-	free(response);
 	while (res == GSASL_NEEDS_MORE) {
 		pack_reply_p(outbuf, cmd.request_id, EXT_INIT, SASL_R_CHALLENGE, (uint16_t)output_len);
 		memcpy(outbuf + SIZEOF_reply(), output, output_len);
@@ -301,7 +309,7 @@ void do_session_init()
 
 void fork_client (int client)
 {
-	int pid;
+	int pid, yes = 1;
 	CHECK(pid, fork(), return);
 
 	if (pid > 0) return;
@@ -310,8 +318,15 @@ void fork_client (int client)
 	child = 1;
 	childsock = client;
 	close_server_sockets();
+	if (metrics_sock != -1) close(metrics_sock);
+	metrics_session(1);
+	log_init();
 	log("connection received");
 
+	/* replies span several TLS records; don't let Nagle hold back
+	 * the last one until the client acknowledges the others */
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
 	/* initialize TLS */
 	newtp_gnutls_init (client, GNUTLS_SERVER);
 
@@ -320,6 +335,8 @@ void fork_client (int client)
 
 	do_session_init();
 	do_sasl_auth();
+	/* authentication is left out, a replay has no use for it */
+	if (capture_dir && capture_open(capture_dir, capture_flags) == -1) capture_dir = NULL;
 	do_work();
 
 	newtp_gnutls_disconnect(1);
@@ -333,7 +350,8 @@ int main (int argc, char ** argv)
 	socklen_t remote_addr_s = sizeof(remote_addr);
 	int yes = 1;
 	int sock, s, err, max = -1;
-	fd_set set;
+	fd_set set, all;
+	struct sigaction hup;
 
 	setlocale(LC_ALL, "");
 
@@ -341,20 +359,28 @@ int main (int argc, char ** argv)
 	signal(SIGINT, sighandler);
 	signal(SIGTERM, sighandler);
 	signal(SIGSEGV, sighandler);
+	/* signal() would reset the handler after the first SIGHUP */
+	memset(&hup, 0, sizeof(hup));
+	hup.sa_handler = hup_handler;
+	hup.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &hup, NULL);
 
 	/* process command line arguments */
 	if (argc < 2) {
-		printf("usage: %s [-p password] <shares>\n", argv[0]);
+		printf("usage: %s [-p password] [-m metrics_socket] [-c config] [-P port]\n"
+			"       [-C|-Cp capture_dir] <shares>\n", argv[0]);
 		printf("shares can be specified as follows:\n");
 		printf("/path/to/share=name - this share is read-only\n");
 		printf("-ro /path/to/share=name - this is also read-only\n");
 		printf("-rw /path/to/share=name - this is read-write\n");
+		printf("config file has one share per line, in the same format.\n");
+		printf("it is read again on SIGHUP.\n");
+		printf("-C records commands of every session in capture_dir, -Cp with payloads.\n");
 		printf("example: %s -ro /home/you/Public=public -rw /home/you/Incoming=Incoming\n", argv[0]);
 		exit(1);
 	}
 	for (int i = 1; i < argc; i++) {
 		char * path;
-		char * name;
 		int writable = 0;
 		if (!strcmp("-ro", argv[i])) {
 			if (++i < argc) path = argv[i];
@@ -369,6 +395,15 @@ int main (int argc, char ** argv)
 				printf("missing share name for -rw\n");
 				exit(1);
 			}
+		} else if (!strcmp("-m", argv[i])) {
+			if (argc > i + 1) {
+				metrics_path = argv[i+1];
+				i++;
+				continue;
+			} else {
+				printf("-m specified but no socket path supplied\n");
+				exit(1);
+			}
 		} else if (!strcmp("-p", argv[i])) {
 			if (argc > i + 1) {
 				SASL_password = argv[i+1];
@@ -378,27 +413,45 @@ int main (int argc, char ** argv)
 				printf("-p specified but no password supplied\n");
 				exit(1);
 			}
+		} else if (!strcmp("-P", argv[i])) {
+			if (argc > i + 1) {
+				port = argv[i+1];
+				i++;
+				continue;
+			} else {
+				printf("-P specified but no port supplied\n");
+				exit(1);
+			}
+		} else if (!strcmp("-C", argv[i]) || !strcmp("-Cp", argv[i])) {
+			if (argc > i + 1) {
+				capture_dir = argv[i+1];
+				if (argv[i][2] == 'p') capture_flags = CAPTURE_PAYLOADS;
+				i++;
+				continue;
+			} else {
+				printf("%s specified but no capture directory supplied\n", argv[i]);
+				exit(1);
+			}
+		} else if (!strcmp("-c", argv[i])) {
+			if (argc > i + 1) {
+				share_set_config(argv[i+1]);
+				i++;
+				continue;
+			} else {
+				printf("-c specified but no config file supplied\n");
+				exit(1);
+			}
 		} else {
 			path = argv[i];
 		}
-		name = path;
-		while (*name && *name != '=') name++; /* find '=' */
-		if (!*name) {
-			printf("cannot find share name in string '%s'\n", path);
-			exit(1);
-		}
-		*name = 0; /* break into path/name pair */
-		name++;
-		if (!*name) {
-			printf("share name cannot be empty\n");
-			exit(1);
-		}
-		/* TODO check for invalid share names */
-
-		if (!share_add(name, path, writable)) {
-			printf("failed to add '%s' under name '%s'\n", path, name);
-		}
+		if (share_add_spec(path, writable) == -1) exit(1);
 	}
+	if (share_reload() == -1) exit(1);
+
+	/* shared state of group commit, inherited by all sessions */
+	flush_init();
+	metrics_init();
+	share_init();
 
 	/* set up Gsasl context */
 	if ((err = gsasl_init(&SASL_context)) != GSASL_OK) {
@@ -426,7 +479,7 @@ int main (int argc, char ** argv)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE; /* fill in my IP for me */
 
-	CHECK(err,getaddrinfo(NULL, MYPORT, &hints, &res), return 1);
+	CHECK(err,getaddrinfo(NULL, port, &hints, &res), return 1);
 
 	/* make a socket, bind it, and listen on it: */
 	for (; res; res = res->ai_next) {
@@ -443,15 +496,27 @@ int main (int argc, char ** argv)
 		++socknum;
 	}
 
-	FD_ZERO(&set);
+	if (metrics_path) {
+		metrics_sock = metrics_listen(metrics_path);
+		if (metrics_sock == -1) return 1;
+	}
+
+	FD_ZERO(&all);
 	for (int i = 0; i < socknum; i++) {
-		FD_SET(sockets[i], &set);
+		FD_SET(sockets[i], &all);
 		if (sockets[i] > max) max = sockets[i];
 	}
+	if (metrics_sock != -1) {
+		FD_SET(metrics_sock, &all);
+		if (metrics_sock > max) max = metrics_sock;
+	}
 	logp("we have %d sockets, max is %d", socknum, max);
 	
 	while (1) {
-		CHECK(err, select(max + 1, &set, NULL, NULL, NULL), continue);
+		share_check(1);
+		set = all; /* select() overwrites the set */
+		err = select(max + 1, &set, NULL, NULL, NULL);
+		if (err == -1 && errno != EINTR) perror("select");
 		if (err <= 0) continue;
 
 		for (int i = 0; i < socknum; i++) {
@@ -460,5 +525,6 @@ int main (int argc, char ** argv)
 				fork_client(sock);
 			}
 		}
+		if (metrics_sock != -1 && FD_ISSET(metrics_sock, &set)) metrics_serve(metrics_sock);
 	}
 }
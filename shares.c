@@ -0,0 +1,310 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "shares.h"
+#include "tools.h"
+
+#define SHARE_BUCKETS_MIN 64
+
+struct share_table {
+	struct share ** buckets;
+	unsigned mask;
+	int count;
+	struct share * first, * last;
+};
+
+/* the table in use */
+static struct share_table * shares = NULL;
+static uint32_t generation = 1;
+
+/* permanent shares, copied into every new table */
+struct share_spec {
+	char * name;
+	char * path;
+	int writable;
+};
+static struct share_spec * permanent = NULL;
+static int permanent_count = 0;
+
+static char const * config_file = NULL;
+
+static volatile sig_atomic_t reload_requested = 0;
+/* reloads done by the main process, in shared memory */
+static uint32_t * announced = NULL;
+static uint32_t seen = 0;
+
+/* FNV-1a */
+static uint32_t share_hash (char const * name, int nlen)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < nlen; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct share_table * table_new ()
+{
+	struct share_table * t = xcalloc(sizeof(struct share_table));
+	t->buckets = xcalloc(SHARE_BUCKETS_MIN * sizeof(struct share *));
+	t->mask = SHARE_BUCKETS_MIN - 1;
+	return t;
+}
+
+static void table_free (struct share_table * t)
+{
+	struct share * s, * next;
+	if (!t) return;
+	for (s = t->first; s; s = next) {
+		next = s->next;
+		free(s);
+	}
+	free(t->buckets);
+	free(t);
+}
+
+static void table_grow (struct share_table * t)
+{
+	unsigned mask = t->mask * 2 + 1;
+	struct share ** buckets = xcalloc((mask + 1) * sizeof(struct share *));
+	for (struct share * s = t->first; s; s = s->next) {
+		s->next_hash = buckets[s->hash & mask];
+		buckets[s->hash & mask] = s;
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->mask = mask;
+}
+
+static struct share * table_find (struct share_table * t, char const * name, int nlen, uint32_t hash)
+{
+	for (struct share * s = t->buckets[hash & t->mask]; s; s = s->next_hash)
+		if (s->hash == hash && s->nlen == nlen && !memcmp(s->name, name, nlen)) return s;
+	return NULL;
+}
+
+static int table_add (struct share_table * t, char const * name, char const * path, int writable)
+{
+	int nlen = strlen(name);
+	int plen = strlen(path);
+	uint32_t hash = share_hash(name, nlen);
+	struct share * s;
+
+	if (table_find(t, name, nlen, hash)) return 0; /* duplicate entry */
+
+	s = xmalloc(sizeof(struct share) + nlen + 1 + plen + 1);
+	s->name = s->data;
+	memcpy(s->name, name, nlen + 1);
+	s->nlen = nlen;
+	s->path = s->data + nlen + 1;
+	memcpy(s->path, path, plen + 1);
+	s->plen = plen;
+	s->writable = writable;
+	s->hash = hash;
+	s->next = NULL;
+
+	if (t->count >= t->mask + 1) table_grow(t);
+	s->next_hash = t->buckets[hash & t->mask];
+	t->buckets[hash & t->mask] = s;
+	if (t->last) t->last->next = s;
+	else t->first = s;
+	t->last = s;
+	t->count++;
+	return 1;
+}
+
+/* split "path=name" into a copy of path and name.
+ * returns NULL on success, or an error message */
+static char const * parse_spec (char const * spec, char ** path, char ** name)
+{
+	char const * eq = strchr(spec, '=');
+	if (!eq) return "cannot find share name";
+	if (!eq[1]) return "share name cannot be empty";
+	if (eq == spec) return "share path cannot be empty";
+	/* TODO check for invalid share names */
+	*path = xmalloc(eq - spec + 1);
+	memcpy(*path, spec, eq - spec);
+	(*path)[eq - spec] = 0;
+	*name = xmalloc(strlen(eq + 1) + 1);
+	strcpy(*name, eq + 1);
+	return NULL;
+}
+
+void share_init ()
+{
+	void * mem = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		/* sessions will keep the shares they started with */
+		warnp("cannot map shared reload counter: %s", strerror(errno));
+		return;
+	}
+	announced = mem;
+	*announced = 0;
+}
+
+int share_add (char const * name, char const * path, int writable)
+{
+	struct share_spec * p;
+
+	if (!shares) shares = table_new();
+	if (!table_add(shares, name, path, writable)) return 0;
+
+	permanent = xrealloc(permanent, (permanent_count + 1) * sizeof(struct share_spec));
+	p = permanent + permanent_count++;
+	p->name = xmalloc(strlen(name) + 1);
+	strcpy(p->name, name);
+	p->path = xmalloc(strlen(path) + 1);
+	strcpy(p->path, path);
+	p->writable = writable;
+	generation++;
+	return 1;
+}
+
+int share_add_spec (char const * spec, int writable)
+{
+	char * path, * name;
+	char const * error = parse_spec(spec, &path, &name);
+	int res;
+
+	if (error) {
+		printf("%s in string '%s'\n", error, spec);
+		return -1;
+	}
+	res = share_add(name, path, writable);
+	if (!res) printf("failed to add '%s' under name '%s'\n", path, name);
+	free(path);
+	free(name);
+	return res;
+}
+
+void share_set_config (char const * filename)
+{
+	config_file = filename;
+}
+
+/* add shares from the config file to t. returns 0 on success */
+static int load_config (struct share_table * t)
+{
+	FILE * f;
+	char line[4096];
+	int lineno = 0, res = 0;
+
+	f = fopen(config_file, "r");
+	if (!f) {
+		errp("cannot open share config %s: %s", config_file, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char * p = line, * end, * path, * name;
+		char const * error;
+		int writable = 0;
+
+		lineno++;
+		end = p + strlen(p);
+		if (end > p && end[-1] != '\n' && !feof(f)) {
+			errp("%s:%d: line too long", config_file, lineno);
+			res = -1;
+			break;
+		}
+		while (end > p && (end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t')) *--end = 0;
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p || *p == '#') continue;
+
+		if (!strncmp(p, "-rw", 3) && (p[3] == ' ' || p[3] == '\t')) {
+			writable = 1;
+			p += 3;
+		} else if (!strncmp(p, "-ro", 3) && (p[3] == ' ' || p[3] == '\t')) {
+			p += 3;
+		}
+		while (*p == ' ' || *p == '\t') p++;
+
+		error = parse_spec(p, &path, &name);
+		if (error) {
+			errp("%s:%d: %s", config_file, lineno, error);
+			res = -1;
+			break;
+		}
+		if (!table_add(t, name, path, writable))
+			warnp("%s:%d: duplicate share name '%s', ignoring", config_file, lineno, name);
+		free(path);
+		free(name);
+	}
+
+	fclose(f);
+	return res;
+}
+
+int share_reload ()
+{
+	struct share_table * t = table_new();
+	struct share_table * old;
+
+	for (int i = 0; i < permanent_count; i++)
+		table_add(t, permanent[i].name, permanent[i].path, permanent[i].writable);
+
+	if (config_file && load_config(t) == -1) {
+		table_free(t);
+		return -1;
+	}
+
+	/* nobody holds pointers into the old table, it can go right away */
+	old = shares;
+	shares = t;
+	generation++;
+	table_free(old);
+
+	logp("loaded %d shares", t->count);
+	return 0;
+}
+
+void share_request_reload ()
+{
+	reload_requested = 1;
+}
+
+void share_check (int main_process)
+{
+	if (main_process) {
+		if (!reload_requested) return;
+		reload_requested = 0;
+		if (share_reload() == 0 && announced) {
+			seen = __atomic_add_fetch(announced, 1, __ATOMIC_RELEASE);
+		}
+		return;
+	}
+
+	if (announced && __atomic_load_n(announced, __ATOMIC_ACQUIRE) != seen) {
+		seen = __atomic_load_n(announced, __ATOMIC_ACQUIRE);
+		reload_requested = 1;
+	}
+	if (!reload_requested) return;
+	reload_requested = 0;
+	share_reload();
+}
+
+uint32_t share_generation ()
+{
+	return generation;
+}
+
+struct share * share_find (char const * name, int nlen)
+{
+	if (!shares) return NULL; /* no shares :( */
+	return table_find(shares, name, nlen, share_hash(name, nlen));
+}
+
+struct share * share_next (struct share * seed)
+{
+	if (seed) return seed->next;
+	return shares ? shares->first : NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef SHARES__H__
+#define SHARES__H__
+
+#include <stdint.h>
+
+/* Share registry.
+ *
+ * Shares live in a chained hash table that doubles when it fills up.
+ * They come from two sources: permanent shares given on the command line
+ * (share_add) and an optional config file (share_set_config), which is
+ * read again on reload.
+ *
+ * Reloading builds a complete new table on the side and swaps it in,
+ * RCU-style. Sessions are single-threaded and only reload between
+ * commands (share_check), when no share pointer is in use, so the old
+ * table can be freed right after the swap. Every swap bumps the
+ * generation number, and handles made under an older generation resolve
+ * their path again on next use.
+ *
+ * SIGHUP makes the main process reload. When that succeeds, it bumps
+ * a counter in shared memory, and every session reloads on its next
+ * command.
+ *
+ * Config file syntax is the same as on the command line, one share
+ * per line:
+ *   [-ro|-rw] /path/to/share=name
+ * Empty lines and lines starting with '#' are ignored. */
+
+struct share {
+	char * name;
+	int nlen;
+	char * path;
+	int plen;
+	int writable;
+
+	uint32_t hash;
+	struct share * next_hash;	/* hash chain */
+	struct share * next;		/* all shares, in order of addition */
+	char data[];			/* name and path are stored here */
+};
+
+/* set up shared memory. must be called before forking sessions */
+void share_init ();
+
+/* add a permanent share, kept across reloads.
+ * returns 1 on success, 0 if the name is taken */
+int share_add (char const * name, char const * path, int writable);
+
+/* add a permanent share from "path=name" string. prints what went wrong.
+ * returns 1 on success, 0 if the name is taken, -1 if the string is bad */
+int share_add_spec (char const * spec, int writable);
+
+/* use shares from this file, in addition to permanent ones */
+void share_set_config (char const * filename);
+
+/* rebuild the table from permanent shares and the config file.
+ * returns 0 on success. on error, the current table stays */
+int share_reload ();
+
+/* called from the SIGHUP handler */
+void share_request_reload ();
+
+/* reload if requested. call only when no share pointers are in use.
+ * in the main process, a successful reload is announced to sessions;
+ * in sessions, reloads announced by the main process are picked up */
+void share_check (int main_process);
+
+/* incremented by every change of the table */
+uint32_t share_generation ();
+
+struct share * share_find (char const * name, int nlen);
+struct share * share_next (struct share * seed);
+
+#endif
@@ -1,60 +1,394 @@
 #ifndef STRUCT_HELPERS__H__
 #define STRUCT_HELPERS__H__
 
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
 #include "structs.h"
 
+/* big-endian loads and stores at arbitrary (unaligned) positions.
+ * memcpy of a constant size compiles to a single move. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WIRE_SWAP16(x) (x)
+#define WIRE_SWAP32(x) (x)
+#define WIRE_SWAP64(x) (x)
+#else
+#define WIRE_SWAP16(x) __builtin_bswap16(x)
+#define WIRE_SWAP32(x) __builtin_bswap32(x)
+#define WIRE_SWAP64(x) __builtin_bswap64(x)
+#endif
+
+static inline void wire_put_uint8_t (char * p, uint8_t v) { *(uint8_t *)p = v; }
+static inline void wire_put_uint16_t (char * p, uint16_t v) { v = WIRE_SWAP16(v); memcpy(p, &v, 2); }
+static inline void wire_put_uint32_t (char * p, uint32_t v) { v = WIRE_SWAP32(v); memcpy(p, &v, 4); }
+static inline void wire_put_uint64_t (char * p, uint64_t v) { v = WIRE_SWAP64(v); memcpy(p, &v, 8); }
+
+static inline uint8_t wire_get_uint8_t (char const * p) { return *(uint8_t const *)p; }
+static inline uint16_t wire_get_uint16_t (char const * p) { uint16_t v; memcpy(&v, p, 2); return WIRE_SWAP16(v); }
+static inline uint32_t wire_get_uint32_t (char const * p) { uint32_t v; memcpy(&v, p, 4); return WIRE_SWAP32(v); }
+static inline uint64_t wire_get_uint64_t (char const * p) { uint64_t v; memcpy(&v, p, 8); return WIRE_SWAP64(v); }
+
 #define FORMAT_params_offlen "ls"
 #define SIZEOF_params_offlen(s) (sizeof(uint64_t) + sizeof(uint16_t))
-int pack_params_offlen (char * const buf, struct params_offlen const * s);
-int pack_params_offlen_p (char * const buf, uint64_t const, uint16_t const);
-int unpack_params_offlen (char const * const buf, int available, struct params_offlen * s);
+
+static inline int pack_params_offlen_p (char * const buf, uint64_t const offset, uint16_t const length)
+{
+	assert(buf);
+	wire_put_uint64_t(buf + 0, offset);
+	wire_put_uint16_t(buf + 8, length);
+	return 10;
+}
+
+static inline int pack_params_offlen (char * const buf, struct params_offlen const * s)
+{
+	assert(s);
+	return pack_params_offlen_p(buf, s->offset, s->length);
+}
+
+static inline int unpack_params_offlen (char const * const buf, int available, struct params_offlen * s)
+{
+	assert(s);
+	assert(buf);
+	if (available < 10) return -1;
+	s->offset = wire_get_uint64_t(buf + 0);
+	s->length = wire_get_uint16_t(buf + 8);
+	return 10;
+}
 
 #define FORMAT_command "sccss"
 #define SIZEOF_command(s) (sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t))
-int pack_command (char * const buf, struct command const * s);
-int pack_command_p (char * const buf, uint16_t const, uint8_t const, uint8_t const, uint16_t const, uint16_t const);
-int unpack_command (char const * const buf, int available, struct command * s);
+
+static inline int pack_command_p (char * const buf, uint16_t const request_id, uint8_t const extension, uint8_t const command, uint16_t const handle, uint16_t const length)
+{
+	assert(buf);
+	wire_put_uint16_t(buf + 0, request_id);
+	wire_put_uint8_t(buf + 2, extension);
+	wire_put_uint8_t(buf + 3, command);
+	wire_put_uint16_t(buf + 4, handle);
+	wire_put_uint16_t(buf + 6, length);
+	return 8;
+}
+
+static inline int pack_command (char * const buf, struct command const * s)
+{
+	assert(s);
+	return pack_command_p(buf, s->request_id, s->extension, s->command, s->handle, s->length);
+}
+
+static inline int unpack_command (char const * const buf, int available, struct command * s)
+{
+	assert(s);
+	assert(buf);
+	if (available < 8) return -1;
+	s->request_id = wire_get_uint16_t(buf + 0);
+	s->extension = wire_get_uint8_t(buf + 2);
+	s->command = wire_get_uint8_t(buf + 3);
+	s->handle = wire_get_uint16_t(buf + 4);
+	s->length = wire_get_uint16_t(buf + 6);
+	return 8;
+}
 
 #define FORMAT_reply "sccs"
 #define SIZEOF_reply(s) (sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t))
-int pack_reply (char * const buf, struct reply const * s);
-int pack_reply_p (char * const buf, uint16_t const, uint8_t const, uint8_t const, uint16_t const);
-int unpack_reply (char const * const buf, int available, struct reply * s);
+
+static inline int pack_reply_p (char * const buf, uint16_t const request_id, uint8_t const extension, uint8_t const result, uint16_t const length)
+{
+	assert(buf);
+	wire_put_uint16_t(buf + 0, request_id);
+	wire_put_uint8_t(buf + 2, extension);
+	wire_put_uint8_t(buf + 3, result);
+	wire_put_uint16_t(buf + 4, length);
+	return 6;
+}
+
+static inline int pack_reply (char * const buf, struct reply const * s)
+{
+	assert(s);
+	return pack_reply_p(buf, s->request_id, s->extension, s->result, s->length);
+}
+
+static inline int unpack_reply (char const * const buf, int available, struct reply * s)
+{
+	assert(s);
+	assert(buf);
+	if (available < 6) return -1;
+	s->request_id = wire_get_uint16_t(buf + 0);
+	s->extension = wire_get_uint8_t(buf + 2);
+	s->result = wire_get_uint8_t(buf + 3);
+	s->length = wire_get_uint16_t(buf + 4);
+	return 6;
+}
 
 #define FORMAT_intro "sssBsBs"
 #define SIZEOF_intro(s) (sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t) + (s)->platform_len + sizeof(uint16_t) + (s)->authstr_len + sizeof(uint16_t))
-int pack_intro (char * const buf, struct intro const * s);
-int pack_intro_p (char * const buf, uint16_t const, uint16_t const, uint16_t const, char * const, uint16_t const, char * const, uint16_t const);
+
+static inline int pack_intro_p (char * const buf, uint16_t const max_handles, uint16_t const max_opendirs, uint16_t const platform_len, char * const platform, uint16_t const authstr_len, char * const authstr, uint16_t const num_extensions)
+{
+	assert(buf);
+	char * p = buf;
+	wire_put_uint16_t(p, max_handles); p += 2;
+	wire_put_uint16_t(p, max_opendirs); p += 2;
+	wire_put_uint16_t(p, platform_len); p += 2;
+	if (platform_len) memcpy(p, platform, platform_len);
+	p += platform_len;
+	wire_put_uint16_t(p, authstr_len); p += 2;
+	if (authstr_len) memcpy(p, authstr, authstr_len);
+	p += authstr_len;
+	wire_put_uint16_t(p, num_extensions); p += 2;
+	return p - buf;
+}
+
+static inline int pack_intro (char * const buf, struct intro const * s)
+{
+	assert(s);
+	return pack_intro_p(buf, s->max_handles, s->max_opendirs, s->platform_len, s->platform, s->authstr_len, s->authstr, s->num_extensions);
+}
+
+/* allocates the strings, caller frees them */
 int unpack_intro (char const * const buf, int available, struct intro * s);
 
+/* strings point into buf (valid as long as buf is) and are not NUL-terminated */
+static inline int unpack_intro_view (char const * const buf, int available, struct intro * s)
+{
+	assert(s);
+	assert(buf);
+	char const * p = buf;
+	int left = available - 10;
+	if (left < 0) return -1;
+	uint16_t const platform_len_ = wire_get_uint16_t(p + 4);
+	left -= platform_len_;
+	if (left < 0) return -1;
+	p += 6 + platform_len_;
+	uint16_t const authstr_len_ = wire_get_uint16_t(p + 0);
+	left -= authstr_len_;
+	if (left < 0) return -1;
+	p = buf;
+	s->max_handles = wire_get_uint16_t(p); p += 2;
+	s->max_opendirs = wire_get_uint16_t(p); p += 2;
+	s->platform_len = wire_get_uint16_t(p); p += 2;
+	s->platform = (char *)p;
+	p += s->platform_len;
+	s->authstr_len = wire_get_uint16_t(p); p += 2;
+	s->authstr = (char *)p;
+	p += s->authstr_len;
+	s->num_extensions = wire_get_uint16_t(p); p += 2;
+	return p - buf;
+}
+
 #define FORMAT_extension "csB"
 #define SIZEOF_extension(s) (sizeof(uint8_t) + sizeof(uint16_t) + (s)->name_len)
-int pack_extension (char * const buf, struct extension const * s);
-int pack_extension_p (char * const buf, uint8_t const, uint16_t const, char * const);
+
+static inline int pack_extension_p (char * const buf, uint8_t const code, uint16_t const name_len, char * const name)
+{
+	assert(buf);
+	char * p = buf;
+	wire_put_uint8_t(p, code); p += 1;
+	wire_put_uint16_t(p, name_len); p += 2;
+	if (name_len) memcpy(p, name, name_len);
+	p += name_len;
+	return p - buf;
+}
+
+static inline int pack_extension (char * const buf, struct extension const * s)
+{
+	assert(s);
+	return pack_extension_p(buf, s->code, s->name_len, s->name);
+}
+
+/* allocates the strings, caller frees them */
 int unpack_extension (char const * const buf, int available, struct extension * s);
 
+/* strings point into buf (valid as long as buf is) and are not NUL-terminated */
+static inline int unpack_extension_view (char const * const buf, int available, struct extension * s)
+{
+	assert(s);
+	assert(buf);
+	char const * p = buf;
+	int left = available - 3;
+	if (left < 0) return -1;
+	uint16_t const name_len_ = wire_get_uint16_t(p + 1);
+	left -= name_len_;
+	if (left < 0) return -1;
+	p = buf;
+	s->code = wire_get_uint8_t(p); p += 1;
+	s->name_len = wire_get_uint16_t(p); p += 2;
+	s->name = (char *)p;
+	p += s->name_len;
+	return p - buf;
+}
+
 #define FORMAT_auth_initial "sBsB"
 #define SIZEOF_auth_initial(s) (sizeof(uint16_t) + (s)->mechanism_len + sizeof(uint16_t) + (s)->response_len)
-int pack_auth_initial (char * const buf, struct auth_initial const * s);
-int pack_auth_initial_p (char * const buf, uint16_t const, char * const, uint16_t const, char * const);
+
+static inline int pack_auth_initial_p (char * const buf, uint16_t const mechanism_len, char * const mechanism, uint16_t const response_len, char * const response)
+{
+	assert(buf);
+	char * p = buf;
+	wire_put_uint16_t(p, mechanism_len); p += 2;
+	if (mechanism_len) memcpy(p, mechanism, mechanism_len);
+	p += mechanism_len;
+	wire_put_uint16_t(p, response_len); p += 2;
+	if (response_len) memcpy(p, response, response_len);
+	p += response_len;
+	return p - buf;
+}
+
+static inline int pack_auth_initial (char * const buf, struct auth_initial const * s)
+{
+	assert(s);
+	return pack_auth_initial_p(buf, s->mechanism_len, s->mechanism, s->response_len, s->response);
+}
+
+/* allocates the strings, caller frees them */
 int unpack_auth_initial (char const * const buf, int available, struct auth_initial * s);
 
+/* strings point into buf (valid as long as buf is) and are not NUL-terminated */
+static inline int unpack_auth_initial_view (char const * const buf, int available, struct auth_initial * s)
+{
+	assert(s);
+	assert(buf);
+	char const * p = buf;
+	int left = available - 4;
+	if (left < 0) return -1;
+	uint16_t const mechanism_len_ = wire_get_uint16_t(p + 0);
+	left -= mechanism_len_;
+	if (left < 0) return -1;
+	p += 2 + mechanism_len_;
+	uint16_t const response_len_ = wire_get_uint16_t(p + 0);
+	left -= response_len_;
+	if (left < 0) return -1;
+	p = buf;
+	s->mechanism_len = wire_get_uint16_t(p); p += 2;
+	s->mechanism = (char *)p;
+	p += s->mechanism_len;
+	s->response_len = wire_get_uint16_t(p); p += 2;
+	s->response = (char *)p;
+	p += s->response_len;
+	return p - buf;
+}
+
 #define FORMAT_auth_outcome "csB"
 #define SIZEOF_auth_outcome(s) (sizeof(uint8_t) + sizeof(uint16_t) + (s)->adata_len)
-int pack_auth_outcome (char * const buf, struct auth_outcome const * s);
-int pack_auth_outcome_p (char * const buf, uint8_t const, uint16_t const, char * const);
+
+static inline int pack_auth_outcome_p (char * const buf, uint8_t const result, uint16_t const adata_len, char * const adata)
+{
+	assert(buf);
+	char * p = buf;
+	wire_put_uint8_t(p, result); p += 1;
+	wire_put_uint16_t(p, adata_len); p += 2;
+	if (adata_len) memcpy(p, adata, adata_len);
+	p += adata_len;
+	return p - buf;
+}
+
+static inline int pack_auth_outcome (char * const buf, struct auth_outcome const * s)
+{
+	assert(s);
+	return pack_auth_outcome_p(buf, s->result, s->adata_len, s->adata);
+}
+
+/* allocates the strings, caller frees them */
 int unpack_auth_outcome (char const * const buf, int available, struct auth_outcome * s);
 
+/* strings point into buf (valid as long as buf is) and are not NUL-terminated */
+static inline int unpack_auth_outcome_view (char const * const buf, int available, struct auth_outcome * s)
+{
+	assert(s);
+	assert(buf);
+	char const * p = buf;
+	int left = available - 3;
+	if (left < 0) return -1;
+	uint16_t const adata_len_ = wire_get_uint16_t(p + 1);
+	left -= adata_len_;
+	if (left < 0) return -1;
+	p = buf;
+	s->result = wire_get_uint8_t(p); p += 1;
+	s->adata_len = wire_get_uint16_t(p); p += 2;
+	s->adata = (char *)p;
+	p += s->adata_len;
+	return p - buf;
+}
+
 #define FORMAT_dir_entry "sBsB"
 #define SIZEOF_dir_entry(s) (sizeof(uint16_t) + (s)->name_len + sizeof(uint16_t) + (s)->attr_len)
-int pack_dir_entry (char * const buf, struct dir_entry const * s);
-int pack_dir_entry_p (char * const buf, uint16_t const, char * const, uint16_t const, char * const);
+
+static inline int pack_dir_entry_p (char * const buf, uint16_t const name_len, char * const name, uint16_t const attr_len, char * const attr)
+{
+	assert(buf);
+	char * p = buf;
+	wire_put_uint16_t(p, name_len); p += 2;
+	if (name_len) memcpy(p, name, name_len);
+	p += name_len;
+	wire_put_uint16_t(p, attr_len); p += 2;
+	if (attr_len) memcpy(p, attr, attr_len);
+	p += attr_len;
+	return p - buf;
+}
+
+static inline int pack_dir_entry (char * const buf, struct dir_entry const * s)
+{
+	assert(s);
+	return pack_dir_entry_p(buf, s->name_len, s->name, s->attr_len, s->attr);
+}
+
+/* allocates the strings, caller frees them */
 int unpack_dir_entry (char const * const buf, int available, struct dir_entry * s);
 
+/* strings point into buf (valid as long as buf is) and are not NUL-terminated */
+static inline int unpack_dir_entry_view (char const * const buf, int available, struct dir_entry * s)
+{
+	assert(s);
+	assert(buf);
+	char const * p = buf;
+	int left = available - 4;
+	if (left < 0) return -1;
+	uint16_t const name_len_ = wire_get_uint16_t(p + 0);
+	left -= name_len_;
+	if (left < 0) return -1;
+	p += 2 + name_len_;
+	uint16_t const attr_len_ = wire_get_uint16_t(p + 0);
+	left -= attr_len_;
+	if (left < 0) return -1;
+	p = buf;
+	s->name_len = wire_get_uint16_t(p); p += 2;
+	s->name = (char *)p;
+	p += s->name_len;
+	s->attr_len = wire_get_uint16_t(p); p += 2;
+	s->attr = (char *)p;
+	p += s->attr_len;
+	return p - buf;
+}
+
 #define FORMAT_statvfs_result "illc"
 #define SIZEOF_statvfs_result(s) (sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint8_t))
-int pack_statvfs_result (char * const buf, struct statvfs_result const * s);
-int pack_statvfs_result_p (char * const buf, uint32_t const, uint64_t const, uint64_t const, uint8_t const);
-int unpack_statvfs_result (char const * const buf, int available, struct statvfs_result * s);
+
+static inline int pack_statvfs_result_p (char * const buf, uint32_t const device_id, uint64_t const capacity, uint64_t const free_space, uint8_t const readonly)
+{
+	assert(buf);
+	wire_put_uint32_t(buf + 0, device_id);
+	wire_put_uint64_t(buf + 4, capacity);
+	wire_put_uint64_t(buf + 12, free_space);
+	wire_put_uint8_t(buf + 20, readonly);
+	return 21;
+}
+
+static inline int pack_statvfs_result (char * const buf, struct statvfs_result const * s)
+{
+	assert(s);
+	return pack_statvfs_result_p(buf, s->device_id, s->capacity, s->free_space, s->readonly);
+}
+
+static inline int unpack_statvfs_result (char const * const buf, int available, struct statvfs_result * s)
+{
+	assert(s);
+	assert(buf);
+	if (available < 21) return -1;
+	s->device_id = wire_get_uint32_t(buf + 0);
+	s->capacity = wire_get_uint64_t(buf + 4);
+	s->free_space = wire_get_uint64_t(buf + 12);
+	s->readonly = wire_get_uint8_t(buf + 20);
+	return 21;
+}
 
 #endif /* STRUCT_HELPERS__H__ */
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "tools.h"
+
 void * xmalloc (size_t what)
 {
 	void* v = malloc(what);
@@ -9,7 +11,16 @@ void * xmalloc (size_t what)
 		fprintf(stderr, "out of memory!\n");
 		exit(13);
 	}
-	memset(v, 0, what);
+	return v;
+}
+
+void * xcalloc (size_t what)
+{
+	void* v = calloc(1, what);
+	if (!v) {
+		fprintf(stderr, "out of memory!\n");
+		exit(13);
+	}
 	return v;
 }
 
@@ -1,9 +1,10 @@
 #ifndef TOOLS_H__
 #define	TOOLS_H__
 
-/* same as malloc, except zeroes out allocated memory
-and dies if allocation fails */
+/* same as malloc, except dies if allocation fails */
 void * xmalloc (size_t);
+/* same as xmalloc, except zeroes out allocated memory */
+void * xcalloc (size_t);
 /* same as realloc, except dies when fails */
 void * xrealloc (void *, size_t);
 /* same as strncpy, except sets dest[n] to zero */
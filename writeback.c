@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "common.h"
+#include "libnewtp.h"
+#include "tools.h"
+#include "writeback.h"
+
+/* bytes buffered or in flight in all files, and the part in flight */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_cond = PTHREAD_COND_INITIALIZER;
+static size_t mem_used, mem_in_flight;
+
+/* waits until n more bytes fit. only WRITEs in flight free memory by
+ * themselves, so with none in flight there is nothing to wait for */
+static void mem_acquire (size_t n)
+{
+	pthread_mutex_lock(&mem_lock);
+	while (mem_used + n > WB_MEMORY && mem_in_flight > 0)
+		pthread_cond_wait(&mem_cond, &mem_lock);
+	mem_used += n;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+static void mem_sent (size_t n)
+{
+	pthread_mutex_lock(&mem_lock);
+	mem_in_flight += n;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+static void mem_release (size_t n)
+{
+	pthread_mutex_lock(&mem_lock);
+	mem_used -= n;
+	mem_in_flight -= n;
+	pthread_cond_broadcast(&mem_cond);
+	pthread_mutex_unlock(&mem_lock);
+}
+
+void wb_init (struct writeback * wb, struct newtp_conn * conn, uint16_t handle)
+{
+	memset(wb, 0, sizeof(struct writeback));
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_mutex_init(&wb->done_lock, NULL);
+	pthread_cond_init(&wb->done, NULL);
+	wb->conn = conn;
+	wb->handle = handle;
+}
+
+/* called from the receiver thread */
+static void write_done (struct newtp_req * r, void * arg)
+{
+	struct writeback * wb = arg;
+	uint16_t len = r->cmd.length - 8, retlen = 0;
+	int res = newtp_result_to_errno(r->reply.result);
+
+	if (res == 0) {
+		if (r->reply.length < 2) res = -EIO;
+		else unpack(r->data, r->reply.length, "s", &retlen);
+		/* the server writes everything unless the device is full */
+		if (res == 0 && retlen < len) res = -ENOSPC;
+	}
+	newtp_req_free(r);
+	mem_release(len);
+
+	pthread_mutex_lock(&wb->done_lock);
+	if (res < 0 && wb->error == 0) wb->error = res;
+	wb->in_flight--;
+	pthread_cond_broadcast(&wb->done);
+	pthread_mutex_unlock(&wb->done_lock);
+}
+
+/* the functions below are called with wb->lock held */
+
+/* sends the buffered data */
+static void send_buffer (struct writeback * wb)
+{
+	size_t sent = 0;
+
+	mem_sent(wb->len);
+	while (sent < wb->len) {
+		uint16_t len = (wb->len - sent > WB_CHUNK) ? WB_CHUNK : wb->len - sent;
+		struct newtp_req * r = newtp_req_new(wb->conn, CMD_WRITE, wb->handle);
+		char * data = newtp_req_payload(r, len + 8);
+		pack(data, "l", wb->off + sent);
+		memcpy(data + 8, wb->buf + sent, len);
+		pthread_mutex_lock(&wb->done_lock);
+		wb->in_flight++;
+		pthread_mutex_unlock(&wb->done_lock);
+		/* the server applies WRITEs in the order they are sent,
+		 * so data written later wins where ranges overlap */
+		newtp_submit(r, write_done, wb);
+		sent += len;
+	}
+	wb->len = 0;
+}
+
+/* returns the first error since the last call and forgets it */
+static int take_error (struct writeback * wb)
+{
+	int res;
+	pthread_mutex_lock(&wb->done_lock);
+	res = wb->error;
+	wb->error = 0;
+	pthread_mutex_unlock(&wb->done_lock);
+	return res;
+}
+
+int wb_write (struct writeback * wb, char const * buf, size_t size, uint64_t offset)
+{
+	size_t total = 0;
+	int res;
+
+	pthread_mutex_lock(&wb->lock);
+	res = take_error(wb);
+	if (res < 0) {
+		pthread_mutex_unlock(&wb->lock);
+		return res;
+	}
+	if (!wb->buf) wb->buf = xmalloc(WB_BUFFER);
+
+	while (total < size) {
+		uint64_t pos = offset + total;
+		size_t n = size - total;
+		uint64_t start, end;
+
+		if (n > WB_BUFFER) n = WB_BUFFER;
+		/* the buffer holds one range: data elsewhere sends it first */
+		if (wb->len && (pos > wb->off + wb->len || pos + n < wb->off)) send_buffer(wb);
+		if (!wb->len) wb->off = pos;
+		start = pos < wb->off ? pos : wb->off;
+		end = pos + n > wb->off + wb->len ? pos + n : wb->off + wb->len;
+		if (end - start > WB_BUFFER) {
+			send_buffer(wb);
+			wb->off = start = pos;
+			end = pos + n;
+		}
+
+		mem_acquire(end - start - wb->len);
+		if (start < wb->off) memmove(wb->buf + (wb->off - start), wb->buf, wb->len);
+		memcpy(wb->buf + (pos - start), buf + total, n);
+		wb->off = start;
+		wb->len = end - start;
+		total += n;
+
+		if (wb->len == WB_BUFFER) send_buffer(wb);
+	}
+
+	pthread_mutex_unlock(&wb->lock);
+	return total;
+}
+
+int wb_sync (struct writeback * wb)
+{
+	pthread_mutex_lock(&wb->lock);
+	if (wb->len) send_buffer(wb);
+	/* a file that isn't being written to doesn't keep its buffer */
+	free(wb->buf);
+	wb->buf = NULL;
+
+	pthread_mutex_lock(&wb->done_lock);
+	while (wb->in_flight) pthread_cond_wait(&wb->done, &wb->done_lock);
+	pthread_mutex_unlock(&wb->done_lock);
+
+	pthread_mutex_unlock(&wb->lock);
+	return take_error(wb);
+}
+
+int wb_dirty (struct writeback * wb)
+{
+	int dirty;
+	/* WRITEs in flight are the common case, and wb_sync holds lock
+	 * while it waits for them */
+	pthread_mutex_lock(&wb->done_lock);
+	dirty = wb->in_flight > 0;
+	pthread_mutex_unlock(&wb->done_lock);
+	if (dirty) return 1;
+	pthread_mutex_lock(&wb->lock);
+	pthread_mutex_lock(&wb->done_lock);
+	dirty = wb->len > 0 || wb->in_flight > 0;
+	pthread_mutex_unlock(&wb->done_lock);
+	pthread_mutex_unlock(&wb->lock);
+	return dirty;
+}
+
+void wb_destroy (struct writeback * wb)
+{
+	wb_sync(wb);
+	pthread_mutex_destroy(&wb->lock);
+	pthread_mutex_destroy(&wb->done_lock);
+	pthread_cond_destroy(&wb->done);
+}
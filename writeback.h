@@ -0,0 +1,55 @@
+#ifndef WRITEBACK__H__
+#define WRITEBACK__H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "commands.h"
+#include "libnewtp.h"
+
+/* Write-back buffering of newfs' files.
+ *
+ * Writes to a file are collected in its buffer as long as each touches
+ * or overlaps the data already there, so small appends and rewrites
+ * become one range. The range goes out as WRITEs of WB_CHUNK bytes, all
+ * sent at once without waiting for the replies, when the buffer is full,
+ * when a write lands elsewhere, or on wb_sync. Errors of those WRITEs
+ * are returned by the next wb_write or wb_sync.
+ *
+ * Data buffered or in flight in all files together is kept around
+ * WB_MEMORY: writers wait while WRITEs in flight bring it over. */
+
+#define WB_CHUNK   (MAX_LENGTH - 8)
+#define WB_BUFFER  (16 * WB_CHUNK)
+#define WB_MEMORY  (64 * 1024 * 1024)
+
+struct writeback {
+	pthread_mutex_t lock;
+	struct newtp_conn * conn;
+	uint16_t handle;
+
+	/* len bytes to be written at off */
+	char * buf;
+	uint64_t off;
+	size_t len;
+
+	/* WRITEs sent, and the first error among them. changed from the
+	 * receiver thread under done_lock, not lock */
+	pthread_mutex_t done_lock;
+	pthread_cond_t done;
+	int in_flight;
+	int error;
+};
+
+void wb_init (struct writeback * wb, struct newtp_conn * conn, uint16_t handle);
+/* returns size or negative errno */
+int wb_write (struct writeback * wb, char const * buf, size_t size, uint64_t offset);
+/* sends the buffered data and waits for all WRITEs.
+ * returns 0 or negative errno */
+int wb_sync (struct writeback * wb);
+/* whether data is buffered or WRITEs are in flight */
+int wb_dirty (struct writeback * wb);
+void wb_destroy (struct writeback * wb);
+
+#endif